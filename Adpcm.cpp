@@ -0,0 +1,153 @@
+/** @file Adpcm.cpp */
+
+#include "Adpcm.h"
+
+const int Adpcm::step_table[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+const int Adpcm::index_table[8] =
+{
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+const int Adpcm::max_channels;
+
+/**
+* @brief Compresses samples.
+* @param samples The samples (channels interleaved).
+* @param nb_samples Number of samples (of all channels).
+* @param nb_channels 1 or 2.
+* @param encoded Receives the compressed samples: (nb_samples + 1) / 2 bytes.
+*/
+void Adpcm::encode(const int16_t* samples, size_t nb_samples, int nb_channels, std::vector<char>& encoded)
+{
+	State states[max_channels] = { { 0, 0 }, { 0, 0 } };
+	encoded.assign((nb_samples + 1) / 2, 0);
+
+	for(size_t i = 0; i < nb_samples; i++)
+	{
+		int nibble = encode_sample(states[i % nb_channels], samples[i]);
+		encoded[i / 2] |= char(nibble << ((i % 2) * 4));
+	}
+}
+
+/**
+* @brief Decompresses samples.
+* @param encoded The samples compressed by encode().
+* @param nb_samples Number of samples (of all channels).
+* @param nb_channels 1 or 2.
+* @param samples Receives the nb_samples samples.
+*/
+void Adpcm::decode(const char* encoded, size_t nb_samples, int nb_channels, int16_t* samples)
+{
+	State states[max_channels] = { { 0, 0 }, { 0, 0 } };
+
+	for(size_t i = 0; i < nb_samples; i++)
+	{
+		int nibble = (uint8_t(encoded[i / 2]) >> ((i % 2) * 4)) & 0x0F;
+		samples[i] = int16_t(decode_sample(states[i % nb_channels], nibble));
+	}
+}
+
+/**
+* @brief Quantizes the difference between a sample and the prediction.
+*
+* The state is updated as the decoder will do, so that errors do not accumulate.
+*
+* @param state State of the channel.
+* @param sample The sample to code.
+* @return The 4-bit code.
+*/
+int Adpcm::encode_sample(State& state, int sample)
+{
+	int step = step_table[state.step_index];
+	int difference = sample - state.predictor;
+	int nibble = 0;
+	if(difference < 0)
+	{
+		nibble = 8;
+		difference = -difference;
+	}
+
+	if(difference >= step)
+	{
+		nibble |= 4;
+		difference -= step;
+	}
+	step >>= 1;
+	if(difference >= step)
+	{
+		nibble |= 2;
+		difference -= step;
+	}
+	step >>= 1;
+	if(difference >= step)
+	{
+		nibble |= 1;
+	}
+
+	decode_sample(state, nibble);
+	return nibble;
+}
+
+/**
+* @brief Reconstructs a sample.
+* @param state State of the channel.
+* @param nibble The 4-bit code.
+* @return The sample.
+*/
+int Adpcm::decode_sample(State& state, int nibble)
+{
+	int step = step_table[state.step_index];
+	int difference = step >> 3;
+	if(nibble & 4)
+	{
+		difference += step;
+	}
+	if(nibble & 2)
+	{
+		difference += step >> 1;
+	}
+	if(nibble & 1)
+	{
+		difference += step >> 2;
+	}
+
+	if(nibble & 8)
+	{
+		state.predictor -= difference;
+	}
+	else
+	{
+		state.predictor += difference;
+	}
+	if(state.predictor > 32767)
+	{
+		state.predictor = 32767;
+	}
+	else if(state.predictor < -32768)
+	{
+		state.predictor = -32768;
+	}
+
+	state.step_index += index_table[nibble & 7];
+	if(state.step_index < 0)
+	{
+		state.step_index = 0;
+	}
+	else if(state.step_index > 88)
+	{
+		state.step_index = 88;
+	}
+	return state.predictor;
+}
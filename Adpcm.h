@@ -0,0 +1,50 @@
+/** @file Adpcm.h */
+
+#ifndef KQ_ADPCM_H
+#define KQ_ADPCM_H
+
+#include "Common.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+* @brief IMA-ADPCM compression of 16-bit samples.
+*
+* Each sample is stored on 4 bits: a sound takes four times less memory
+* than as raw samples, and decoding it is much cheaper than decoding Ogg
+* Vorbis. The quality is lower, which is fine for short effects.
+*
+* Interleaved channels are coded independently, two samples per byte
+* (the first one in the low bits).
+*/
+class Adpcm
+{
+public:
+
+	static void encode(const int16_t* samples, size_t nb_samples, int nb_channels, std::vector<char>& encoded);
+	static void decode(const char* encoded, size_t nb_samples, int nb_channels, int16_t* samples);
+
+private:
+
+	// we don't need to instantiate this class
+	Adpcm();
+
+	/**
+	* @brief Coder state of a channel.
+	*/
+	struct State
+	{
+		int predictor;		/**< last sample reconstructed */
+		int step_index;		/**< position in step_table */
+	};
+
+	static int encode_sample(State& state, int sample);
+	static int decode_sample(State& state, int nibble);
+
+	static const int step_table[89];	/**< quantization steps */
+	static const int index_table[8];	/**< step index change for each magnitude */
+	static const int max_channels = 2;	/**< number of channels supported */
+};
+
+#endif
@@ -2,10 +2,18 @@
 
 #include "LuaContext.h"
 #include "Sound.h"
+#include "Music.h"
 #include "lua.hpp"
 
 const std::string LuaContext::audio_module_name = "kq.audio";
 
+static const std::string storage_class_names[] = {
+    "pcm",
+    "vorbis",
+    "adpcm",
+    "" // Sentinel.
+};
+
 /** @brief Initializes the audio features provided to Lua */
 
 void LuaContext::register_audio_module()
@@ -14,12 +22,22 @@ void LuaContext::register_audio_module()
 	{
 		{ "play_sound", audio_api_play_sound },
         { "preload_sounds", audio_api_preload_sounds },
-        //{ "play_music", audio_api_play_music },
-        //{ "stop_music", audio_api_stop_music },
+        { "get_preload_progress", audio_api_get_preload_progress },
+        { "get_sound_priority", audio_api_get_sound_priority },
+        { "set_sound_priority", audio_api_set_sound_priority },
+        { "is_sound_pinned", audio_api_is_sound_pinned },
+        { "set_sound_pinned", audio_api_set_sound_pinned },
+        { "get_sound_memory", audio_api_get_sound_memory },
+        { "set_sound_memory_budget", audio_api_set_sound_memory_budget },
+        { "get_sound_storage", audio_api_get_sound_storage },
+        { "set_sound_storage", audio_api_set_sound_storage },
+        { "get_stats", audio_api_get_stats },
+        { "play_music", audio_api_play_music },
+        { "stop_music", audio_api_stop_music },
         //{ "get_sound_volume", audio_api_get_sound_volume },
         //{ "set_sound_volume", audio_api_set_sound_volume },
-        //{ "get_music_volume", audio_api_get_music_volume },
-        //{ "set_music_volume", audio_api_set_music_volume },
+        { "get_music_volume", audio_api_get_music_volume },
+        { "set_music_volume", audio_api_set_music_volume },
         { NULL, NULL }
 	};
 	register_functions(audio_module_name, functions);
@@ -46,11 +64,306 @@ int LuaContext::audio_api_play_sound(lua_State* l)
 
 /**
 * @brief Implementation of kq.audio.preload_sounds().
-* @param l the Lua context that is calling this function
+*
+* The sounds are loaded in the background: see kq.audio.get_preload_progress().
+*
 * @return number of values to return to Lua
 */
-int LuaContext::audio_api_preload_sounds(lua_State* l) 
+int LuaContext::audio_api_preload_sounds(lua_State* /* l */) 
 {
 	Sound::load_all();
 	return 0;
-}
\ No newline at end of file
+}
+
+/**
+* @brief Implementation of kq.audio.get_preload_progress().
+*
+* Returns the number of sounds loaded so far by kq.audio.preload_sounds()
+* and the total number of sounds to load.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_get_preload_progress(lua_State* l) 
+{
+  int nb_done, nb_total;
+  Sound::get_preload_progress(nb_done, nb_total);
+
+  lua_pushinteger(l, nb_done);
+  lua_pushinteger(l, nb_total);
+  return 2;
+}
+
+/**
+* @brief Implementation of kq.audio.get_sound_priority().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_get_sound_priority(lua_State* l) 
+{
+  const std::string& sound_id = luaL_checkstring(l, 1);
+
+  lua_pushinteger(l, Sound::get_priority(sound_id));
+  return 1;
+}
+
+/**
+* @brief Implementation of kq.audio.set_sound_priority().
+*
+* When too many sounds play at the same time, a new sound interrupts
+* one of the same or a lower priority.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_set_sound_priority(lua_State* l) 
+{
+  const std::string& sound_id = luaL_checkstring(l, 1);
+  int priority = luaL_checkint(l, 2);
+
+  if (!Sound::exists(sound_id)) 
+  {
+	  std::string error_msg = "Cannot find sound " + sound_id + "\n";
+      luaL_error(l, error_msg.c_str());
+  }
+
+  Sound::set_priority(sound_id, priority);
+  return 0;
+}
+
+/**
+* @brief Implementation of kq.audio.is_sound_pinned().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_is_sound_pinned(lua_State* l) 
+{
+  const std::string& sound_id = luaL_checkstring(l, 1);
+
+  lua_pushboolean(l, Sound::is_pinned(sound_id));
+  return 1;
+}
+
+/**
+* @brief Implementation of kq.audio.set_sound_pinned().
+*
+* A pinned sound is loaded immediately and stays in memory whatever
+* the memory budget.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_set_sound_pinned(lua_State* l) 
+{
+  const std::string& sound_id = luaL_checkstring(l, 1);
+  bool pinned = lua_isnone(l, 2) || lua_toboolean(l, 2);
+
+  if (!Sound::exists(sound_id)) 
+  {
+	  std::string error_msg = "Cannot find sound " + sound_id + "\n";
+      luaL_error(l, error_msg.c_str());
+  }
+
+  Sound::set_pinned(sound_id, pinned);
+  return 0;
+}
+
+/**
+* @brief Implementation of kq.audio.get_sound_memory().
+*
+* Returns the size of the decoded sounds in memory and the memory budget
+* (0 if there is no limit), both in bytes.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_get_sound_memory(lua_State* l) 
+{
+  lua_pushinteger(l, lua_Integer(Sound::get_resident_bytes()));
+  lua_pushinteger(l, lua_Integer(Sound::get_memory_budget()));
+  return 2;
+}
+
+/**
+* @brief Implementation of kq.audio.set_sound_memory_budget().
+*
+* Sounds that are not playing and not pinned are unloaded, least recently
+* used first, until the decoded sounds fit in the budget.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_set_sound_memory_budget(lua_State* l) 
+{
+  int budget = luaL_checkint(l, 1);
+
+  if (budget < 0) 
+  {
+    luaL_argerror(l, 1, "The budget must be positive or zero");
+  }
+
+  Sound::set_memory_budget(size_t(budget));
+  return 0;
+}
+
+/**
+* @brief Implementation of kq.audio.play_music().
+*
+* The music is streamed in the background: this function does not wait
+* for the file to be loaded.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_play_music(lua_State* l) 
+{
+  const std::string& music_id = luaL_optstring(l, 1, Music::none.c_str());
+
+  if (!Music::exists(music_id)) 
+  {
+	  std::string error_msg = "Cannot find music " + music_id + "\n";
+      luaL_error(l, error_msg.c_str());
+  }
+
+  Music::play(music_id);
+  return 0;
+}
+
+/**
+* @brief Implementation of kq.audio.stop_music().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_stop_music(lua_State* /* l */) 
+{
+  Music::stop();
+  return 0;
+}
+
+/**
+* @brief Implementation of kq.audio.get_music_volume().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_get_music_volume(lua_State* l) 
+{
+  lua_pushinteger(l, Music::get_volume());
+  return 1;
+}
+
+/**
+* @brief Implementation of kq.audio.set_music_volume().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_set_music_volume(lua_State* l) 
+{
+  int volume = luaL_checkint(l, 1);
+
+  Music::set_volume(volume);
+  return 0;
+}
+
+/**
+* @brief Implementation of kq.audio.get_sound_storage().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_get_sound_storage(lua_State* l) 
+{
+  const std::string& sound_id = luaL_checkstring(l, 1);
+
+  Sound::StorageClass storage = Sound::get_storage_class(sound_id);
+  push_string(l, storage_class_names[storage]);
+  return 1;
+}
+
+/**
+* @brief Implementation of kq.audio.set_sound_storage().
+*
+* The first parameter is a sound id, or a directory of sounds ending with '/'
+* to set the storage of a group of sounds. The storage is "pcm" (the default),
+* "vorbis" or "adpcm": compressed sounds take less memory but are decoded
+* each time they play.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_set_sound_storage(lua_State* l) 
+{
+  const std::string& sound_or_group_id = luaL_checkstring(l, 1);
+  Sound::StorageClass storage = check_enum<Sound::StorageClass>(l, 2, storage_class_names);
+
+  Sound::set_storage_class(sound_or_group_id, storage);
+  return 0;
+}
+
+/**
+* @brief Implementation of kq.audio.get_stats().
+*
+* Returns a table of counters of the audio system, to diagnose audio hitches.
+* Times are in milliseconds. The field decode_times maps the id of each
+* sound decoded so far to the total time spent decoding it.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::audio_api_get_stats(lua_State* l) 
+{
+  Sound::Stats stats;
+  Sound::get_stats(stats);
+  int nb_preloads_done, nb_preloads;
+  Sound::get_preload_progress(nb_preloads_done, nb_preloads);
+
+  lua_newtable(l);
+  lua_pushinteger(l, stats.nb_decodes);
+  lua_setfield(l, -2, "nb_decodes");
+  lua_pushnumber(l, stats.decode_time / 1000000.0);
+  lua_setfield(l, -2, "decode_time");
+  lua_pushnumber(l, stats.max_decode_time / 1000000.0);
+  lua_setfield(l, -2, "max_decode_time");
+  push_string(l, stats.slowest_sound);
+  lua_setfield(l, -2, "slowest_sound");
+  lua_pushnumber(l, lua_Number(stats.bytes_decoded));
+  lua_setfield(l, -2, "bytes_decoded");
+  lua_pushinteger(l, stats.nb_voices);
+  lua_setfield(l, -2, "nb_voices");
+  lua_pushinteger(l, stats.nb_active_voices);
+  lua_setfield(l, -2, "nb_active_voices");
+  lua_pushinteger(l, stats.nb_voice_steals);
+  lua_setfield(l, -2, "nb_voice_steals");
+  lua_pushinteger(l, stats.nb_voice_failures);
+  lua_setfield(l, -2, "nb_voice_failures");
+  lua_pushinteger(l, stats.nb_updates);
+  lua_setfield(l, -2, "nb_updates");
+  lua_pushnumber(l, stats.update_time / 1000000.0);
+  lua_setfield(l, -2, "update_time");
+  lua_pushnumber(l, stats.max_update_time / 1000000.0);
+  lua_setfield(l, -2, "max_update_time");
+  lua_pushnumber(l, lua_Number(stats.resident_bytes));
+  lua_setfield(l, -2, "resident_bytes");
+  lua_pushinteger(l, stats.nb_evictions);
+  lua_setfield(l, -2, "nb_evictions");
+  lua_pushinteger(l, nb_preloads_done);
+  lua_setfield(l, -2, "nb_preloads_done");
+  lua_pushinteger(l, nb_preloads);
+  lua_setfield(l, -2, "nb_preloads");
+  lua_pushinteger(l, Music::get_nb_buffer_refills());
+  lua_setfield(l, -2, "nb_music_refills");
+  lua_pushinteger(l, Music::get_nb_underruns());
+  lua_setfield(l, -2, "nb_music_underruns");
+  lua_pushnumber(l, Music::get_update_time() / 1000000.0);
+  lua_setfield(l, -2, "music_update_time");
+
+  std::map<std::string, uint64_t> decode_times;
+  Sound::get_decode_times(decode_times);
+  lua_newtable(l);
+  std::map<std::string, uint64_t>::const_iterator it;
+  for (it = decode_times.begin(); it != decode_times.end(); ++it) 
+  {
+    lua_pushnumber(l, it->second / 1000000.0);
+    lua_setfield(l, -2, it->first.c_str());
+  }
+  lua_setfield(l, -2, "decode_times");
+  return 1;
+}
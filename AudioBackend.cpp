@@ -0,0 +1,583 @@
+/** @file AudioBackend.cpp */
+
+#include "AudioBackend.h"
+#include "System.h"
+#include <iostream>
+#include <algorithm>
+
+/**
+* @brief Destructor.
+*/
+AudioBackend::~AudioBackend()
+{
+}
+
+/**
+* @brief Creates the OpenAL backend. Call open() to use the device.
+*/
+OpenALBackend::OpenALBackend():
+	device(NULL),
+	context(NULL)
+{
+}
+
+/**
+* @brief Opens the default sound device and activates an OpenAL context.
+* @return false if there is no usable device.
+*/
+bool OpenALBackend::open()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	device = alcOpenDevice(NULL);
+	if(!device)
+	{
+		std::cout << "Error:  could not open audio device\n";
+		return false;
+	}
+	ALCint attr[] = {ALC_FREQUENCY, 32000, 0};
+	context = alcCreateContext(device, attr);
+	if(!context)
+	{
+		std::cout << "Error:  could not create audio context\n";
+		alcCloseDevice(device);
+		device = NULL;
+		return false;
+	}
+	if(!alcMakeContextCurrent(context))
+	{
+		std::cout << "Cannot activate audio context\n";
+		alcDestroyContext(context);
+		alcCloseDevice(device);
+		context = NULL;
+		device = NULL;
+		return false;
+	}
+
+	alGenBuffers(0, AL_NONE);  // Necessary on some systems to avoid errors with the first sound loaded
+	return true;
+}
+
+/**
+* @brief Releases the OpenAL context and the device.
+*/
+void OpenALBackend::close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alcMakeContextCurrent(NULL);
+	alcDestroyContext(context);
+	context = NULL;
+	alcCloseDevice(device);
+	device = NULL;
+}
+
+/**
+* @brief Does nothing: OpenAL plays in its own thread.
+*/
+void OpenALBackend::update()
+{
+}
+
+/**
+* @brief Creates an OpenAL source.
+* @return The source, or AL_NONE if the implementation has no more sources.
+*/
+ALuint OpenALBackend::create_source()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALuint source = AL_NONE;
+	alGetError();
+	alGenSources(1, &source);
+	if(alGetError() != AL_NO_ERROR)
+	{
+		return AL_NONE;
+	}
+	return source;
+}
+
+/**
+* @brief Deletes an OpenAL source.
+* @param source The source.
+*/
+void OpenALBackend::delete_source(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alDeleteSources(1, &source);
+}
+
+/**
+* @brief Creates an empty OpenAL buffer.
+* @return The buffer.
+*/
+ALuint OpenALBackend::create_buffer()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALuint buffer = AL_NONE;
+	alGenBuffers(1, &buffer);
+	return buffer;
+}
+
+/**
+* @brief Deletes an OpenAL buffer.
+* @param buffer The buffer.
+*/
+void OpenALBackend::delete_buffer(ALuint buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alDeleteBuffers(1, &buffer);
+}
+
+/**
+* @brief Copies samples into an OpenAL buffer.
+* @param buffer The buffer.
+* @param format AL_FORMAT_MONO16 or AL_FORMAT_STEREO16.
+* @param data The samples.
+* @param size Size of the samples in bytes.
+* @param sample_rate Number of frames per second.
+* @return false in case of error.
+*/
+bool OpenALBackend::set_buffer_data(ALuint buffer, ALenum format, const void* data, size_t size, ALsizei sample_rate)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alGetError();
+	alBufferData(buffer, format, data, ALsizei(size), sample_rate);
+	return alGetError() == AL_NO_ERROR;
+}
+
+bool OpenALBackend::set_source_buffer(ALuint source, ALuint buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alGetError();
+	alSourcei(source, AL_BUFFER, buffer);
+	return alGetError() == AL_NO_ERROR;
+}
+
+void OpenALBackend::queue_buffer(ALuint source, ALuint buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alSourceQueueBuffers(source, 1, &buffer);
+}
+
+ALuint OpenALBackend::unqueue_buffer(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALuint buffer = AL_NONE;
+	alSourceUnqueueBuffers(source, 1, &buffer);
+	return buffer;
+}
+
+int OpenALBackend::get_nb_queued_buffers(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALint nb_queued = 0;
+	alGetSourcei(source, AL_BUFFERS_QUEUED, &nb_queued);
+	return nb_queued;
+}
+
+int OpenALBackend::get_nb_processed_buffers(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALint nb_processed = 0;
+	alGetSourcei(source, AL_BUFFERS_PROCESSED, &nb_processed);
+	return nb_processed;
+}
+
+bool OpenALBackend::play(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alGetError();
+	alSourcePlay(source);
+	return alGetError() == AL_NO_ERROR;
+}
+
+void OpenALBackend::pause(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alSourcePause(source);
+}
+
+void OpenALBackend::stop(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alSourceStop(source);
+}
+
+bool OpenALBackend::is_playing(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALint status;
+	alGetSourcei(source, AL_SOURCE_STATE, &status);
+	return status == AL_PLAYING;
+}
+
+void OpenALBackend::set_gain(ALuint source, float gain)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	alSourcef(source, AL_GAIN, gain);
+}
+
+float OpenALBackend::get_gain(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALfloat gain = 0.0f;
+	alGetSourcef(source, AL_GAIN, &gain);
+	return gain;
+}
+
+/**
+* @brief Creates the software mixer. Call open() to start mixing.
+* @param wav_file_name File where the mixed audio is written,
+* or an empty string to discard it.
+*/
+MixerBackend::MixerBackend(const std::string& wav_file_name):
+	next_handle(1),
+	last_mix_date(0),
+	nb_frames_mixed(0),
+	mix_buffer(chunk_frames * 2),
+	output(chunk_frames * 2),
+	wav_file_name(wav_file_name)
+{
+}
+
+/**
+* @brief Starts mixing from the current System date.
+* @return false if the WAV file cannot be created.
+*/
+bool MixerBackend::open()
+{
+	if(!wav_file_name.empty())
+	{
+		wav_file.open(wav_file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if(!wav_file.is_open())
+		{
+			std::cerr << "Cannot create audio output file '" << wav_file_name << "'\n";
+			return false;
+		}
+		write_wav_header();
+	}
+
+	last_mix_date = System::now_ns();
+	nb_frames_mixed = 0;
+	return true;
+}
+
+/**
+* @brief Stops mixing and completes the WAV file if any.
+*/
+void MixerBackend::close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(wav_file.is_open())
+	{
+		// now that the size is known, rewrite the header
+		wav_file.seekp(0);
+		write_wav_header();
+		wav_file.close();
+	}
+	sources.clear();
+	buffers.clear();
+}
+
+/**
+* @brief Writes a little-endian integer.
+* @param file The file to write.
+* @param value The value.
+* @param nb_bytes Size of the value in bytes.
+*/
+static void write_le(std::ofstream& file, uint32_t value, int nb_bytes)
+{
+	for(int i = 0; i < nb_bytes; i++)
+	{
+		file.put(char((value >> (8 * i)) & 0xFF));
+	}
+}
+
+/**
+* @brief Writes the header of a 16-bit stereo WAV file of the frames mixed so far.
+*/
+void MixerBackend::write_wav_header()
+{
+	uint32_t data_size = uint32_t(nb_frames_mixed * 4);
+	wav_file.write("RIFF", 4);
+	write_le(wav_file, 36 + data_size, 4);
+	wav_file.write("WAVEfmt ", 8);
+	write_le(wav_file, 16, 4);					// size of the fmt chunk
+	write_le(wav_file, 1, 2);					// PCM
+	write_le(wav_file, 2, 2);					// channels
+	write_le(wav_file, output_rate, 4);
+	write_le(wav_file, output_rate * 4, 4);		// bytes per second
+	write_le(wav_file, 4, 2);					// bytes per frame
+	write_le(wav_file, 16, 2);					// bits per sample
+	wav_file.write("data", 4);
+	write_le(wav_file, data_size, 4);
+}
+
+/**
+* @brief Mixes the frames of the time elapsed since the previous call.
+*/
+void MixerBackend::update()
+{
+	uint64_t now = System::now_ns();
+	if(now <= last_mix_date)
+	{
+		return;
+	}
+
+	// date of the next frame to mix, so that rounding errors do not accumulate
+	uint64_t nb_frames_due = (now - last_mix_date) * output_rate / 1000000000;
+	if(nb_frames_due == 0)
+	{
+		return;
+	}
+	last_mix_date += nb_frames_due * 1000000000 / output_rate;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	while(nb_frames_due > 0)
+	{
+		int nb_frames = int(std::min<uint64_t>(nb_frames_due, chunk_frames));
+		mix(nb_frames);
+		nb_frames_due -= nb_frames;
+	}
+}
+
+/**
+* @brief Mixes all playing sources into the output.
+* @param nb_frames Number of frames to mix (at most chunk_frames).
+*/
+void MixerBackend::mix(int nb_frames)
+{
+	std::fill(mix_buffer.begin(), mix_buffer.begin() + nb_frames * 2, 0.0f);
+
+	std::map<ALuint, Source>::iterator it;
+	for(it = sources.begin(); it != sources.end(); ++it)
+	{
+		if(it->second.state == Source::PLAYING)
+		{
+			mix_source(it->second, nb_frames);
+		}
+	}
+
+	for(int i = 0; i < nb_frames * 2; i++)
+	{
+		float sample = std::max(-32768.0f, std::min(32767.0f, mix_buffer[i]));
+		output[i] = int16_t(sample);
+	}
+	if(wav_file.is_open())
+	{
+		wav_file.write((const char*) &output[0], nb_frames * 4);
+	}
+	nb_frames_mixed += nb_frames;
+}
+
+/**
+* @brief Adds the next frames of a source to the mix and advances it.
+*
+* The source stops when all its buffers are processed.
+*
+* @param source A playing source.
+* @param nb_frames Number of frames to mix.
+*/
+void MixerBackend::mix_source(Source& source, int nb_frames)
+{
+	int frame = 0;
+	while(frame < nb_frames)
+	{
+		if(source.current >= source.queue.size())
+		{
+			source.state = Source::STOPPED;
+			return;
+		}
+
+		std::map<ALuint, Buffer>::const_iterator it = buffers.find(source.queue[source.current]);
+		if(it == buffers.end())
+		{
+			// deleted while queued: skip it
+			source.current++;
+			continue;
+		}
+		const Buffer& buffer = it->second;
+		size_t buffer_frames = buffer.samples.size() / buffer.nb_channels;
+		uint64_t step = (uint64_t(buffer.sample_rate) << 16) / output_rate;
+		for(; frame < nb_frames; frame++)
+		{
+			size_t index = size_t(source.position >> 16);
+			if(index >= buffer_frames)
+			{
+				break;
+			}
+			const int16_t* samples = &buffer.samples[index * buffer.nb_channels];
+			mix_buffer[frame * 2] += samples[0] * source.gain;
+			mix_buffer[frame * 2 + 1] += samples[buffer.nb_channels - 1] * source.gain;
+			source.position += step;
+		}
+
+		if(frame < nb_frames)
+		{
+			// end of this buffer: continue with the next one
+			source.position -= std::min<uint64_t>(source.position, uint64_t(buffer_frames) << 16);
+			source.current++;
+		}
+	}
+}
+
+/**
+* @brief Returns the number of frames mixed since the output was opened.
+* @return The duration of the output in 1/44100 s.
+*/
+uint64_t MixerBackend::get_nb_frames_mixed() const
+{
+	return nb_frames_mixed;
+}
+
+ALuint MixerBackend::create_source()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALuint handle = next_handle++;
+	Source& source = sources[handle];
+	source.state = Source::INITIAL;
+	source.gain = 1.0f;
+	source.current = 0;
+	source.position = 0;
+	return handle;
+}
+
+void MixerBackend::delete_source(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	sources.erase(source);
+}
+
+ALuint MixerBackend::create_buffer()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ALuint handle = next_handle++;
+	Buffer& buffer = buffers[handle];
+	buffer.nb_channels = 1;
+	buffer.sample_rate = output_rate;
+	return handle;
+}
+
+void MixerBackend::delete_buffer(ALuint buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	buffers.erase(buffer);
+}
+
+bool MixerBackend::set_buffer_data(ALuint buffer, ALenum format, const void* data, size_t size, ALsizei sample_rate)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<ALuint, Buffer>::iterator it = buffers.find(buffer);
+	if(it == buffers.end() || sample_rate <= 0
+		|| (format != AL_FORMAT_MONO16 && format != AL_FORMAT_STEREO16))
+	{
+		return false;
+	}
+
+	Buffer& target = it->second;
+	target.nb_channels = (format == AL_FORMAT_STEREO16) ? 2 : 1;
+	target.sample_rate = sample_rate;
+	const int16_t* samples = (const int16_t*) data;
+	target.samples.assign(samples, samples + size / (2 * target.nb_channels) * target.nb_channels);
+	return true;
+}
+
+bool MixerBackend::set_source_buffer(ALuint source, ALuint buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(buffer != AL_NONE && buffers.find(buffer) == buffers.end())
+	{
+		return false;
+	}
+
+	Source& target = sources[source];
+	target.queue.clear();
+	if(buffer != AL_NONE)
+	{
+		target.queue.push_back(buffer);
+	}
+	target.current = 0;
+	target.position = 0;
+	return true;
+}
+
+void MixerBackend::queue_buffer(ALuint source, ALuint buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	sources[source].queue.push_back(buffer);
+}
+
+ALuint MixerBackend::unqueue_buffer(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Source& target = sources[source];
+	if(target.current == 0 || target.queue.empty())
+	{
+		return AL_NONE;
+	}
+	ALuint buffer = target.queue.front();
+	target.queue.erase(target.queue.begin());
+	target.current--;
+	return buffer;
+}
+
+int MixerBackend::get_nb_queued_buffers(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return int(sources[source].queue.size());
+}
+
+int MixerBackend::get_nb_processed_buffers(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Source& target = sources[source];
+	return int(std::min(target.current, target.queue.size()));
+}
+
+bool MixerBackend::play(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Source& target = sources[source];
+	if(target.state == Source::INITIAL || target.state == Source::STOPPED)
+	{
+		// like OpenAL, replay the whole queue
+		target.current = 0;
+		target.position = 0;
+	}
+	target.state = Source::PLAYING;
+	return true;
+}
+
+void MixerBackend::pause(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Source& target = sources[source];
+	if(target.state == Source::PLAYING)
+	{
+		target.state = Source::PAUSED;
+	}
+}
+
+void MixerBackend::stop(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Source& target = sources[source];
+	target.state = Source::STOPPED;
+	target.current = target.queue.size();
+}
+
+bool MixerBackend::is_playing(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return sources[source].state == Source::PLAYING;
+}
+
+void MixerBackend::set_gain(ALuint source, float gain)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	sources[source].gain = gain;
+}
+
+float MixerBackend::get_gain(ALuint source)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return sources[source].gain;
+}
@@ -0,0 +1,204 @@
+/** @file AudioBackend.h */
+
+#ifndef KQ_AUDIO_BACKEND_H
+#define KQ_AUDIO_BACKEND_H
+
+#include "Common.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <cstdint>
+#include "al.h"
+#include "alc.h"
+
+/**
+* @brief Abstract output of the audio system.
+*
+* Sound and Music create their sources and buffers through this interface
+* instead of calling OpenAL directly, so that the audio system also runs
+* on machines without a sound device.
+* Sources and buffers are identified by ALuint handles, AL_NONE meaning no object.
+* Formats are AL_FORMAT_MONO16 or AL_FORMAT_STEREO16.
+*
+* Implementations must be usable from the main thread and from the music
+* thread at the same time.
+*/
+class AudioBackend
+{
+public:
+	virtual ~AudioBackend();
+
+	/**
+	* @brief Opens the output.
+	* @return false if the output is not available.
+	*/
+	virtual bool open() = 0;
+
+	/**
+	* @brief Closes the output. All sources and buffers must have been deleted.
+	*/
+	virtual void close() = 0;
+
+	/**
+	* @brief Called once per cycle by the main thread.
+	*/
+	virtual void update() = 0;
+
+	virtual ALuint create_source() = 0;
+	virtual void delete_source(ALuint source) = 0;
+	virtual ALuint create_buffer() = 0;
+	virtual void delete_buffer(ALuint buffer) = 0;
+	virtual bool set_buffer_data(ALuint buffer, ALenum format, const void* data, size_t size, ALsizei sample_rate) = 0;
+
+	/**
+	* @brief Attaches a single buffer to a source, replacing its queue.
+	* @param source A stopped source.
+	* @param buffer The buffer to play, or AL_NONE to detach all buffers.
+	* @return false in case of error.
+	*/
+	virtual bool set_source_buffer(ALuint source, ALuint buffer) = 0;
+
+	virtual void queue_buffer(ALuint source, ALuint buffer) = 0;
+	virtual ALuint unqueue_buffer(ALuint source) = 0;
+	virtual int get_nb_queued_buffers(ALuint source) = 0;
+	virtual int get_nb_processed_buffers(ALuint source) = 0;
+
+	virtual bool play(ALuint source) = 0;
+	virtual void pause(ALuint source) = 0;
+	virtual void stop(ALuint source) = 0;
+	virtual bool is_playing(ALuint source) = 0;
+	virtual void set_gain(ALuint source, float gain) = 0;
+	virtual float get_gain(ALuint source) = 0;
+};
+
+/**
+* @brief Plays the audio on the sound device with OpenAL.
+*/
+class OpenALBackend: public AudioBackend
+{
+public:
+	OpenALBackend();
+
+	bool open();
+	void close();
+	void update();
+
+	ALuint create_source();
+	void delete_source(ALuint source);
+	ALuint create_buffer();
+	void delete_buffer(ALuint buffer);
+	bool set_buffer_data(ALuint buffer, ALenum format, const void* data, size_t size, ALsizei sample_rate);
+	bool set_source_buffer(ALuint source, ALuint buffer);
+	void queue_buffer(ALuint source, ALuint buffer);
+	ALuint unqueue_buffer(ALuint source);
+	int get_nb_queued_buffers(ALuint source);
+	int get_nb_processed_buffers(ALuint source);
+	bool play(ALuint source);
+	void pause(ALuint source);
+	void stop(ALuint source);
+	bool is_playing(ALuint source);
+	void set_gain(ALuint source, float gain);
+	float get_gain(ALuint source);
+
+private:
+	ALCdevice* device;		/**< The sound device. */
+	ALCcontext* context;	/**< The OpenAL context. */
+	std::mutex mutex;		/**< Serializes the OpenAL calls of the main and music threads:
+							 * the error state of alGetError() is shared by the context. */
+};
+
+/**
+* @brief Mixes the audio in software, without any sound device.
+*
+* The voices are mixed into a 44100 Hz stereo stream that is either
+* discarded or written to a WAV file. update() mixes the time elapsed on
+* the System clock since the previous cycle: at the real rate normally,
+* and at the virtual rate with -virtual-clock. Decoding, mixing and
+* voice management thus cost the same as with a device, which makes
+* them visible in headless benchmarks and replays.
+*
+* Resampling is nearest-neighbour: this backend measures, it is not meant
+* to be listened to carefully.
+*/
+class MixerBackend: public AudioBackend
+{
+public:
+	explicit MixerBackend(const std::string& wav_file_name = "");
+
+	bool open();
+	void close();
+	void update();
+
+	ALuint create_source();
+	void delete_source(ALuint source);
+	ALuint create_buffer();
+	void delete_buffer(ALuint buffer);
+	bool set_buffer_data(ALuint buffer, ALenum format, const void* data, size_t size, ALsizei sample_rate);
+	bool set_source_buffer(ALuint source, ALuint buffer);
+	void queue_buffer(ALuint source, ALuint buffer);
+	ALuint unqueue_buffer(ALuint source);
+	int get_nb_queued_buffers(ALuint source);
+	int get_nb_processed_buffers(ALuint source);
+	bool play(ALuint source);
+	void pause(ALuint source);
+	void stop(ALuint source);
+	bool is_playing(ALuint source);
+	void set_gain(ALuint source, float gain);
+	float get_gain(ALuint source);
+
+	uint64_t get_nb_frames_mixed() const;
+
+private:
+
+	/**
+	* @brief Samples of a buffer.
+	*/
+	struct Buffer
+	{
+		int nb_channels;					/**< 1 or 2 */
+		ALsizei sample_rate;				/**< Number of frames per second. */
+		std::vector<int16_t> samples;		/**< Interleaved samples. */
+	};
+
+	/**
+	* @brief A voice and its queue of buffers.
+	*/
+	struct Source
+	{
+		enum State
+		{
+			INITIAL,
+			PLAYING,
+			PAUSED,
+			STOPPED
+		};
+
+		State state;
+		float gain;
+		std::vector<ALuint> queue;			/**< Buffers attached, the processed ones first. */
+		size_t current;						/**< Index in queue of the buffer playing. */
+		uint64_t position;					/**< Position in the current buffer, in frames (16.16 fixed point). */
+	};
+
+	void mix(int nb_frames);
+	void mix_source(Source& source, int nb_frames);
+	void write_wav_header();
+
+	static const int output_rate = 44100;	/**< Frames per second of the output. */
+	static const int chunk_frames = 1024;	/**< Maximum number of frames mixed at once. */
+
+	std::mutex mutex;						/**< Protects everything below. */
+	std::map<ALuint, Buffer> buffers;		/**< All buffers created. */
+	std::map<ALuint, Source> sources;		/**< All sources created. */
+	ALuint next_handle;						/**< Handle of the next object created. */
+	uint64_t last_mix_date;					/**< System date of the last update() in nanoseconds. */
+	uint64_t nb_frames_mixed;				/**< Frames mixed since open(). */
+	std::vector<float> mix_buffer;			/**< Mixed frames before conversion. */
+	std::vector<int16_t> output;			/**< Mixed frames converted to 16 bits. */
+	std::string wav_file_name;				/**< File to write, or an empty string to discard the output. */
+	std::ofstream wav_file;					/**< The WAV file being written. */
+};
+
+#endif
@@ -0,0 +1,105 @@
+/** @file Clock.cpp */
+
+#include "Clock.h"
+#include "SDL.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/**
+* @brief Destructor.
+*/
+Clock::~Clock()
+{
+}
+
+/**
+* @brief Creates the real clock, starting at zero.
+*/
+RealClock::RealClock():
+	origin(0)
+{
+	origin = read_ns();
+}
+
+/**
+* @brief Reads the monotonic clock of the system.
+* @return The system date in nanoseconds (the origin is unspecified).
+*/
+uint64_t RealClock::read_ns()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	if(frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+
+	// Split the division to avoid overflowing after a few days of uptime.
+	uint64_t seconds = counter.QuadPart / frequency.QuadPart;
+	uint64_t remainder = counter.QuadPart % frequency.QuadPart;
+	return seconds * 1000000000ULL + remainder * 1000000000ULL / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return uint64_t(now.tv_sec) * 1000000000ULL + uint64_t(now.tv_nsec);
+#endif
+}
+
+/**
+* @brief Returns the time elapsed since this clock was created.
+* @return The current date in nanoseconds.
+*/
+uint64_t RealClock::get_time_ns()
+{
+	return read_ns() - origin;
+}
+
+/**
+* @brief Makes the program sleep.
+* @param duration Duration of the sleep in nanoseconds
+* (the precision is about one millisecond).
+*/
+void RealClock::sleep(uint64_t duration)
+{
+	SDL_Delay(uint32_t(duration / 1000000));
+}
+
+/**
+* @brief Creates a virtual clock at date zero.
+*/
+VirtualClock::VirtualClock():
+	time(0)
+{
+}
+
+/**
+* @brief Returns the date of this clock.
+* @return The current date in nanoseconds.
+*/
+uint64_t VirtualClock::get_time_ns()
+{
+	return time;
+}
+
+/**
+* @brief Advances the clock instead of sleeping.
+* @param duration Duration to skip in nanoseconds.
+*/
+void VirtualClock::sleep(uint64_t duration)
+{
+	step(duration);
+}
+
+/**
+* @brief Advances the clock.
+* @param duration Duration to add in nanoseconds.
+*/
+void VirtualClock::step(uint64_t duration)
+{
+	time += duration;
+}
@@ -0,0 +1,76 @@
+/** @file Clock.h */
+
+#ifndef KQ_CLOCK_H
+#define KQ_CLOCK_H
+
+#include "Common.h"
+#include <cstdint>
+
+/**
+* @brief Abstract source of time for the engine.
+*
+* Dates are 64-bit numbers of nanoseconds since the clock was created:
+* they do not wrap around in practice and are fine enough to profile
+* or to interpolate within a frame.
+*
+* System reads the current clock once per cycle (see System::now_ns()).
+*/
+class Clock
+{
+public:
+	virtual ~Clock();
+
+	/**
+	* @brief Returns the current date of this clock.
+	* @return Nanoseconds elapsed since the clock was created.
+	*/
+	virtual uint64_t get_time_ns() = 0;
+
+	/**
+	* @brief Waits until this clock has advanced by some duration.
+	* @param duration Duration to wait in nanoseconds.
+	*/
+	virtual void sleep(uint64_t duration) = 0;
+};
+
+/**
+* @brief The monotonic clock of the system.
+*
+* CLOCK_MONOTONIC is used, or the performance counter on Windows.
+* Unlike the wall clock, it never goes back when the system time changes.
+*/
+class RealClock: public Clock
+{
+public:
+	RealClock();
+
+	uint64_t get_time_ns();
+	void sleep(uint64_t duration);
+
+private:
+	uint64_t read_ns();
+
+	uint64_t origin;		/**< Date of the system clock when this clock was created. */
+};
+
+/**
+* @brief A clock that only advances when it is stepped.
+*
+* sleep() steps the clock instead of waiting, so the main loop runs as fast
+* as the machine allows while the game still sees regular frames.
+* This makes benchmarks and replays deterministic and faster than real time.
+*/
+class VirtualClock: public Clock
+{
+public:
+	VirtualClock();
+
+	uint64_t get_time_ns();
+	void sleep(uint64_t duration);
+	void step(uint64_t duration);
+
+private:
+	uint64_t time;			/**< Current date in nanoseconds. */
+};
+
+#endif
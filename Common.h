@@ -40,6 +40,14 @@
 # endif
 #endif
 
+/**
+ * Define KQ_LUAJIT when building against LuaJIT instead of Lua 5.1 (use the
+ * LuaJIT headers and its lua51.lib in place of the Lua ones). LuaJIT has the
+ * same C API: this flag only enables the FFI fast paths of the drawing API
+ * (see FfiAPI.cpp).
+ */
+//#define KQ_LUAJIT
+
 //TODO:  adjust play screen for HUD menus
 #define KQ_PLAY_SCREEN_WIDTH
 #define KQ_PLAY_SCREEN_HEIGHT
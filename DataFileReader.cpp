@@ -0,0 +1,210 @@
+/** @file DataFileReader.cpp */
+
+#include "DataFileReader.h"
+#include "FileTools.h"
+#include <cstring>
+#include <climits>
+
+/**
+* @brief Creates an empty slice.
+*/
+StringSlice::StringSlice():
+	data(""),
+	size(0)
+{
+}
+
+/**
+* @brief Creates a slice of some characters.
+* @param data First character.
+* @param size Number of characters.
+*/
+StringSlice::StringSlice(const char* data, size_t size):
+	data(data),
+	size(size)
+{
+}
+
+/**
+* @brief Returns the characters of this slice.
+* @return The first character (the slice is not null-terminated).
+*/
+const char* StringSlice::get_data() const
+{
+	return data;
+}
+
+/**
+* @brief Returns the number of characters of this slice.
+* @return The size.
+*/
+size_t StringSlice::get_size() const
+{
+	return size;
+}
+
+/**
+* @brief Returns whether this slice has no characters.
+* @return true if the size is zero.
+*/
+bool StringSlice::is_empty() const
+{
+	return size == 0;
+}
+
+/**
+* @brief Returns a character of this slice.
+* @param index Index of the character, lower than the size.
+* @return The character.
+*/
+char StringSlice::operator[](size_t index) const
+{
+	return data[index];
+}
+
+/**
+* @brief Compares this slice to a string.
+* @param text A null-terminated string.
+* @return true if they have the same characters.
+*/
+bool StringSlice::operator==(const char* text) const
+{
+	return std::strncmp(data, text, size) == 0 && text[size] == '\0';
+}
+
+/**
+* @brief Copies this slice into a string.
+* @return The string.
+*/
+std::string StringSlice::to_string() const
+{
+	return std::string(data, size);
+}
+
+/**
+* @brief Parses this slice as a decimal integer.
+* @param value Receives the integer.
+* @return false if the slice is not an integer.
+*/
+bool StringSlice::to_int(int& value) const
+{
+	size_t i = 0;
+	bool negative = false;
+	if(size > 0 && (data[0] == '-' || data[0] == '+'))
+	{
+		negative = (data[0] == '-');
+		i++;
+	}
+	if(i == size)
+	{
+		return false;
+	}
+
+	long long result = 0;
+	for(; i < size; i++)
+	{
+		if(data[i] < '0' || data[i] > '9')
+		{
+			return false;
+		}
+		result = result * 10 + (data[i] - '0');
+		if(result > INT_MAX)
+		{
+			return false;
+		}
+	}
+	value = int(negative ? -result : result);
+	return true;
+}
+
+/**
+* @brief Removes the spaces and tabs at the beginning of this slice.
+*/
+void StringSlice::trim_left()
+{
+	while(size > 0 && (*data == ' ' || *data == '\t'))
+	{
+		data++;
+		size--;
+	}
+}
+
+/**
+* @brief Takes the next word of this slice.
+*
+* Words are separated by spaces or tabs. The word and the spaces before it
+* are removed from this slice.
+*
+* @param token Receives the word.
+* @return false if there is no word left.
+*/
+bool StringSlice::next_token(StringSlice& token)
+{
+	trim_left();
+	size_t length = 0;
+	while(length < size && data[length] != ' ' && data[length] != '\t')
+	{
+		length++;
+	}
+
+	token = StringSlice(data, length);
+	data += length;
+	size -= length;
+	return length > 0;
+}
+
+/**
+* @brief Loads a data file.
+* @param file_name Name of the file, relative to the data directory.
+*/
+DataFileReader::DataFileReader(const std::string& file_name):
+	buffer(NULL),
+	size(0),
+	position(0),
+	line_number(0)
+{
+	FileTools::data_file_open_buffer(file_name, &buffer, &size);
+}
+
+/**
+* @brief Closes the data file. The slices returned become invalid.
+*/
+DataFileReader::~DataFileReader()
+{
+	FileTools::data_file_close_buffer(buffer);
+}
+
+/**
+* @brief Reads the next line.
+* @param line Receives the line, without its end of line characters.
+* @return false if the end of the file is reached.
+*/
+bool DataFileReader::read_line(StringSlice& line)
+{
+	if(buffer == NULL || position >= size)
+	{
+		return false;
+	}
+
+	const char* begin = buffer + position;
+	const char* end = (const char*) std::memchr(begin, '\n', size - position);
+	size_t length = (end != NULL) ? size_t(end - begin) : size - position;
+	position += length + 1;
+
+	if(length > 0 && begin[length - 1] == '\r')
+	{
+		length--;
+	}
+	line = StringSlice(begin, length);
+	line_number++;
+	return true;
+}
+
+/**
+* @brief Returns the number of the last line read, for error messages.
+* @return The line number (1 for the first line).
+*/
+int DataFileReader::get_line_number() const
+{
+	return line_number;
+}
@@ -0,0 +1,76 @@
+/** @file DataFileReader.h */
+
+#ifndef KQ_DATA_FILE_READER_H
+#define KQ_DATA_FILE_READER_H
+
+#include "Common.h"
+#include <string>
+#include <cstddef>
+
+/**
+* @brief A read-only view of characters owned by someone else.
+*
+* Slices of a data file are returned by DataFileReader without copying
+* anything: they stay valid as long as the reader exists.
+*/
+class StringSlice
+{
+public:
+	StringSlice();
+	StringSlice(const char* data, size_t size);
+
+	const char* get_data() const;
+	size_t get_size() const;
+	bool is_empty() const;
+	char operator[](size_t index) const;
+	bool operator==(const char* text) const;
+	std::string to_string() const;
+	bool to_int(int& value) const;
+
+	void trim_left();
+	bool next_token(StringSlice& token);
+
+private:
+	const char* data;	/**< First character. */
+	size_t size;		/**< Number of characters. */
+};
+
+/**
+* @brief Reads a text data file line by line without copying it.
+*
+* The file is loaded once with FileTools::data_file_open_buffer() and
+* lines are returned as slices of this buffer, without their end of line
+* ("\n" or "\r\n"). This replaces data_file_open(), which copies the file
+* into a string stream, and std::getline(), which copies each line again.
+*
+* Usage:
+* @code
+* DataFileReader reader("text/strings.dat");
+* StringSlice line, key;
+* while(reader.read_line(line))
+* {
+*   line.next_token(key);
+*   ...
+* }
+* @endcode
+*/
+class DataFileReader
+{
+public:
+	explicit DataFileReader(const std::string& file_name);
+	~DataFileReader();
+
+	bool read_line(StringSlice& line);
+	int get_line_number() const;
+
+private:
+	DataFileReader(const DataFileReader& other);				// not copyable
+	DataFileReader& operator=(const DataFileReader& other);
+
+	char* buffer;		/**< The whole file. */
+	size_t size;		/**< Size of the file in bytes. */
+	size_t position;	/**< Beginning of the next line in the buffer. */
+	int line_number;	/**< Number of the last line read (1 for the first one). */
+};
+
+#endif
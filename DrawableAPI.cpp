@@ -1,10 +1,42 @@
 /** @file DrawableAPI.cpp */
 
 #include "LuaContext.h"
+#include "LuaBinding.h"
 #include "Drawable.h"
+#include "Surface.h"
+#include "TextSurface.h"
 #include "lua.hpp"
 #include "TransitionFade.h"
 
+/**
+* @brief Returns whether a value is a drawable object (surface, text surface
+* or sprite).
+* @param l A Lua context.
+* @param index An index in the stack.
+* @return true if the value at this index is a drawable.
+*/
+bool LuaType<Drawable>::is(lua_State* l, int index) 
+{
+  return LuaType<Surface>::is(l, index)
+      || LuaType<TextSurface>::is(l, index);
+}
+
+/**
+* @brief Checks that a value is a drawable object and returns it.
+* @param l A Lua context.
+* @param index An index in the stack.
+* @return The drawable object.
+*/
+Drawable& LuaType<Drawable>::check(lua_State* l, int index) 
+{
+  if (!is(l, index)) 
+  {
+    luaL_typerror(l, index, "drawable");
+  }
+  ExportableToLua** userdata = static_cast<ExportableToLua**>(lua_touserdata(l, index));
+  return static_cast<Drawable&>(**userdata);
+}
+
 /**
 * @brief Returns whether a value is a userdata of a type.
 * @param l A Lua context.
@@ -13,7 +45,7 @@
 */
 bool LuaContext::is_drawable(lua_State* l, int index) 
 {
-  return true; //TODO: Implement later: is_surface(l, index) || is_text_surface(l, index) || is_sprite(l, index);
+  return LuaType<Drawable>::is(l, index);
 }
 
 /**
@@ -25,18 +57,7 @@ bool LuaContext::is_drawable(lua_State* l, int index)
 */
 Drawable& LuaContext::check_drawable(lua_State* l, int index) 
 {
-  Drawable** drawable = NULL;
-
-  if (is_drawable(l, index)) 
-  {
-    drawable = static_cast<Drawable**>(lua_touserdata(l, index));
-  }
-  else 
-  {
-    luaL_typerror(l, index, "drawable");
-  }
-
-  return **drawable;
+  return LuaType<Drawable>::check(l, index);
 }
 
 /**
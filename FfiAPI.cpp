@@ -0,0 +1,154 @@
+/** @file FfiAPI.cpp */
+
+#include "LuaContext.h"
+#include "Surface.h"
+#include "TextSurface.h"
+#include "Color.h"
+#include "lua.hpp"
+
+/*
+ * FFI fast paths of the drawing API (LuaJIT builds only).
+ *
+ * Define KQ_LUAJIT and link LuaJIT's lua51.lib instead of Lua 5.1 to enable
+ * them. LuaJIT exposes the same C API, so the rest of LuaContext is
+ * unchanged. The functions below are called directly from JIT-compiled
+ * code through ffi.C, which skips the Lua/C stack protocol for the calls
+ * that quest scripts make every frame. The Lua API seen by quests does not
+ * change: the wrappers keep the same names and fall back to the regular
+ * implementation (and its error messages) for unexpected arguments.
+ *
+ * A userdata passed to a void* FFI parameter gives the address of its
+ * payload, which is the ExportableToLua* stored by push_userdata().
+ */
+#ifdef KQ_LUAJIT
+
+#if defined(_WIN32)
+#define KQ_FFI_EXPORT extern "C" __declspec(dllexport)
+#else
+// The executable must also be linked with -rdynamic.
+#define KQ_FFI_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+namespace {
+
+/**
+* @brief Returns the C++ object of a userdata payload.
+* @param userdata Address of the payload of a userdata created by push_userdata().
+* @return The object.
+*/
+template<typename T>
+T& get_object(void* userdata)
+{
+	return static_cast<T&>(**static_cast<ExportableToLua**>(userdata));
+}
+
+/**
+* @brief Lua side of the fast paths.
+*
+* Receives the surface and text surface metatables. Arguments are still
+* type-checked, but with metatable comparisons that the JIT compiles.
+*/
+const char ffi_wrappers[] =
+	"local surface_mt, text_surface_mt = ...\n"
+	"local ffi = require(\"ffi\")\n"
+	"ffi.cdef[[\n"
+	"void kq_ffi_drawable_draw(void* drawable, void* dst_surface, int x, int y);\n"
+	"void kq_ffi_surface_fill_color(void* surface, int r, int g, int b);\n"
+	"void kq_ffi_surface_fill_color_region(void* surface, int r, int g, int b,\n"
+	"    int x, int y, int width, int height);\n"
+	"void kq_ffi_text_surface_set_text(void* text_surface, const char* text);\n"
+	"]]\n"
+	"local C = ffi.C\n"
+	"local getmetatable, type, select = getmetatable, type, select\n"
+	"local surface_api, text_surface_api = kq.surface, kq.text_surface\n"
+	"\n"
+	"local function wrap_draw(lua_draw)\n"
+	"  return function(drawable, dst_surface, x, y, ...)\n"
+	"    local mt = getmetatable(drawable)\n"
+	"    if (mt ~= surface_mt and mt ~= text_surface_mt)\n"
+	"        or getmetatable(dst_surface) ~= surface_mt\n"
+	"        or (x ~= nil and type(x) ~= \"number\")\n"
+	"        or (y ~= nil and type(y) ~= \"number\") then\n"
+	"      return lua_draw(drawable, dst_surface, x, y, ...)\n"
+	"    end\n"
+	"    C.kq_ffi_drawable_draw(drawable, dst_surface, x or 0, y or 0)\n"
+	"  end\n"
+	"end\n"
+	"surface_api.draw = wrap_draw(surface_api.draw)\n"
+	"text_surface_api.draw = wrap_draw(text_surface_api.draw)\n"
+	"\n"
+	"local lua_fill_color = surface_api.fill_color\n"
+	"surface_api.fill_color = function(surface, color, ...)\n"
+	"  if getmetatable(surface) ~= surface_mt or type(color) ~= \"table\"\n"
+	"      or type(color[1]) ~= \"number\" or type(color[2]) ~= \"number\"\n"
+	"      or type(color[3]) ~= \"number\" then\n"
+	"    return lua_fill_color(surface, color, ...)\n"
+	"  end\n"
+	"  if select(\"#\", ...) == 0 then\n"
+	"    C.kq_ffi_surface_fill_color(surface, color[1], color[2], color[3])\n"
+	"  else\n"
+	"    local x, y, width, height = ...\n"
+	"    if type(x) ~= \"number\" or type(y) ~= \"number\"\n"
+	"        or type(width) ~= \"number\" or type(height) ~= \"number\" then\n"
+	"      return lua_fill_color(surface, color, ...)\n"
+	"    end\n"
+	"    C.kq_ffi_surface_fill_color_region(surface, color[1], color[2], color[3],\n"
+	"        x, y, width, height)\n"
+	"  end\n"
+	"end\n"
+	"\n"
+	"local lua_set_text = text_surface_api.set_text\n"
+	"text_surface_api.set_text = function(text_surface, text, ...)\n"
+	"  if getmetatable(text_surface) ~= text_surface_mt or type(text) ~= \"string\" then\n"
+	"    return lua_set_text(text_surface, text, ...)\n"
+	"  end\n"
+	"  C.kq_ffi_text_surface_set_text(text_surface, text)\n"
+	"end\n";
+
+}
+
+KQ_FFI_EXPORT void kq_ffi_drawable_draw(void* drawable, void* dst_surface, int x, int y)
+{
+	get_object<Drawable>(drawable).draw(get_object<Surface>(dst_surface), x, y);
+}
+
+KQ_FFI_EXPORT void kq_ffi_surface_fill_color(void* surface, int r, int g, int b)
+{
+	Color color(r, g, b);
+	get_object<Surface>(surface).fill_with_color(color);
+}
+
+KQ_FFI_EXPORT void kq_ffi_surface_fill_color_region(void* surface, int r, int g, int b,
+		int x, int y, int width, int height)
+{
+	Color color(r, g, b);
+	get_object<Surface>(surface).fill_with_color(color, Rectangle(x, y, width, height));
+}
+
+KQ_FFI_EXPORT void kq_ffi_text_surface_set_text(void* text_surface, const char* text)
+{
+	get_object<TextSurface>(text_surface).set_text(text);
+}
+
+#endif
+
+/**
+* @brief Replaces the hottest drawing functions by FFI fast paths.
+*
+* Does nothing unless the engine is built with LuaJIT (KQ_LUAJIT).
+* Must be called after the surface and text surface modules are registered.
+*/
+void LuaContext::register_ffi_fast_paths()
+{
+#ifdef KQ_LUAJIT
+	if(luaL_loadbuffer(l, ffi_wrappers, sizeof(ffi_wrappers) - 1, "ffi_fast_paths") != 0)
+	{
+		std::cerr << "Cannot load the FFI fast paths: " << lua_tostring(l, -1) << '\n';
+		lua_pop(l, 1);
+		return;
+	}
+	luaL_getmetatable(l, surface_module_name.c_str());
+	luaL_getmetatable(l, text_surface_module_name.c_str());
+	call_function(2, 0, "ffi_fast_paths");
+#endif
+}
@@ -6,12 +6,23 @@
 #include "physfs.h"
 #include <iostream>
 #include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 std::string FileTools::kq_write_dir;
 std::string FileTools::quest_write_dir;
 std::string FileTools::language_code;
 std::string FileTools::default_language_code;
 std::map<std::string, std::string> FileTools::languages;
+std::map<std::string, FileTools::MappedFile> FileTools::mapped_files;
+std::map<const char*, std::string> FileTools::mapped_buffers;
+std::mutex FileTools::mapped_files_mutex;
 
 void FileTools::initialize(int argc, char* argv[])
 {
@@ -121,9 +132,27 @@ void FileTools::data_file_close(const std::istream& data_file)
   delete &data_file;
 }
 
+/**
+* @brief Opens a data file and returns its content.
+*
+* When the file is a real file of the quest directory, it is mapped in
+* memory instead of being copied: the buffer is then read-only and shared
+* by all the callers that open the same file. Files in archives and in the
+* write directory (which the engine may rewrite) are copied.
+* Close the buffer with data_file_close_buffer().
+*
+* @param file_name name of the file, relative to the data directory
+* @param buffer receives the content of the file (do not modify it)
+* @param size receives the size of the file in bytes
+*/
 void FileTools::data_file_open_buffer(const std::string& file_name, char** buffer, size_t* size)
 {
 	std::cerr << file_name.c_str() << '\n';
+	if(data_file_open_mapped(file_name, buffer, size))
+	{
+		return;
+	}
+
 	if(!PHYSFS_exists(file_name.c_str()))
 	{
 		std::cerr << "File does not exist.\n";
@@ -243,6 +272,11 @@ void FileTools::set_kq_write_dir(const std::string& kq_write_dir)
 		std::cout << "Cannot set write directory to " << full_write_dir << '\n';
 	}
 
+	//Files written there (savegames, settings, caches) can be read back
+	//with the usual data_file functions, through paths that start with the
+	//quest write directory. It is searched last so that it never hides quest data.
+	PHYSFS_addToSearchPath(PHYSFS_getWriteDir(), 1);
+
 	if(!quest_write_dir.empty())
 	{
 		set_quest_write_dir(quest_write_dir);
@@ -273,13 +307,261 @@ void FileTools::data_file_save_buffer(const std::string& file_name, const char*
 	PHYSFS_close(file);
 }
 
+/**
+* @brief Deletes a file from the write directory.
+* @param file_name Name of the file, relative to the engine write directory.
+*/
+void FileTools::data_file_delete(const std::string& file_name)
+{
+	if(!PHYSFS_delete(file_name.c_str()))
+	{
+		std::cerr << "Cannot delete file '" << file_name << "': " << PHYSFS_getLastError() << '\n';
+	}
+}
+
+/**
+* @brief Returns whether a data file comes from the write directory.
+* @param file_name Name of the file, relative to the data or write directory.
+* @return true if the file is in the write directory, false if it is quest
+* data or does not exist.
+*/
+bool FileTools::data_file_is_in_write_dir(const std::string& file_name)
+{
+	const char* real_dir = PHYSFS_getRealDir(file_name.c_str());
+	const char* write_dir = PHYSFS_getWriteDir();
+	return real_dir != NULL && write_dir != NULL && std::string(real_dir) == write_dir;
+}
+
+/**
+* @brief Returns the size of a data file.
+* @param file_name Name of the file, relative to the data or write directory.
+* @return Size of the file in bytes, or 0 if it cannot be open.
+*/
+size_t FileTools::data_file_get_size(const std::string& file_name)
+{
+	PHYSFS_file* file = PHYSFS_openRead(file_name.c_str());
+	if(file == NULL)
+	{
+		return 0;
+	}
+	PHYSFS_sint64 size = PHYSFS_fileLength(file);
+	PHYSFS_close(file);
+	return size > 0 ? size_t(size) : 0;
+}
+
+/**
+* @brief Returns the date when a data file was last modified.
+* @param file_name Name of the file, relative to the data or write directory.
+* @return Seconds since the epoch, or -1 if unknown.
+*/
+int64_t FileTools::data_file_get_modification_time(const std::string& file_name)
+{
+	return PHYSFS_getLastModTime(file_name.c_str());
+}
+
+/**
+* @brief Maps a data file into memory instead of reading it.
+*
+* This only works for files stored as real files on the disk (the write
+* directory or a quest data directory), not inside an archive.
+* The pages are loaded by the system when they are accessed.
+* Release the memory with data_file_unmap().
+*
+* @param file_name Name of the file, relative to the data or write directory.
+* @param data The mapped content of the file.
+* @param size Size of the file in bytes.
+* @return true in case of success, false if the file cannot be mapped.
+*/
+bool FileTools::data_file_map(const std::string& file_name, const char** data, size_t* size)
+{
+	const char* real_dir = PHYSFS_getRealDir(file_name.c_str());
+	if(real_dir == NULL)
+	{
+		return false;
+	}
+	const std::string& path = std::string(real_dir) + PHYSFS_getDirSeparator() + file_name;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER file_size;
+	HANDLE mapping = NULL;
+	if(GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+	{
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	CloseHandle(file);
+	if(mapping == NULL)
+	{
+		return false;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if(view == NULL)
+	{
+		return false;
+	}
+	*data = static_cast<const char*>(view);
+	*size = size_t(file_size.QuadPart);
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd == -1)
+	{
+		return false;
+	}
+	struct stat file_stat;
+	void* view = MAP_FAILED;
+	if(fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0)
+	{
+		view = mmap(NULL, size_t(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if(view == MAP_FAILED)
+	{
+		return false;
+	}
+	*data = static_cast<const char*>(view);
+	*size = size_t(file_stat.st_size);
+#endif
+	return true;
+}
+
+/**
+* @brief Releases a file mapped by data_file_map().
+* @param data The mapped content.
+* @param size Size of the mapping in bytes.
+*/
+void FileTools::data_file_unmap(const char* data, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(const_cast<char*>(data), size);
+#endif
+}
+
+/**
+* @brief Creates a directory in the write directory.
+*
+* Parent directories are created as needed. Nothing happens if the
+* directory already exists.
+*
+* @param dir_name Name of the directory, relative to the engine write directory.
+*/
+void FileTools::data_file_mkdir(const std::string& dir_name)
+{
+	if(!PHYSFS_mkdir(dir_name.c_str()))
+	{
+		std::cerr << "Cannot create directory '" << dir_name << "': " << PHYSFS_getLastError() << '\n';
+	}
+}
+
+/**
+* @brief Recursively lists the data files that have an extension.
+* @param dir_name Directory to search, relative to the data directory
+* (an empty string means the root).
+* @param extension The extension to look for, including the dot (e.g. ".lua").
+* @param file_names The file names found are appended to this vector.
+*/
+void FileTools::data_files_find(const std::string& dir_name, const std::string& extension,
+		std::vector<std::string>& file_names)
+{
+	char** files = PHYSFS_enumerateFiles(dir_name.c_str());
+	for(char** it = files; *it != NULL; ++it)
+	{
+		const std::string file_name = dir_name.empty() ? *it : dir_name + "/" + *it;
+		if(PHYSFS_isDirectory(file_name.c_str()))
+		{
+			data_files_find(file_name, extension, file_names);
+		}
+		else if(file_name.size() > extension.size()
+			&& file_name.compare(file_name.size() - extension.size(), extension.size(), extension) == 0)
+		{
+			file_names.push_back(file_name);
+		}
+	}
+	PHYSFS_freeList(files);
+}
+
 /**
 * @brief Closes a data buffer previously open with data_file_open_buffer().
 * @param buffer the buffer to close
 */
 void FileTools::data_file_close_buffer(char* buffer) 
 {
-  delete[] buffer;
+  if (!data_file_close_mapped(buffer)) 
+  {
+    delete[] buffer;
+  }
+}
+
+/**
+* @brief Maps a data file in memory, or shares the mapping if it is already mapped.
+* @param file_name name of the file, relative to the data directory
+* @param buffer receives the mapping
+* @param size receives the size of the file in bytes
+* @return false if the file cannot be mapped: the caller must copy it instead
+*/
+bool FileTools::data_file_open_mapped(const std::string& file_name, char** buffer, size_t* size)
+{
+	// Files of the write directory may be rewritten while mapped.
+	if(!data_file_exists(file_name) || data_file_is_in_write_dir(file_name))
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mapped_files_mutex);
+	std::map<std::string, MappedFile>::iterator it = mapped_files.find(file_name);
+	if(it == mapped_files.end())
+	{
+		MappedFile mapped_file;
+		if(!data_file_map(file_name, &mapped_file.data, &mapped_file.size))
+		{
+			return false;
+		}
+		mapped_file.refcount = 0;
+		it = mapped_files.insert(std::make_pair(file_name, mapped_file)).first;
+		mapped_buffers[mapped_file.data] = file_name;
+	}
+
+	MappedFile& mapped_file = it->second;
+	mapped_file.refcount++;
+	*buffer = const_cast<char*>(mapped_file.data);
+	*size = mapped_file.size;
+	return true;
+}
+
+/**
+* @brief Releases a buffer returned by data_file_open_mapped().
+*
+* The file is unmapped when its last buffer is released.
+*
+* @param buffer a buffer returned by data_file_open_buffer()
+* @return false if the buffer is not a mapping (it was copied)
+*/
+bool FileTools::data_file_close_mapped(char* buffer)
+{
+	std::lock_guard<std::mutex> lock(mapped_files_mutex);
+	std::map<const char*, std::string>::iterator it = mapped_buffers.find(buffer);
+	if(it == mapped_buffers.end())
+	{
+		return false;
+	}
+
+	std::map<std::string, MappedFile>::iterator file_it = mapped_files.find(it->second);
+	MappedFile& mapped_file = file_it->second;
+	mapped_file.refcount--;
+	if(mapped_file.refcount == 0)
+	{
+		data_file_unmap(mapped_file.data, mapped_file.size);
+		mapped_files.erase(file_it);
+		mapped_buffers.erase(it);
+	}
+	return true;
 }
 
 std::string FileTools::get_base_write_dir()
@@ -5,8 +5,10 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <iostream>
 #include <cstdint>
+#include <mutex>
 
 /** @brief Finished */
 
@@ -25,6 +27,14 @@ public:
 	static void data_file_close_buffer(char* buffer);
 	static void data_file_save_buffer(const std::string& file_name, const char* buffer, size_t size);
 	static void data_file_delete(const std::string& file_name);
+	static void data_file_mkdir(const std::string& dir_name);
+	static bool data_file_is_in_write_dir(const std::string& file_name);
+	static size_t data_file_get_size(const std::string& file_name);
+	static int64_t data_file_get_modification_time(const std::string& file_name);
+	static bool data_file_map(const std::string& file_name, const char** data, size_t* size);
+	static void data_file_unmap(const char* data, size_t size);
+	static void data_files_find(const std::string& dir_name, const std::string& extension,
+		std::vector<std::string>& file_names);
 
 	static void read(std::istream& is, int& value);
     static void read(std::istream& is, uint32_t& value);
@@ -50,6 +60,24 @@ private:
 
 	static std::string kq_write_dir;
 	static std::string quest_write_dir;
+
+	/**
+	* @brief A data file mapped in memory by data_file_open_buffer().
+	*/
+	struct MappedFile
+	{
+		const char* data;	/**< the mapping */
+		size_t size;		/**< size of the file */
+		int refcount;		/**< number of buffers open on this mapping */
+	};
+
+	static bool data_file_open_mapped(const std::string& file_name, char** buffer, size_t* size);
+	static bool data_file_close_mapped(char* buffer);
+
+	static std::map<std::string, MappedFile> mapped_files;		/**< files currently mapped, by file name */
+	static std::map<const char*, std::string> mapped_buffers;	/**< file name of each mapping */
+	static std::mutex mapped_files_mutex;						/**< protects the mappings (files are also read by
+																 * the sound and music threads) */
 	
 
 	static std::map<std::string, std::string> languages;
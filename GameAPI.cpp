@@ -1,6 +1,7 @@
 /** @file GameAPI.cpp */
 
 #include "LuaContext.h"
+#include "LuaBinding.h"
 #include "MainLoop.h"
 #include "Game.h"
 #include "Savegame.h"
@@ -74,6 +75,7 @@ void LuaContext::register_game_module()
       { NULL, NULL }
   };
   register_type(game_module_name, methods, metamethods);
+  LuaType<Savegame>::bind(l, game_module_name);
 }
 
 /**
@@ -84,7 +86,7 @@ void LuaContext::register_game_module()
 */
 bool LuaContext::is_game(lua_State* l, int index) 
 {
-  return is_userdata(l, index, game_module_name);
+  return LuaType<Savegame>::is(l, index);
 }
 
 /**
@@ -96,7 +98,7 @@ bool LuaContext::is_game(lua_State* l, int index)
 */
 Savegame& LuaContext::check_game(lua_State* l, int index) 
 {
-  return static_cast<Savegame&>(check_userdata(l, index, game_module_name));
+  return LuaType<Savegame>::check(l, index);
 }
 
 /**
@@ -160,6 +160,8 @@ public:
 	static void quit();
 
 private:
+	friend class InputRecording;	// records and rebuilds the internal events
+
 	InputEvent(const SDL_Event &event);
 
 public:
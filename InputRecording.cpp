@@ -0,0 +1,419 @@
+/** @file InputRecording.cpp */
+
+#include "InputRecording.h"
+#include "InputEvent.h"
+#include "Surface.h"
+#include <iostream>
+#include <cstring>
+
+const char InputRecording::magic[4] = { 'K', 'Q', 'I', 'R' };
+const uint8_t InputRecording::version = 2;
+const uint8_t InputRecording::end_type = 0xFF;
+const uint8_t InputRecording::frame_type = 0xFE;
+const uint32_t InputRecording::frames_between_frame_records = 60;
+
+namespace
+{
+	// Values are stored in little-endian order whatever the platform.
+
+	void write_uint8(std::ostream& os, uint8_t value)
+	{
+		os.put(char(value));
+	}
+
+	void write_uint16(std::ostream& os, uint16_t value)
+	{
+		write_uint8(os, uint8_t(value & 0xFF));
+		write_uint8(os, uint8_t(value >> 8));
+	}
+
+	void write_uint32(std::ostream& os, uint32_t value)
+	{
+		write_uint16(os, uint16_t(value & 0xFFFF));
+		write_uint16(os, uint16_t(value >> 16));
+	}
+
+	uint8_t read_uint8(std::istream& is)
+	{
+		return uint8_t(is.get());
+	}
+
+	uint16_t read_uint16(std::istream& is)
+	{
+		uint16_t low = read_uint8(is);
+		return uint16_t(low | (read_uint8(is) << 8));
+	}
+
+	uint32_t read_uint32(std::istream& is)
+	{
+		uint32_t low = read_uint16(is);
+		return low | (uint32_t(read_uint16(is)) << 16);
+	}
+
+	/**
+	* @brief Adds some bytes to a FNV-1a hash.
+	* @param hash The hash to update.
+	* @param data The bytes to add.
+	* @param size Number of bytes.
+	*/
+	void hash_bytes(uint32_t& hash, const void* data, size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for(size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 16777619U;
+		}
+	}
+}
+
+/**
+* @brief Constructor.
+* @param replaying true to replay a file, false to record one.
+* @param seed Seed of Random.
+*/
+InputRecording::InputRecording(bool replaying, uint32_t seed):
+	replaying(replaying),
+	seed(seed),
+	nb_events(0),
+	last_frame(0),
+	next_record_loaded(false),
+	next_frame(0),
+	ended(false)
+{
+	std::memset(&next_event, 0, sizeof(next_event));
+}
+
+/**
+* @brief Destructor. Closes the file.
+*/
+InputRecording::~InputRecording()
+{
+}
+
+/**
+* @brief Starts recording the input events of this session.
+* @param file_name Name of the file to create.
+* @param seed The seed of Random for this session.
+* @return The recording, or NULL if the file cannot be created.
+*/
+InputRecording* InputRecording::create_recording(const std::string& file_name, uint32_t seed)
+{
+	InputRecording* recording = new InputRecording(false, seed);
+	recording->output.open(file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if(!recording->output)
+	{
+		std::cerr << "Cannot create the input recording file '" << file_name << "'" << std::endl;
+		delete recording;
+		return NULL;
+	}
+
+	recording->output.write(magic, sizeof(magic));
+	write_uint8(recording->output, version);
+	write_uint32(recording->output, seed);
+	return recording;
+}
+
+/**
+* @brief Opens a recording to replay it.
+* @param file_name Name of the recording file.
+* @return The replay, or NULL if the file cannot be read.
+*/
+InputRecording* InputRecording::load_replay(const std::string& file_name)
+{
+	InputRecording* replay = new InputRecording(true, 0);
+	replay->input.open(file_name.c_str(), std::ios::in | std::ios::binary);
+
+	char file_magic[sizeof(magic)];
+	replay->input.read(file_magic, sizeof(file_magic));
+	uint8_t file_version = read_uint8(replay->input);
+	// version 1 has no frame records and is read the same way
+	if(!replay->input || std::memcmp(file_magic, magic, sizeof(magic)) != 0 || file_version < 1 || file_version > version)
+	{
+		std::cerr << "Cannot read the input recording file '" << file_name << "'" << std::endl;
+		delete replay;
+		return NULL;
+	}
+
+	replay->seed = read_uint32(replay->input);
+	return replay;
+}
+
+/**
+* @brief Returns whether this object replays a recording.
+* @return true if replaying, false if recording.
+*/
+bool InputRecording::is_replaying()
+{
+	return replaying;
+}
+
+/**
+* @brief Returns the seed of Random during the recorded session.
+* @return The seed.
+*/
+uint32_t InputRecording::get_seed()
+{
+	return seed;
+}
+
+/**
+* @brief Appends an input event to the recording.
+* @param event The event that has just happened.
+* @param frame Number of frames drawn before it.
+*/
+void InputRecording::record(InputEvent& event, uint32_t frame)
+{
+	const SDL_Event& e = event.internal_event;
+	switch(e.type)
+	{
+		case SDL_KEYDOWN:
+		case SDL_KEYUP:
+		case SDL_MOUSEMOTION:
+		case SDL_MOUSEBUTTONDOWN:
+		case SDL_MOUSEBUTTONUP:
+		case SDL_ACTIVEEVENT:
+		case SDL_QUIT:
+			break;
+
+		default:
+			return;
+	}
+
+	write_uint32(output, frame);
+	write_uint8(output, e.type);
+	switch(e.type)
+	{
+		case SDL_KEYDOWN:
+		case SDL_KEYUP:
+			write_uint8(output, e.key.state);
+			write_uint8(output, e.key.keysym.scancode);
+			write_uint16(output, uint16_t(e.key.keysym.sym));
+			write_uint16(output, uint16_t(e.key.keysym.mod));
+			write_uint16(output, e.key.keysym.unicode);
+			break;
+
+		case SDL_MOUSEMOTION:
+			write_uint8(output, e.motion.state);
+			write_uint16(output, e.motion.x);
+			write_uint16(output, e.motion.y);
+			write_uint16(output, uint16_t(e.motion.xrel));
+			write_uint16(output, uint16_t(e.motion.yrel));
+			break;
+
+		case SDL_MOUSEBUTTONDOWN:
+		case SDL_MOUSEBUTTONUP:
+			write_uint8(output, e.button.button);
+			write_uint8(output, e.button.state);
+			write_uint16(output, e.button.x);
+			write_uint16(output, e.button.y);
+			break;
+
+		case SDL_ACTIVEEVENT:
+			write_uint8(output, e.active.gain);
+			write_uint8(output, e.active.state);
+			break;
+	}
+	nb_events++;
+}
+
+/**
+* @brief Saves the number of frames of the recording from time to time.
+*
+* The file is flushed at the same time, so that a session that does not
+* end normally can still be replayed up to this point.
+*
+* @param frame Number of frames drawn so far.
+*/
+void InputRecording::update(uint32_t frame)
+{
+	if(replaying || !output.is_open() || frame < last_frame + frames_between_frame_records)
+	{
+		return;
+	}
+
+	write_uint32(output, frame);
+	write_uint8(output, frame_type);
+	output.flush();
+	last_frame = frame;
+}
+
+/**
+* @brief Ends the recording and closes the file.
+* @param nb_frames Total number of frames of the session.
+*/
+void InputRecording::finish(uint32_t nb_frames)
+{
+	if(replaying || !output.is_open())
+	{
+		return;
+	}
+
+	write_uint32(output, nb_frames);
+	write_uint8(output, end_type);
+	output.close();
+}
+
+/**
+* @brief Reads the next record of the replay.
+*
+* Frame records are skipped. If the file is truncated or has an unknown
+* record, the replay ends at the last frame read.
+*
+* @return true if an event was read, false at the end of the replay.
+*/
+bool InputRecording::read_next_record()
+{
+	next_record_loaded = true;
+	uint8_t type = frame_type;
+	while(type == frame_type)
+	{
+		next_frame = read_uint32(input);
+		type = read_uint8(input);
+		if(input && type == frame_type)
+		{
+			last_frame = next_frame;
+		}
+	}
+
+	std::memset(&next_event, 0, sizeof(next_event));
+	next_event.type = type;
+	switch(type)
+	{
+		case SDL_KEYDOWN:
+		case SDL_KEYUP:
+			next_event.key.type = type;
+			next_event.key.state = read_uint8(input);
+			next_event.key.keysym.scancode = read_uint8(input);
+			next_event.key.keysym.sym = SDLKey(read_uint16(input));
+			next_event.key.keysym.mod = SDLMod(read_uint16(input));
+			next_event.key.keysym.unicode = read_uint16(input);
+			break;
+
+		case SDL_MOUSEMOTION:
+			next_event.motion.state = read_uint8(input);
+			next_event.motion.x = read_uint16(input);
+			next_event.motion.y = read_uint16(input);
+			next_event.motion.xrel = int16_t(read_uint16(input));
+			next_event.motion.yrel = int16_t(read_uint16(input));
+			break;
+
+		case SDL_MOUSEBUTTONDOWN:
+		case SDL_MOUSEBUTTONUP:
+			next_event.button.button = read_uint8(input);
+			next_event.button.state = read_uint8(input);
+			next_event.button.x = read_uint16(input);
+			next_event.button.y = read_uint16(input);
+			break;
+
+		case SDL_ACTIVEEVENT:
+			next_event.active.gain = read_uint8(input);
+			next_event.active.state = read_uint8(input);
+			break;
+
+		case SDL_QUIT:
+			break;
+
+		case end_type:
+			ended = true;
+			break;
+
+		default:
+			// An unknown type that we cannot skip.
+			std::cerr << "Unknown record in the input recording" << std::endl;
+			next_frame = last_frame;
+			ended = true;
+			break;
+	}
+
+	if(!input)
+	{
+		std::cerr << "The input recording is truncated" << std::endl;
+		next_frame = last_frame;
+		ended = true;
+	}
+
+	if(!ended)
+	{
+		last_frame = next_frame;
+	}
+	return !ended;
+}
+
+/**
+* @brief Returns the next recorded event if it happened at this frame.
+*
+* At most one event is returned per call, like InputEvent::get_event().
+*
+* @param frame Number of frames drawn so far.
+* @return The event to handle (delete it after use), or NULL.
+*/
+InputEvent* InputRecording::get_event(uint32_t frame)
+{
+	if(!next_record_loaded && !ended)
+	{
+		read_next_record();
+	}
+
+	if(ended || next_frame > frame)
+	{
+		return NULL;
+	}
+
+	next_record_loaded = false;
+	nb_events++;
+	return new InputEvent(next_event);
+}
+
+/**
+* @brief Returns whether the replay has reached the end of the session.
+* @param frame Number of frames drawn so far.
+* @return true if all events were replayed and the recorded number of
+* frames is reached.
+*/
+bool InputRecording::is_finished(uint32_t frame)
+{
+	if(!next_record_loaded && !ended)
+	{
+		read_next_record();
+	}
+	return ended && frame >= next_frame;
+}
+
+/**
+* @brief Returns the number of events recorded or replayed so far.
+* @return The number of events.
+*/
+int InputRecording::get_nb_events()
+{
+	return nb_events;
+}
+
+/**
+* @brief Computes a hash of the visible state of the game.
+*
+* Two replays of the same recording must give the same hash. The pixels
+* drawn and the number of frames are hashed: a difference in the game logic
+* quickly shows on the screen.
+*
+* @param surface The surface where the last frame was drawn.
+* @param nb_frames Number of frames drawn.
+* @return The hash.
+*/
+uint32_t InputRecording::get_state_hash(Surface& surface, uint32_t nb_frames)
+{
+	uint32_t hash = 2166136261U;
+	hash_bytes(hash, &nb_frames, sizeof(nb_frames));
+
+	SDL_Surface* internal_surface = surface.get_internal_surface();
+	SDL_LockSurface(internal_surface);
+	const uint8_t* pixels = static_cast<const uint8_t*>(internal_surface->pixels);
+	size_t row_size = internal_surface->w * internal_surface->format->BytesPerPixel;
+	for(int y = 0; y < internal_surface->h; y++)
+	{
+		hash_bytes(hash, pixels + y * internal_surface->pitch, row_size);
+	}
+	SDL_UnlockSurface(internal_surface);
+
+	return hash;
+}
@@ -0,0 +1,76 @@
+/** @file InputRecording.h */
+
+#ifndef KQ_INPUT_RECORDING_H
+#define KQ_INPUT_RECORDING_H
+
+#include "Common.h"
+#include "SDL.h"
+#include <string>
+#include <fstream>
+
+/**
+* @brief Records the input events of a session or replays them.
+*
+* A recording is a compact binary file: a header with the seed of Random,
+* then one record per input event with the number of the frame when it
+* happened, and an end record with the total number of frames.
+* A frame record is also written and flushed every second or so: a session
+* that was killed before writing its end record replays up to the last
+* frame record or event that was saved.
+*
+* A replay feeds the events back to the main loop at the same frames, on a
+* virtual clock (see System::set_clock()) and without video, so that it runs
+* as fast as possible and always computes the same thing. At the end, a hash
+* of the state is printed to detect divergences between two builds, with the
+* time spent so that replays can serve as benchmarks.
+*
+* Only keyboard, mouse, focus and quit events are recorded.
+*/
+class InputRecording
+{
+public:
+	~InputRecording();
+
+	static InputRecording* create_recording(const std::string& file_name, uint32_t seed);
+	static InputRecording* load_replay(const std::string& file_name);
+
+	bool is_replaying();
+	uint32_t get_seed();
+
+	void record(InputEvent& event, uint32_t frame);
+	void update(uint32_t frame);
+	void finish(uint32_t nb_frames);
+
+	InputEvent* get_event(uint32_t frame);
+	bool is_finished(uint32_t frame);
+	int get_nb_events();
+
+	static uint32_t get_state_hash(Surface& surface, uint32_t nb_frames);
+
+private:
+	InputRecording(bool replaying, uint32_t seed);
+
+	bool read_next_record();
+
+	static const char magic[4];		/**< Identifies a recording file. */
+	static const uint8_t version;	/**< Version of the file format. */
+	static const uint8_t end_type;	/**< Type of the end record. */
+	static const uint8_t frame_type;	/**< Type of the records that only save the number of frames. */
+	static const uint32_t frames_between_frame_records;	/**< Frames between two frame records. */
+
+	bool replaying;					/**< true to replay a file, false to record one. */
+	uint32_t seed;					/**< Seed of Random during the recorded session. */
+	std::ofstream output;			/**< The file being recorded. */
+	std::ifstream input;			/**< The file being replayed. */
+	int nb_events;					/**< Number of events recorded or replayed so far. */
+	uint32_t last_frame;			/**< Frame of the last record written or read. */
+
+	// next record of the replay
+	bool next_record_loaded;		/**< Indicates that next_frame and next_event are valid. */
+	uint32_t next_frame;			/**< Frame of the next event or of the end of the replay. */
+	SDL_Event next_event;			/**< The next event to replay. */
+	bool ended;						/**< Indicates that the end record was read (or the file is truncated):
+									 * next_frame is then the last frame to replay. */
+};
+
+#endif
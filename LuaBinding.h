@@ -0,0 +1,378 @@
+/** @file LuaBinding.h */
+
+#ifndef KQ_LUA_BINDING_H
+#define KQ_LUA_BINDING_H
+
+#include "Common.h"
+#include "ExportableToLua.h"
+#include "lua.hpp"
+#include <string>
+
+/**
+* @brief Compile-time glue between C++ userdata types and Lua.
+*
+* LuaType<T> identifies the metatable of a userdata type. The identity is
+* captured once when the type is registered, so checking an argument is a
+* pointer comparison instead of a registry lookup by name.
+*
+* LuaMethod0/1/2 turn a member function pointer into a lua_CFunction at
+* compile time. Use the KQ_LUA_METHOD() macro to get one:
+* @code
+* { "is_suspended", KQ_LUA_METHOD(&Timer::is_suspended) },
+* @endcode
+* The object is checked at index 1 and the arguments at the following
+* indices with LuaArg<A>::check(). The result (if any) is pushed with
+* LuaResult<R>::push().
+*
+* Only the Lua state owned by the LuaContext registers userdata types, so
+* each type has a single metatable identity at a time.
+*/
+template<typename T>
+class LuaType
+{
+public:
+	static void bind(lua_State* l, const std::string& module_name);
+	static bool is(lua_State* l, int index);
+	static T& check(lua_State* l, int index);
+
+private:
+	static const void* metatable;			/**< Identity of the metatable of this type (NULL if not registered). */
+	static const std::string* module_name;	/**< Name of this type in Lua, used in error messages. */
+};
+
+template<typename T>
+const void* LuaType<T>::metatable = NULL;
+
+template<typename T>
+const std::string* LuaType<T>::module_name = NULL;
+
+/**
+* @brief Remembers the metatable of this type.
+*
+* Call this after the type is registered with LuaContext::register_type().
+*
+* @param l A Lua state.
+* @param module_name Name of the type (e.g. "kq.surface").
+*/
+template<typename T>
+void LuaType<T>::bind(lua_State* l, const std::string& module_name)
+{
+	luaL_getmetatable(l, module_name.c_str());
+	LuaType<T>::metatable = lua_topointer(l, -1);
+	LuaType<T>::module_name = &module_name;
+	lua_pop(l, 1);
+}
+
+/**
+* @brief Returns whether a value is a userdata of this type.
+* @param l A Lua state.
+* @param index An index in the stack.
+* @return true if the value at this index has the metatable of this type.
+*/
+template<typename T>
+bool LuaType<T>::is(lua_State* l, int index)
+{
+	if(metatable == NULL || lua_type(l, index) != LUA_TUSERDATA || !lua_getmetatable(l, index))
+	{
+		return false;
+	}
+	bool result = (lua_topointer(l, -1) == metatable);
+	lua_pop(l, 1);
+	return result;
+}
+
+/**
+* @brief Checks that a value is a userdata of this type and returns it.
+*
+* Raises a Lua error if the value has another type.
+*
+* @param l A Lua state.
+* @param index An index in the stack.
+* @return The object at this index.
+*/
+template<typename T>
+T& LuaType<T>::check(lua_State* l, int index)
+{
+	if(!is(l, index))
+	{
+		luaL_typerror(l, index, module_name != NULL ? module_name->c_str() : "userdata");
+	}
+	ExportableToLua** userdata = static_cast<ExportableToLua**>(lua_touserdata(l, index));
+	return static_cast<T&>(**userdata);
+}
+
+/**
+* @brief Drawable objects have no metatable of their own: a value is a
+* drawable if it is a surface, a text surface or a sprite.
+*
+* Defined in DrawableAPI.cpp.
+*/
+template<>
+class LuaType<Drawable>
+{
+public:
+	static bool is(lua_State* l, int index);
+	static Drawable& check(lua_State* l, int index);
+};
+
+/**
+* @brief Converts a Lua argument to a C++ parameter of type A.
+*
+* Userdata parameters are passed by reference and checked by LuaType.
+*/
+template<typename A>
+struct LuaArg
+{
+	typedef A& Type;
+
+	static A& check(lua_State* l, int index)
+	{
+		return LuaType<A>::check(l, index);
+	}
+};
+
+template<typename A>
+struct LuaArg<A&>: public LuaArg<A>
+{
+};
+
+template<>
+struct LuaArg<int>
+{
+	typedef int Type;
+
+	static int check(lua_State* l, int index)
+	{
+		return luaL_checkint(l, index);
+	}
+};
+
+/**
+* @brief Unsigned parameters (durations, dates...) must be positive or zero:
+* a negative value would become a huge one.
+*/
+template<>
+struct LuaArg<uint32_t>
+{
+	typedef uint32_t Type;
+
+	static uint32_t check(lua_State* l, int index)
+	{
+		int value = luaL_checkint(l, index);
+		if(value < 0)
+		{
+			luaL_argerror(l, index, "must be positive or zero");
+		}
+		return uint32_t(value);
+	}
+};
+
+/**
+* @brief Boolean parameters default to true when omitted, like the
+* set_something([value]) functions of the API.
+*/
+template<>
+struct LuaArg<bool>
+{
+	typedef bool Type;
+
+	static bool check(lua_State* l, int index)
+	{
+		return lua_isnone(l, index) || lua_toboolean(l, index);
+	}
+};
+
+/**
+* @brief String parameters as C strings point to the Lua string itself:
+* no copy is made, and the argument stays on the stack during the call.
+*/
+template<>
+struct LuaArg<const char*>
+{
+	typedef const char* Type;
+
+	static const char* check(lua_State* l, int index)
+	{
+		return luaL_checkstring(l, index);
+	}
+};
+
+template<>
+struct LuaArg<const std::string&>
+{
+	typedef std::string Type;
+
+	static std::string check(lua_State* l, int index)
+	{
+		size_t size;
+		const char* value = luaL_checklstring(l, index, &size);
+		return std::string(value, size);
+	}
+};
+
+/**
+* @brief Pushes the result of a C++ function of type R onto the Lua stack.
+*/
+template<typename R>
+struct LuaResult;
+
+template<>
+struct LuaResult<int>
+{
+	static int push(lua_State* l, int value)
+	{
+		lua_pushinteger(l, value);
+		return 1;
+	}
+};
+
+template<>
+struct LuaResult<uint32_t>
+{
+	static int push(lua_State* l, uint32_t value)
+	{
+		lua_pushinteger(l, value);
+		return 1;
+	}
+};
+
+template<>
+struct LuaResult<bool>
+{
+	static int push(lua_State* l, bool value)
+	{
+		lua_pushboolean(l, value);
+		return 1;
+	}
+};
+
+template<>
+struct LuaResult<const std::string&>
+{
+	static int push(lua_State* l, const std::string& value)
+	{
+		lua_pushlstring(l, value.data(), value.size());
+		return 1;
+	}
+};
+
+/**
+* @brief Binds a member function with no parameters.
+*/
+template<typename T, typename R>
+struct LuaMethod0
+{
+	template<R (T::*method)()>
+	static int call(lua_State* l)
+	{
+		T& object = LuaType<T>::check(l, 1);
+		return LuaResult<R>::push(l, (object.*method)());
+	}
+};
+
+template<typename T>
+struct LuaMethod0<T, void>
+{
+	template<void (T::*method)()>
+	static int call(lua_State* l)
+	{
+		T& object = LuaType<T>::check(l, 1);
+		(object.*method)();
+		return 0;
+	}
+};
+
+template<typename T, typename R>
+struct LuaConstMethod0
+{
+	template<R (T::*method)() const>
+	static int call(lua_State* l)
+	{
+		T& object = LuaType<T>::check(l, 1);
+		return LuaResult<R>::push(l, (object.*method)());
+	}
+};
+
+/**
+* @brief Binds a member function with one parameter.
+*/
+template<typename T, typename R, typename A1>
+struct LuaMethod1
+{
+	template<R (T::*method)(A1)>
+	static int call(lua_State* l)
+	{
+		T& object = LuaType<T>::check(l, 1);
+		typename LuaArg<A1>::Type arg1 = LuaArg<A1>::check(l, 2);
+		return LuaResult<R>::push(l, (object.*method)(arg1));
+	}
+};
+
+template<typename T, typename A1>
+struct LuaMethod1<T, void, A1>
+{
+	template<void (T::*method)(A1)>
+	static int call(lua_State* l)
+	{
+		T& object = LuaType<T>::check(l, 1);
+		typename LuaArg<A1>::Type arg1 = LuaArg<A1>::check(l, 2);
+		(object.*method)(arg1);
+		return 0;
+	}
+};
+
+/**
+* @brief Binds a member function with two parameters.
+*/
+template<typename T, typename R, typename A1, typename A2>
+struct LuaMethod2
+{
+	template<R (T::*method)(A1, A2)>
+	static int call(lua_State* l)
+	{
+		T& object = LuaType<T>::check(l, 1);
+		typename LuaArg<A1>::Type arg1 = LuaArg<A1>::check(l, 2);
+		typename LuaArg<A2>::Type arg2 = LuaArg<A2>::check(l, 3);
+		return LuaResult<R>::push(l, (object.*method)(arg1, arg2));
+	}
+};
+
+template<typename T, typename A1, typename A2>
+struct LuaMethod2<T, void, A1, A2>
+{
+	template<void (T::*method)(A1, A2)>
+	static int call(lua_State* l)
+	{
+		T& object = LuaType<T>::check(l, 1);
+		typename LuaArg<A1>::Type arg1 = LuaArg<A1>::check(l, 2);
+		typename LuaArg<A2>::Type arg2 = LuaArg<A2>::check(l, 3);
+		(object.*method)(arg1, arg2);
+		return 0;
+	}
+};
+
+// Deduce the binder of a member function pointer (only used in decltype).
+template<typename T, typename R>
+LuaMethod0<T, R> lua_method_binder(R (T::*)());
+template<typename T, typename R>
+LuaConstMethod0<T, R> lua_method_binder(R (T::*)() const);
+template<typename T, typename R, typename A1>
+LuaMethod1<T, R, A1> lua_method_binder(R (T::*)(A1));
+template<typename T, typename R, typename A1, typename A2>
+LuaMethod2<T, R, A1, A2> lua_method_binder(R (T::*)(A1, A2));
+
+template<typename B>
+struct LuaBinder
+{
+	typedef B Type;
+};
+
+/**
+* @brief Returns the lua_CFunction that calls a member function.
+* @param method A pointer to a (non-overloaded) member function, e.g.
+* &Timer::is_suspended.
+*/
+#define KQ_LUA_METHOD(method) \
+	(&LuaBinder<decltype(lua_method_binder(method))>::Type::template call<method>)
+
+#endif
@@ -0,0 +1,251 @@
+/** @file LuaBytecodeCache.cpp */
+
+#include "LuaBytecodeCache.h"
+#include "FileTools.h"
+#include "lua.hpp"
+#include <cstring>
+#include <vector>
+#include <map>
+#include <iostream>
+
+// LuaJIT and Lua 5.1 bytecodes are not compatible: use a different magic.
+#ifdef KQ_LUAJIT
+const char LuaBytecodeCache::header_magic[] = "KQLCJ01";
+#else
+const char LuaBytecodeCache::header_magic[] = "KQLC501";
+#endif
+
+// The magic (with its terminating zero) followed by the 64-bit source hash.
+const size_t LuaBytecodeCache::header_size = sizeof(header_magic) + sizeof(uint64_t);
+
+std::map<std::string, std::string> LuaBytecodeCache::chunks;
+
+/**
+* @brief Loads a quest script as a Lua function, from its cache if possible.
+*
+* This function acts like luaL_loadbuffer() on the content of the file:
+* on success, the function is pushed onto the stack and 0 is returned.
+* Otherwise, the error message is pushed and an error code is returned.
+*
+* @param l A Lua state.
+* @param file_name Name of an existing script, relative to the data directory.
+* @return 0 in case of success, or an error code of luaL_loadbuffer().
+*/
+int LuaBytecodeCache::load(lua_State* l, const std::string& file_name)
+{
+	size_t size;
+	char* buffer;
+	FileTools::data_file_open_buffer(file_name, &buffer, &size);
+	uint64_t hash = get_hash(buffer, size);
+
+	// Chunks shipped with the quest first, then the ones compiled during this run.
+	if(load_cache(l, get_cache_file_name(file_name), hash, file_name))
+	{
+		FileTools::data_file_close_buffer(buffer);
+		return 0;
+	}
+
+	std::map<std::string, std::string>::const_iterator it = chunks.find(file_name);
+	if(it != chunks.end() && load_chunk(l, it->second.data(), it->second.size(), hash, file_name))
+	{
+		FileTools::data_file_close_buffer(buffer);
+		return 0;
+	}
+
+	int result = luaL_loadbuffer(l, buffer, size, file_name.c_str());
+	FileTools::data_file_close_buffer(buffer);
+
+	if(result == 0)
+	{
+		dump_chunk(l, hash, chunks[file_name]);
+	}
+	return result;
+}
+
+/**
+* @brief Compiles all scripts of the quest and saves their chunks.
+*
+* The chunks are saved in the "luac" directory of the quest write directory.
+* Copy this directory into the quest data (or data.kq) to ship them.
+*
+* @return The number of scripts compiled.
+*/
+int LuaBytecodeCache::precompile_all()
+{
+	const std::string& quest_write_dir = FileTools::get_quest_write_dir();
+	if(quest_write_dir.empty())
+	{
+		std::cerr << "Cannot precompile scripts: no write directory was specified in quest.dat\n";
+		return 0;
+	}
+
+	std::vector<std::string> file_names;
+	FileTools::data_files_find("", ".lua", file_names);
+
+	lua_State* l = luaL_newstate();
+	int nb_compiled = 0;
+	std::vector<std::string>::const_iterator it;
+	for(it = file_names.begin(); it != file_names.end(); ++it)
+	{
+		const std::string& file_name = *it;
+		if(FileTools::data_file_is_in_write_dir(file_name))
+		{
+			// Not a quest file.
+			continue;
+		}
+
+		size_t size;
+		char* buffer;
+		FileTools::data_file_open_buffer(file_name, &buffer, &size);
+		uint64_t hash = get_hash(buffer, size);
+		int result = luaL_loadbuffer(l, buffer, size, file_name.c_str());
+		FileTools::data_file_close_buffer(buffer);
+
+		if(result != 0)
+		{
+			std::cerr << "Cannot compile '" << file_name << "': " << lua_tostring(l, -1) << '\n';
+		}
+		else
+		{
+			std::string chunk;
+			if(dump_chunk(l, hash, chunk))
+			{
+				const std::string& cache_file_name = quest_write_dir + "/" + get_cache_file_name(file_name);
+				FileTools::data_file_mkdir(cache_file_name.substr(0, cache_file_name.rfind('/')));
+				FileTools::data_file_save_buffer(cache_file_name, chunk.data(), chunk.size());
+				nb_compiled++;
+			}
+		}
+		lua_pop(l, 1);
+	}
+	lua_close(l);
+
+	std::cout << nb_compiled << " scripts compiled into '" << quest_write_dir << "/luac' of the write directory\n";
+	return nb_compiled;
+}
+
+/**
+* @brief Computes the hash that identifies the content of a script.
+*
+* This is a 64-bit FNV-1a hash.
+*
+* @param buffer The source of the script.
+* @param size Size of the buffer in bytes.
+* @return The hash.
+*/
+uint64_t LuaBytecodeCache::get_hash(const char* buffer, size_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= uint8_t(buffer[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+* @brief Returns the name of the cache file of a script.
+* @param file_name Name of a script (e.g. "menus/title.lua").
+* @return Name of its cache file relative to a data or write directory
+* (e.g. "luac/menus/title.luac").
+*/
+std::string LuaBytecodeCache::get_cache_file_name(const std::string& file_name)
+{
+	return "luac/" + file_name + "c";
+}
+
+/**
+* @brief Loads a chunk from a cache file of the quest data if it is up to date.
+*
+* On success, the function is pushed onto the stack. Otherwise, the stack
+* is left unchanged.
+*
+* Lua does not verify bytecode: a file of the write directory could have
+* been modified by anyone, so it is never loaded.
+*
+* @param l A Lua state.
+* @param cache_file_name Name of the cache file.
+* @param hash Hash of the current source of the script.
+* @param file_name Name of the script (used as chunk name).
+* @return true if the chunk was loaded.
+*/
+bool LuaBytecodeCache::load_cache(lua_State* l, const std::string& cache_file_name,
+		uint64_t hash, const std::string& file_name)
+{
+	if(!FileTools::data_file_exists(cache_file_name) || FileTools::data_file_is_in_write_dir(cache_file_name))
+	{
+		return false;
+	}
+
+	size_t size;
+	char* buffer;
+	FileTools::data_file_open_buffer(cache_file_name, &buffer, &size);
+	bool loaded = load_chunk(l, buffer, size, hash, file_name);
+	FileTools::data_file_close_buffer(buffer);
+	return loaded;
+}
+
+/**
+* @brief Loads a chunk dumped by dump_chunk() if it is up to date.
+*
+* On success, the function is pushed onto the stack. Otherwise, the stack
+* is left unchanged.
+*
+* @param l A Lua state.
+* @param chunk The header and the bytecode.
+* @param size Size of the chunk in bytes.
+* @param hash Hash of the current source of the script.
+* @param file_name Name of the script (used as chunk name).
+* @return true if the chunk was loaded.
+*/
+bool LuaBytecodeCache::load_chunk(lua_State* l, const char* chunk, size_t size,
+		uint64_t hash, const std::string& file_name)
+{
+	if(size <= header_size
+		|| std::memcmp(chunk, header_magic, sizeof(header_magic)) != 0
+		|| std::memcmp(chunk + sizeof(header_magic), &hash, sizeof(hash)) != 0)
+	{
+		return false;
+	}
+
+	if(luaL_loadbuffer(l, chunk + header_size, size - header_size, file_name.c_str()) != 0)
+	{
+		// Corrupted cache or built by another version of Lua: compile the source.
+		lua_pop(l, 1);
+		return false;
+	}
+	return true;
+}
+
+/**
+* @brief Dumps the function on top of the stack, preceded by the header.
+* @param l A Lua state, with the compiled script on top of the stack.
+* @param hash Hash of the source of the script.
+* @param chunk Receives the header and the bytecode.
+* @return true in case of success.
+*/
+bool LuaBytecodeCache::dump_chunk(lua_State* l, uint64_t hash, std::string& chunk)
+{
+	chunk.assign(header_magic, sizeof(header_magic));
+	chunk.append(reinterpret_cast<const char*>(&hash), sizeof(hash));
+	if(lua_dump(l, write_chunk, &chunk) != 0)
+	{
+		chunk.clear();
+		return false;
+	}
+	return true;
+}
+
+/**
+* @brief lua_Writer that appends a dumped chunk to a std::string.
+* @param data The bytes to write.
+* @param size Number of bytes.
+* @param user_data The destination std::string.
+* @return 0 (no error).
+*/
+int LuaBytecodeCache::write_chunk(lua_State* /* l */, const void* data, size_t size, void* user_data)
+{
+	static_cast<std::string*>(user_data)->append(static_cast<const char*>(data), size);
+	return 0;
+}
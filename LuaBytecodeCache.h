@@ -0,0 +1,54 @@
+/** @file LuaBytecodeCache.h */
+
+#ifndef KQ_LUA_BYTECODE_CACHE_H
+#define KQ_LUA_BYTECODE_CACHE_H
+
+#include "Common.h"
+#include <string>
+#include <map>
+
+struct lua_State;
+
+/**
+* @brief Loads quest scripts through a cache of compiled Lua chunks.
+*
+* Compiling a script from source costs more than loading its bytecode.
+* A quest can ship precompiled chunks in its own "luac" directory
+* ("luac/<script>c", inside data.kq or the data directory). They are used
+* as long as the hash of the source is unchanged: editing a script
+* invalidates its chunk automatically. Run the engine with -lua-precompile
+* to generate them all into the quest write directory, then copy them.
+*
+* Lua does not verify bytecode, so chunks are never read back from the
+* write directory, where any program can modify them. The chunks compiled
+* during a run are only kept in memory, for the next loads of the same
+* script (e.g. after a reset).
+*/
+class LuaBytecodeCache
+{
+public:
+
+	static int load(lua_State* l, const std::string& file_name);
+	static int precompile_all();
+
+private:
+
+	// we don't need to instantiate this class
+	LuaBytecodeCache();
+
+	static uint64_t get_hash(const char* buffer, size_t size);
+	static std::string get_cache_file_name(const std::string& file_name);
+	static bool load_cache(lua_State* l, const std::string& cache_file_name,
+		uint64_t hash, const std::string& file_name);
+	static bool load_chunk(lua_State* l, const char* chunk, size_t size,
+		uint64_t hash, const std::string& file_name);
+	static bool dump_chunk(lua_State* l, uint64_t hash, std::string& chunk);
+	static int write_chunk(lua_State* l, const void* data, size_t size, void* user_data);
+
+	static const char header_magic[];	/**< First bytes of a cache file, identifying the Lua backend. */
+	static const size_t header_size;	/**< Size of the magic and the source hash. */
+	static std::map<std::string, std::string>
+		chunks;							/**< Chunks compiled during this run, by script name. */
+};
+
+#endif
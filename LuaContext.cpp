@@ -2,13 +2,33 @@
 
 #include "LuaContext.h"
 #include "FileTools.h"
+#include "LuaBytecodeCache.h"
+#include "LuaProfiler.h"
+#include "System.h"
 #include <string>
 #include <sstream>
 #include <cassert>
+#include <cstring>
 
 std::map<lua_State*, LuaContext*> LuaContext::lua_contexts;
 
-LuaContext::LuaContext(MainLoop& main_loop): l(NULL), main_loop(main_loop) 
+const uint32_t LuaContext::default_gc_budget = 2;
+const int LuaContext::gc_step_size = 4;
+
+const char* const LuaContext::callback_names[] =
+{
+	"on_started",
+	"on_finished",
+	"on_update",
+	"on_draw",
+	"on_key_pressed",
+	"on_key_released",
+	"on_character_pressed",
+	"on_closed"
+};
+
+LuaContext::LuaContext(MainLoop& main_loop): l(NULL), main_loop(main_loop),
+	nb_updates(0), gc_budget(default_gc_budget), gc_paused(false), gc_cycle_running(false), gc_threshold(0)
 {
 }
 
@@ -19,13 +39,24 @@ LuaContext::~LuaContext()
 
 /**
 * @brief Returns the LuaContext object that encapsulates a Lua state.
-* @param l A Lua state.
+* Coroutines have their own lua_State: they are found through the
+* registry, which all threads of a Lua state share.
+*
+* @param l A Lua state or one of its threads.
 * @return The LuaContext object encapsulating this Lua state.
 */
 LuaContext& LuaContext::get_lua_context(lua_State* l) 
 {
   std::map<lua_State*, LuaContext*>::iterator it = lua_contexts.find(l);
-  return *it->second;
+  if (it != lua_contexts.end()) 
+  {
+    return *it->second;
+  }
+
+  lua_getfield(l, LUA_REGISTRYINDEX, "kq.lua_context");
+  LuaContext* lua_context = static_cast<LuaContext*>(lua_touserdata(l, -1));
+  lua_pop(l, 1);
+  return *lua_context;
 }
 
 /**
@@ -46,6 +77,8 @@ void LuaContext::initialize()
 
 	//Associate this LuaContext object with the lua_State pointer
 	lua_contexts[l] = this;
+	lua_pushlightuserdata(l, this);
+	lua_setfield(l, LUA_REGISTRYINDEX, "kq.lua_context");
 
 	//Table to keep track of all userdata
 	lua_newtable(l);
@@ -65,6 +98,12 @@ void LuaContext::initialize()
 
 	//Register the C++ functions and types accessible by Lua
 	register_modules();
+	register_ffi_fast_paths();
+
+	//Track the event handlers that main.lua will define
+	push_main(l);
+	enable_callbacks(-1, main_callbacks);
+	lua_pop(l, 1);
 
 	//Make require() able to load Lua files even from the data.kq archive
 	lua_getglobal(l, "kq");
@@ -78,6 +117,10 @@ void LuaContext::initialize()
 	//Execute the main file
 	do_file_if_exists(l, "main");
 	main_on_started();	
+
+	//From now on, collect garbage in the spare time of the main loop
+	set_gc_budget(gc_budget);
+	restart_gc_cycle();
 }
 
 /**
@@ -94,11 +137,19 @@ void LuaContext::exit()
 		destroy_menus();
 		destroy_timers();
 		destroy_drawables();
+		destroy_coroutines();
+		destroy_workers();
+
+		if(LuaProfiler::is_running())
+		{
+			LuaProfiler::stop(l);
+		}
 
 		//Finalize lua
 		lua_close(l);
 		lua_contexts.erase(l);
 		l = NULL;
+		main_callbacks.enabled = false;
 	}
 }
 
@@ -107,8 +158,152 @@ void LuaContext::update()
 	update_drawables();
 	update_menus();
 	update_timers();
+	update_coroutines();
+	update_workers();
+	update_gc();
+
+	main_on_update();
+}
+
+/**
+* @brief Returns the time allowed to the garbage collector in each frame.
+* @return The budget in milliseconds (0 means that Lua collects
+* automatically whenever it allocates).
+*/
+uint32_t LuaContext::get_gc_budget()
+{
+	return gc_budget;
+}
+
+/**
+* @brief Sets the time allowed to the garbage collector in each frame.
+*
+* With a non-zero budget, the automatic collector of Lua is stopped and
+* the main loop runs incremental steps in its spare time before the next
+* frame (see collect_garbage()), so that a collection cycle does not land
+* in the middle of a frame.
+*
+* @param gc_budget The budget in milliseconds, or 0 to let Lua collect
+* automatically.
+*/
+void LuaContext::set_gc_budget(uint32_t gc_budget)
+{
+	this->gc_budget = gc_budget;
+
+	if(l != NULL && !gc_paused)
+	{
+		lua_gc(l, gc_budget == 0 ? LUA_GCRESTART : LUA_GCSTOP, 0);
+	}
+}
+
+/**
+* @brief Returns whether scripts have suspended garbage collection.
+* @return true if garbage collection is paused.
+*/
+bool LuaContext::is_gc_paused()
+{
+	return gc_paused;
+}
+
+/**
+* @brief Suspends or resumes garbage collection.
+*
+* Scripts can pause it during critical sections. Memory is not collected at
+* all while paused, so keep these sections short.
+*
+* @param gc_paused true to pause garbage collection, false to resume it.
+*/
+void LuaContext::set_gc_paused(bool gc_paused)
+{
+	this->gc_paused = gc_paused;
+
+	if(l != NULL)
+	{
+		lua_gc(l, (gc_paused || gc_budget != 0) ? LUA_GCSTOP : LUA_GCRESTART, 0);
+	}
+}
+
+/**
+* @brief Runs incremental steps of the garbage collector until a date.
+*
+* The main loop calls this function in its spare time. Nothing is done if
+* there is no collection cycle to run.
+*
+* @param deadline Date when the collector must stop (in nanoseconds, like
+* System::get_real_time_ns()).
+* @return Time spent collecting in nanoseconds.
+*/
+uint64_t LuaContext::collect_garbage(uint64_t deadline)
+{
+	if(l == NULL || gc_paused || gc_budget == 0 || !gc_cycle_running)
+	{
+		return 0;
+	}
+
+	uint64_t start_date = System::get_real_time_ns();
+	uint64_t now = start_date;
+	while(gc_cycle_running && now < deadline)
+	{
+		step_gc();
+		now = System::get_real_time_ns();
+	}
+	return now - start_date;
+}
+
+/**
+* @brief Decides whether a garbage collection cycle should start.
+*
+* A cycle starts when memory has doubled since the end of the last one,
+* like the default pause of the Lua collector. If the main loop never has
+* spare time and memory keeps growing, steps are also run here so that
+* memory stays bounded.
+*/
+void LuaContext::update_gc()
+{
+	if(gc_paused || gc_budget == 0)
+	{
+		return;
+	}
 
-	//main_on_update();
+	int memory = lua_gc(l, LUA_GCCOUNT, 0);
+	if(memory >= gc_threshold)
+	{
+		gc_cycle_running = true;
+	}
+
+	if(memory >= 2 * gc_threshold)
+	{
+		// The collector is late.
+		step_gc();
+	}
+}
+
+/**
+* @brief Runs one incremental step of the garbage collector.
+*/
+void LuaContext::step_gc()
+{
+	bool finished = lua_gc(l, LUA_GCSTEP, gc_step_size) != 0;
+
+	// A step also rearms the automatic collector: stop it again.
+	lua_gc(l, LUA_GCSTOP, 0);
+
+	if(finished)
+	{
+		restart_gc_cycle();
+	}
+}
+
+/**
+* @brief Waits for memory to grow before starting the next garbage
+* collection cycle.
+*
+* Called when a cycle has just finished.
+*/
+void LuaContext::restart_gc_cycle()
+{
+	gc_cycle_running = false;
+	gc_threshold = 2 * lua_gc(l, LUA_GCCOUNT, 0);
 }
 
 /**
@@ -228,6 +423,7 @@ void LuaContext::register_modules()
 	//register_video_module();*/
 	register_menu_module();
 	//register_language_module();
+	register_worker_module();
 }
 
 /**
@@ -483,11 +679,27 @@ int LuaContext::userdata_meta_index_as_table(lua_State* l)
   return 1;
 }
 
-const std::string LuaContext::check_string_field(lua_State* l, int table_index, const std::string& key)
+/**
+* @brief Checks that a table field is a string and returns it.
+*
+* This function acts like lua_getfield() followed by luaL_checkstring(),
+* except that numbers are not accepted: the string returned is the one
+* stored in the table, so it remains valid as long as the table keeps it.
+* No copy is made.
+*
+* @param l A Lua state.
+* @param table_index Index of a table in the stack.
+* @param key Key of the field to get in that table.
+* @return The wanted field as a string owned by Lua.
+*/
+const char* LuaContext::check_string_field(lua_State* l, int table_index, const char* key)
 {
-	lua_getfield(l, table_index, key.c_str());
-	//TODO error checking
-	const std::string& value = lua_tostring(l, -1);
+	lua_getfield(l, table_index, key);
+	if(lua_type(l, -1) != LUA_TSTRING)
+	{
+		luaL_error(l, "Bad field '%s' (string expected, got %s)", key, luaL_typename(l, -1));
+	}
+	const char* value = lua_tostring(l, -1);
 	lua_pop(l, 1);
 	return value;
 }
@@ -495,30 +707,30 @@ const std::string LuaContext::check_string_field(lua_State* l, int table_index,
 /**
 * @brief Like check_string_field() but with a default value.
 *
-* This function acts like lua_getfield() followed by luaL_optstring().
+* This function acts like lua_getfield() followed by luaL_optstring(),
+* without accepting numbers either.
 *
 * @param l A Lua state.
 * @param table_index Index of a table in the stack.
 * @param key Key of the field to get in that table.
 * @param default_value The default value to return if the field is \c nil.
-* @return The wanted field as a string.
+* @return The wanted field as a string owned by Lua, or default_value.
 */
-const std::string LuaContext::opt_string_field(lua_State* l, int table_index, const std::string& key,
-		const std::string& default_value)
+const char* LuaContext::opt_string_field(lua_State* l, int table_index, const char* key,
+		const char* default_value)
 {
-	lua_getfield(l, table_index, key.c_str());
-	std::string value;
-	if(lua_isnil(l, -1))
-	{
-		value = default_value;
-	}
-	else
+	lua_getfield(l, table_index, key);
+	const char* value = default_value;
+	if(!lua_isnil(l, -1))
 	{
-		if(!lua_isstring(l, -1))
+		if(lua_type(l, -1) != LUA_TSTRING)
 		{
 			std::cerr << "Error: string expected.\n";
 		}
-		value = lua_tostring(l, -1);
+		else
+		{
+			value = lua_tostring(l, -1);
+		}
 	}
 	lua_pop(l, 1);
 	return value;
@@ -534,9 +746,9 @@ const std::string LuaContext::opt_string_field(lua_State* l, int table_index, co
 * @param default_value The default value to return if the field is \c nil.
 * @return The wanted field as an integer.
 */
-int LuaContext::opt_int_field(lua_State* l, int table_index, const std::string& key, int default_value) 
+int LuaContext::opt_int_field(lua_State* l, int table_index, const char* key, int default_value) 
 {
-  lua_getfield(l, table_index, key.c_str());
+  lua_getfield(l, table_index, key);
   int value = default_value;
   if (!lua_isnil(l, -1)) 
   {
@@ -563,9 +775,9 @@ int LuaContext::opt_int_field(lua_State* l, int table_index, const std::string&
 * @param default_value The default value to return if the field is \c nil.
 * @return The wanted field as a string.
 */
-bool LuaContext::opt_boolean_field(lua_State* l, int table_index, const std::string& key, bool default_value)
+bool LuaContext::opt_boolean_field(lua_State* l, int table_index, const char* key, bool default_value)
 {
-	lua_getfield(l, table_index, key.c_str());
+	lua_getfield(l, table_index, key);
 	bool value = default_value;
 	if (!lua_isnil(l, -1)) 
 	{
@@ -695,6 +907,212 @@ bool LuaContext::find_method(int index, const std::string& function_name)
 	}
 	return exists;
 }
+
+/**
+* @brief Starts caching the event handlers of a table.
+*
+* The handlers already defined are moved to a hidden table that becomes
+* the __index of the object, and a __newindex metamethod catches further
+* assignments of handlers to keep the refs up to date. Other fields are
+* left in the object. Reading a handler from Lua still works as usual.
+*
+* Tables that already have a metatable (e.g. instances of a class) are not
+* cached: their handlers keep being looked up by name.
+*
+* @param index Index of the object in the stack.
+* @param callbacks The cache to fill.
+*/
+void LuaContext::enable_callbacks(int index, LuaCallbacks& callbacks)
+{
+	index = get_positive_index(l, index);
+
+	if(lua_type(l, index) != LUA_TTABLE)
+	{
+		return;
+	}
+	if(lua_getmetatable(l, index))
+	{
+		lua_pop(l, 1);
+		return;
+	}
+
+	lua_newtable(l);
+									// ... handlers
+	for(int i = 0; i < CALLBACK_NB; i++)
+	{
+		lua_pushstring(l, callback_names[i]);
+		lua_rawget(l, index);
+									// ... handlers handler/nil
+		if(!lua_isnil(l, -1))
+		{
+			lua_pushvalue(l, -1);
+			lua_setfield(l, -3, callback_names[i]);
+			lua_pushstring(l, callback_names[i]);
+			lua_pushnil(l);
+			lua_rawset(l, index);
+		}
+
+		if(lua_isfunction(l, -1))
+		{
+			callbacks.refs[i] = create_ref();
+		}
+		else
+		{
+			callbacks.refs[i] = LUA_REFNIL;
+			lua_pop(l, 1);
+		}
+									// ... handlers
+	}
+
+	lua_newtable(l);
+									// ... handlers meta
+	lua_pushvalue(l, -2);
+	lua_setfield(l, -2, "__index");
+	lua_pushlightuserdata(l, &callbacks);
+	lua_pushvalue(l, -3);
+	lua_pushcclosure(l, l_callbacks_newindex, 2);
+	lua_setfield(l, -2, "__newindex");
+	lua_setmetatable(l, index);
+									// ... handlers
+	lua_pop(l, 1);
+
+	callbacks.enabled = true;
+}
+
+/**
+* @brief Stops caching the event handlers of a table.
+*
+* The handlers are put back in the table and its metatable is removed.
+*
+* @param index Index of the object in the stack.
+* @param callbacks The cache to release.
+*/
+void LuaContext::disable_callbacks(int index, LuaCallbacks& callbacks)
+{
+	if(!callbacks.enabled)
+	{
+		return;
+	}
+	index = get_positive_index(l, index);
+
+	if(lua_getmetatable(l, index))
+	{
+									// ... meta
+		lua_getfield(l, -1, "__index");
+									// ... meta handlers
+		if(lua_istable(l, -1))
+		{
+			lua_pushnil(l);
+			while(lua_next(l, -2) != 0)
+			{
+									// ... meta handlers key handler
+				lua_pushvalue(l, -2);
+				lua_insert(l, -2);
+				lua_rawset(l, index);
+									// ... meta handlers key
+			}
+		}
+		lua_pop(l, 2);
+		lua_pushnil(l);
+		lua_setmetatable(l, index);
+	}
+
+	for(int i = 0; i < CALLBACK_NB; i++)
+	{
+		destroy_ref(callbacks.refs[i]);
+	}
+	callbacks.enabled = false;
+}
+
+/**
+* @brief Returns whether an object may handle an event.
+*
+* This does not call Lua: use it to skip objects before pushing them.
+*
+* @param callbacks Cached event handlers of the object, or NULL.
+* @param callback An event.
+* @return false if the object is known not to handle this event.
+*/
+bool LuaContext::has_callback(const LuaCallbacks* callbacks, Callback callback)
+{
+	return callbacks == NULL
+		|| !callbacks->enabled
+		|| callbacks->refs[callback] != LUA_REFNIL;
+}
+
+/**
+* @brief Gets the handler of an event of the object on top of the stack.
+*
+* Like find_method(), if the handler exists, the handler and the object
+* are both pushed so that you can call it immediately with the object as
+* first parameter. Otherwise, the stack is left unchanged.
+*
+* @param callbacks Cached event handlers of the object, or NULL to look
+* up the handler by name.
+* @param callback An event.
+* @return true if the handler was found.
+*/
+bool LuaContext::find_callback(const LuaCallbacks* callbacks, Callback callback)
+{
+	if(callbacks == NULL || !callbacks->enabled)
+	{
+		return find_method(callback_names[callback]);
+	}
+
+	int ref = callbacks->refs[callback];
+	if(ref == LUA_REFNIL)
+	{
+		return false;
+	}
+	push_ref(l, ref);
+	lua_pushvalue(l, -2);
+	return true;
+}
+
+/**
+* @brief __newindex of the objects whose event handlers are cached.
+*
+* Upvalues: the LuaCallbacks cache and the table of handlers.
+*
+* @param l The Lua context that is calling this function.
+* @return Number of values to return to Lua.
+*/
+int LuaContext::l_callbacks_newindex(lua_State* l)
+{
+	lua_settop(l, 3);
+									// object key value
+	if(lua_type(l, 2) == LUA_TSTRING)
+	{
+		const char* key = lua_tostring(l, 2);
+		for(int i = 0; i < CALLBACK_NB; i++)
+		{
+			if(std::strcmp(key, callback_names[i]) == 0)
+			{
+				lua_pushvalue(l, 2);
+				lua_pushvalue(l, 3);
+				lua_rawset(l, lua_upvalueindex(2));
+
+				// The registry is shared by all threads of the state.
+				LuaCallbacks& callbacks = *static_cast<LuaCallbacks*>(lua_touserdata(l, lua_upvalueindex(1)));
+				luaL_unref(l, LUA_REGISTRYINDEX, callbacks.refs[i]);
+				if(lua_isfunction(l, 3))
+				{
+					lua_pushvalue(l, 3);
+					callbacks.refs[i] = luaL_ref(l, LUA_REGISTRYINDEX);
+				}
+				else
+				{
+					callbacks.refs[i] = LUA_REFNIL;
+				}
+				return 0;
+			}
+		}
+	}
+
+	lua_rawset(l, 1);
+	return 0;
+}
+
 /**
 * @brief Opens a script if it exists and lets it on top of the stack as a
 * function.
@@ -712,27 +1130,19 @@ bool LuaContext::load_file_if_exists(lua_State* l, const std::string& script_nam
 
 	if(!FileTools::data_file_exists(file_name))
 	{
-		std::ostringstream oss;
-		oss << script_name << ".lua";
-		file_name = oss.str();
+		file_name += ".lua";
 
-		if(FileTools::data_file_exists(file_name))
+		if(!FileTools::data_file_exists(file_name))
 		{
-			size_t size;
-			char* buffer;
-			FileTools::data_file_open_buffer(file_name, &buffer, &size);
-			int result = luaL_loadbuffer(l, buffer, size, file_name.c_str());
-			FileTools::data_file_close_buffer(buffer);
-			
-			if(result != 0)
-			{
-				std::cerr << "Failed to load script.\n";
-			}
-			return true;
+			return false;
 		}
-		return false;
 	}
-	  
+
+	if(LuaBytecodeCache::load(l, file_name) != 0)
+	{
+		std::cerr << "Failed to load script '" << file_name << "': " << lua_tostring(l, -1) << '\n';
+	}
+	return true;
 }
 
 bool LuaContext::do_file_if_exists(lua_State* l, const std::string& script_name)
@@ -801,8 +1211,20 @@ bool LuaContext::call_function(int nb_arguments, int nb_results, const std::stri
 */
 bool LuaContext::call_function(lua_State* l, int nb_arguments, int nb_results, const std::string& function_name)
 {
-	
-	if(lua_pcall(l, nb_arguments, nb_results, 0) != 0)
+	bool profiling = LuaProfiler::is_running();
+	if(profiling)
+	{
+		LuaProfiler::notify_call_started(l, function_name);
+	}
+
+	int status = lua_pcall(l, nb_arguments, nb_results, 0);
+
+	if(profiling)
+	{
+		LuaProfiler::notify_call_finished(l);
+	}
+
+	if(status != 0)
 	{
 		std::cerr << "Error in function " << function_name << '\n';
 		std::cerr << lua_tostring(l, -1) << std::endl;
@@ -816,10 +1238,11 @@ bool LuaContext::call_function(lua_State* l, int nb_arguments, int nb_results, c
 
 /**
 * @brief Calls the on_started() method of the object on top of the stack.
+* @param callbacks Cached event handlers of the object, or NULL.
 */
-void LuaContext::on_started()
+void LuaContext::on_started(const LuaCallbacks* callbacks)
 {
-	if(find_method("on_started"))
+	if(find_callback(callbacks, CALLBACK_ON_STARTED))
 	{
 		call_function(1, 0, "on_started");
 	}
@@ -827,10 +1250,11 @@ void LuaContext::on_started()
 
 /**
 * \brief Calls the on_finished() method of the object on top of the stack.
+* \param callbacks Cached event handlers of the object, or NULL.
 */
-void LuaContext::on_finished() 
+void LuaContext::on_finished(const LuaCallbacks* callbacks) 
 {
-  if (find_method("on_finished")) 
+  if (find_callback(callbacks, CALLBACK_ON_FINISHED)) 
   {
     call_function(1, 0, "on_finished");
   }
@@ -838,22 +1262,36 @@ void LuaContext::on_finished()
 
 /**
 * \brief Calls the on_closed() method of the object on top of the stack.
+* \param callbacks Cached event handlers of the object, or NULL.
 */
-void LuaContext::on_closed() 
+void LuaContext::on_closed(const LuaCallbacks* callbacks) 
 {
-  if (find_method("on_closed")) 
+  if (find_callback(callbacks, CALLBACK_ON_CLOSED)) 
   {
     call_function(1, 0, "on_closed");
   }
 }
 
+/**
+* @brief Calls the on_update() method of the object on top of the stack.
+* @param callbacks Cached event handlers of the object, or NULL.
+*/
+void LuaContext::on_update(const LuaCallbacks* callbacks) 
+{
+  if (find_callback(callbacks, CALLBACK_ON_UPDATE)) 
+  {
+    call_function(1, 0, "on_update");
+  }
+}
+
 /**
 * @brief Calls the on_draw() method of the object on top of the stack.
 * @param dst_surface The destination surface.
+* @param callbacks Cached event handlers of the object, or NULL.
 */
-void LuaContext::on_draw(Surface& dst_surface) 
+void LuaContext::on_draw(Surface& dst_surface, const LuaCallbacks* callbacks) 
 {
-  if (find_method("on_draw")) 
+  if (find_callback(callbacks, CALLBACK_ON_DRAW)) 
   {
     push_surface(l, dst_surface);
     call_function(2, 0, "on_draw");
@@ -863,9 +1301,10 @@ void LuaContext::on_draw(Surface& dst_surface)
 /**
 * @brief Calls an input callback method of the object on top of the stack.
 * @param event The input event to forward.
+* @param callbacks Cached event handlers of the object, or NULL.
 * @return \c true if the event was handled and should stop being propagated.
 */
-bool LuaContext::on_input(InputEvent& event) 
+bool LuaContext::on_input(InputEvent& event, const LuaCallbacks* callbacks) 
 {
   // Call the Lua function(s) corresponding to this input event.
   bool handled = false;
@@ -874,7 +1313,7 @@ bool LuaContext::on_input(InputEvent& event)
     // Keyboard.
     if (event.is_keyboard_key_pressed()) 
 	{
-      handled = on_key_pressed(event) || handled;/*
+      handled = on_key_pressed(event, callbacks) || handled;/*
       if (event.is_character_pressed()) 
 	  {
         handled = on_character_pressed(event) || handled;
@@ -914,12 +1353,13 @@ bool LuaContext::on_input(InputEvent& event)
 * that a keyboard key was just pressed
 * (including if it is a directional key or a character).
 * @param event The corresponding input event.
+* @param callbacks Cached event handlers of the object, or NULL.
 * @return \c true if the event was handled and should stop being propagated.
 */
-bool LuaContext::on_key_pressed(InputEvent& event) 
+bool LuaContext::on_key_pressed(InputEvent& event, const LuaCallbacks* callbacks) 
 {
   bool handled = false;
-  if (find_method("on_key_pressed")) 
+  if (find_callback(callbacks, CALLBACK_ON_KEY_PRESSED)) 
   {
     const std::string& key_name = InputEvent::get_keyboard_key_name(event.get_keyboard_key());
     if (!key_name.empty()) 
@@ -6,6 +6,7 @@
 #include "Common.h"
 #include "lua.hpp"
 #include "MainLoop.h"
+#include "TimerScheduler.h"
 #include <map>
 #include <list>
 #include <set>
@@ -14,6 +15,10 @@ class MainLoop;
 
 class LuaContext
 {
+private:
+
+	struct LuaCallbacks;
+
 public:
 
 	//functions and types
@@ -24,6 +29,7 @@ public:
 	static const std::string game_module_name;		/**< kq.game */
 	static const std::string audio_module_name;		/**< kq.audio */
 	static const std::string text_surface_module_name; /**< kq.text_surface */
+	static const std::string worker_module_name;	/**< kq.worker */
 
 	LuaContext(MainLoop& main_loop);
     ~LuaContext();
@@ -47,11 +53,11 @@ public:
 	//Lua helpers
 	static bool is_color(lua_State* l, int index);
     static Color check_color(lua_State* l, int index);
-	static const std::string check_string_field(lua_State* l, int table_index, const std::string& key);
-	static const std::string opt_string_field(lua_State* l, int table_index, const std::string& key, 
-		const std::string& default_value);
-	static int opt_int_field(lua_State* l, int table_index, const std::string& key, int default_value);
-	static bool opt_boolean_field(lua_State* l, int table_index, const std::string& key, bool default_value);
+	static const char* check_string_field(lua_State* l, int table_index, const char* key);
+	static const char* opt_string_field(lua_State* l, int table_index, const char* key,
+		const char* default_value);
+	static int opt_int_field(lua_State* l, int table_index, const char* key, int default_value);
+	static bool opt_boolean_field(lua_State* l, int table_index, const char* key, bool default_value);
 
 	template<typename E>
     static E check_enum(lua_State* l, int index, const std::string names[]);
@@ -73,6 +79,7 @@ public:
     void destroy_timers();
     void update_timers();
     void notify_timers_map_suspended(bool suspended);
+	void run_timer_benchmark(int nb_timers);
 
 	//Menus
 	void add_menu(int menu_ref, int context_index);
@@ -81,6 +88,19 @@ public:
 	void destroy_menus();
 	void update_menus();
 
+	//Workers
+	void add_worker(LuaWorker* worker, int callback_index);
+	void remove_worker(LuaWorker* worker);
+	void destroy_workers();
+	void update_workers();
+
+	//Garbage collection
+	uint32_t get_gc_budget();
+	void set_gc_budget(uint32_t gc_budget);
+	bool is_gc_paused();
+	void set_gc_paused(bool gc_paused);
+	uint64_t collect_garbage(uint64_t deadline);
+
 	//Drawable objects
 	bool has_drawable(Drawable* drawable);
 	void add_drawable(Drawable* drawable);
@@ -96,11 +116,11 @@ public:
     bool main_on_input(InputEvent& event);
 
 	//Menu events
-	void menu_on_started(int menu_ref);
-	void menu_on_finished(int menu_ref);
-    void menu_on_update(int menu_ref);
-    void menu_on_draw(int menu_ref, Surface& dst_surface);
-    bool menu_on_input(int menu_ref, InputEvent& event);
+	void menu_on_started(int menu_ref, const LuaCallbacks* callbacks = NULL);
+	void menu_on_finished(int menu_ref, const LuaCallbacks* callbacks = NULL);
+    void menu_on_update(int menu_ref, const LuaCallbacks* callbacks = NULL);
+    void menu_on_draw(int menu_ref, Surface& dst_surface, const LuaCallbacks* callbacks = NULL);
+    bool menu_on_input(int menu_ref, InputEvent& event, const LuaCallbacks* callbacks = NULL);
     //bool menu_on_command_pressed(int menu_ref, GameCommands::Command command);
     //bool menu_on_command_released(int menu_ref, GameCommands::Command command);
     void menus_on_update(int context_index);
@@ -137,10 +157,39 @@ public:
 		main_api_save_settings,
 		main_api_get_distance,
 		main_api_get_angle,
+		main_api_get_gc_budget,
+		main_api_set_gc_budget,
+		main_api_is_gc_paused,
+		main_api_set_gc_paused,
+		main_api_start_profiler,
+		main_api_stop_profiler,
+		main_api_start_coroutine,
+		main_api_sleep,
+		main_api_wait_frames,
+		main_api_wait_for,
+
+		//Worker API
+		worker_api_start,
+		worker_api_send,
+		worker_api_stop,
 
 		//Audio API
 		audio_api_play_sound,
 		audio_api_preload_sounds,
+		audio_api_get_preload_progress,
+		audio_api_get_sound_priority,
+		audio_api_set_sound_priority,
+		audio_api_is_sound_pinned,
+		audio_api_set_sound_pinned,
+		audio_api_get_sound_memory,
+		audio_api_set_sound_memory_budget,
+		audio_api_get_sound_storage,
+		audio_api_set_sound_storage,
+		audio_api_get_stats,
+		audio_api_play_music,
+		audio_api_stop_music,
+		audio_api_get_music_volume,
+		audio_api_set_music_volume,
 	  
 		//Menu API
 		menu_api_start,
@@ -151,14 +200,10 @@ public:
 		timer_api_start,
 		timer_api_stop,
 		timer_api_stop_all,
-		timer_api_is_with_sound,
-		timer_api_set_with_sound,
-		timer_api_is_suspended,
-		timer_api_set_suspended,
-		timer_api_is_suspended_with_map,
-		timer_api_set_suspended_with_map,
-		// TODO add get_remaining_time, set_remaining_time,
-		// TODO allow to repeat a timer automatically
+		// is_with_sound, set_with_sound, is_suspended, set_suspended,
+		// is_suspended_with_map, set_suspended_with_map, get_remaining_time,
+		// set_remaining_time, is_repeating and set_repeating are bound
+		// directly to Timer with KQ_LUA_METHOD.
 		// TODO remove is_with_sound, set_with_sound (do this in pure Lua, possibly with a second timer)
 		// TODO game:is_suspended, timer:is/set_suspended_with_map, sprite:get/set_ignore_suspend
 		// are the same concept, make these names consistent
@@ -188,14 +233,10 @@ public:
 		text_surface_api_set_horizontal_alignment,
 		text_surface_api_get_vertical_alignment,
 		text_surface_api_set_vertical_alignment,
-		text_surface_api_get_font,
-		text_surface_api_set_font,
 		text_surface_api_get_rendering_mode,
 		text_surface_api_set_rendering_mode,
 		text_surface_api_get_color,
 		text_surface_api_set_color,
-		text_surface_api_get_text,
-		text_surface_api_set_text,
 		text_surface_api_set_text_key,
 		text_surface_api_get_size,
 
@@ -257,10 +298,45 @@ public:
 
 private:
 
+	/**
+	* @brief Events that the engine calls on Lua objects.
+	*/
+	enum Callback
+	{
+		CALLBACK_ON_STARTED,
+		CALLBACK_ON_FINISHED,
+		CALLBACK_ON_UPDATE,
+		CALLBACK_ON_DRAW,
+		CALLBACK_ON_KEY_PRESSED,
+		CALLBACK_ON_KEY_RELEASED,
+		CALLBACK_ON_CHARACTER_PRESSED,
+		CALLBACK_ON_CLOSED,
+		CALLBACK_NB
+	};
+
+	/**
+	* @brief Event handlers of a Lua table, cached as refs.
+	*
+	* While the cache is enabled, the handlers are kept out of the table
+	* itself so that any assignment goes through __newindex and updates the
+	* refs (see enable_callbacks()). The engine then knows without any Lua
+	* call which events an object handles.
+	*/
+	struct LuaCallbacks
+	{
+		bool enabled;				/**< false if the object is not cached: its handlers are looked up by name. */
+		int refs[CALLBACK_NB];		/**< Ref to the function handling each event, or LUA_REFNIL. */
+
+		LuaCallbacks(): enabled(false)
+		{
+		}
+	};
+
 	struct LuaMenuData
 	{
 		int ref;
 		const void* context;		/**< Lua table or userdata the menu is attached to. */
+		LuaCallbacks callbacks;		/**< Event handlers of the menu. */
 
 		LuaMenuData(int ref, const void* context): ref(ref), context(context)
 		{
@@ -273,24 +349,63 @@ private:
 		const void* context;	/**< Lua table or userdata the timer is attached to */
 	};
 
+	struct LuaCoroutineData
+	{
+		int ref;				/**< Lua ref to the thread, to keep it alive while it is suspended. */
+		bool waiting;			/**< Indicates that the last yield came from sleep(), wait_frames() or wait_for(). */
+		int waited_object_ref;	/**< Lua ref to the object passed to wait_for(), or LUA_REFNIL. */
+	};
+
 	//Functions exported to Lua for internal needs
-	static FunctionExportedToLua l_loader;
+	static FunctionExportedToLua l_loader,
+		l_callbacks_newindex;
+
+	static const char* const callback_names[CALLBACK_NB];	/**< Lua name of each event. */
 
 	lua_State* l;
 	MainLoop& main_loop;
-	std::list<LuaMenuData> menus;
+	LuaCallbacks main_callbacks;	/**< Event handlers of kq.main. */
+	std::map<const void*, std::list<LuaMenuData> >
+		menus;						/**< Menus of each context (table or userdata), in their order of start. */
+	std::set<const void*> contexts_with_removed_menus;	/**< Contexts whose menu list has entries to erase. */
 	std::map<Timer*, LuaTimerData> timers;
+	TimerScheduler timer_scheduler;	/**< The running timers, by date of their next event. */
 	std::list<Timer*> timers_to_remove;
 	std::set<Drawable*> drawables;
 	std::set<Drawable*> drawables_to_remove;
 
+	std::map<lua_State*, LuaCoroutineData> coroutines;	/**< Coroutines started by kq.main.start_coroutine(). */
+	std::multimap<uint64_t, lua_State*>
+		sleeping_coroutines;		/**< Coroutines in sleep(), by date of wake up in ns. */
+	std::multimap<uint32_t, lua_State*>
+		coroutines_waiting_frames;	/**< Coroutines in wait_frames(), by number of the update to resume at. */
+	std::list<std::pair<lua_State*, Drawable*> >
+		coroutines_waiting_transitions;	/**< Coroutines in wait_for(), with the drawable awaited. */
+	uint32_t nb_updates;		/**< Number of calls to update() so far. */
+
+	std::map<LuaWorker*, int> workers;		/**< Workers started by scripts, with the ref of their callback. */
+	std::list<LuaWorker*> workers_to_remove;	/**< Workers stopped, to destroy at the next update. */
+
+	uint32_t gc_budget;			/**< Maximum time in ms of garbage collection per frame
+								 * (0 means that Lua collects automatically). */
+	bool gc_paused;				/**< Indicates that scripts suspended garbage collection. */
+	bool gc_cycle_running;		/**< Indicates that a collection cycle is in progress. */
+	int gc_threshold;			/**< Memory in KB from which the next cycle starts. */
 
 
+
+	static const uint32_t default_gc_budget;	/**< Garbage collection time per frame by default in ms. */
+	static const int gc_step_size;				/**< Size of each incremental garbage collection step. */
+
 	static std::map<lua_State*, LuaContext*> lua_contexts;	/**< Mapping to get the encapsulated object from the 
 															 *   lua_State pointer. */
 	//Executing Lua code.
 	bool find_method(int index, const std::string& function_name);
 	bool find_method(const std::string& function_name);
+	void enable_callbacks(int index, LuaCallbacks& callbacks);
+	void disable_callbacks(int index, LuaCallbacks& callbacks);
+	static bool has_callback(const LuaCallbacks* callbacks, Callback callback);
+	bool find_callback(const LuaCallbacks* callbacks, Callback callback);
 	bool call_function(int nb_arguments, int nb_results, const std::string& function_name);
 	static bool call_function(lua_State* l, int nb_arguments, int nb_results, const std::string& function_name);
 	static void load_file(lua_State* l, const std::string& script_name);
@@ -298,6 +413,23 @@ private:
 	static void do_file(lua_State* l, const std::string& script_name);
 	static bool do_file_if_exists(lua_State* l, const std::string& script_name);
 
+	//Coroutines
+	void add_coroutine(lua_State* thread, int thread_ref);
+	void resume_coroutine(lua_State* thread, int nb_arguments);
+	void destroy_coroutine(std::map<lua_State*, LuaCoroutineData>::iterator it);
+	void remove_coroutine_waits(lua_State* thread);
+	void destroy_coroutines();
+	void update_coroutines();
+	static LuaCoroutineData& check_coroutine(lua_State* l);
+
+	//Menus
+	static const void* get_menu_context(lua_State* l, int context_index);
+
+	//Garbage collection
+	void update_gc();
+	void step_gc();
+	void restart_gc_cycle();
+
 	//Initialization of modules
 	void register_functions(const std::string& module_name, const luaL_Reg* functions);
 	void register_type(const std::string& module_name, const luaL_Reg* methods, const luaL_Reg* metamethods);
@@ -317,6 +449,8 @@ private:
 	void register_video_module();
 	void register_menu_module();
 	void register_language_module();
+	void register_worker_module();
+	void register_ffi_fast_paths();
 
 	//Pushing objects to Lua
 	static void push_ref(lua_State* l, int ref);
@@ -327,6 +461,7 @@ private:
 	static void push_surface(lua_State* l, Surface& surface);
 	static void push_text_surface(lua_State* l, TextSurface& text_surface);
 	static void push_game(lua_State* l, Savegame& game);
+	static void push_worker(lua_State* l, LuaWorker& worker);
 
 
 	//Getting userdata objects from Lua.
@@ -340,15 +475,15 @@ private:
     static Savegame& check_game(lua_State* l, int index);
 
 	//Events
-	void on_started();
-	void on_finished();
-	void on_update();
-	void on_draw(Surface& dst_surface);
-	bool on_input(InputEvent& event);
-	bool on_key_pressed(InputEvent& event);
-	bool on_key_released(InputEvent& event);
-	bool on_character_pressed(InputEvent& event);
-	void on_closed();
+	void on_started(const LuaCallbacks* callbacks = NULL);
+	void on_finished(const LuaCallbacks* callbacks = NULL);
+	void on_update(const LuaCallbacks* callbacks = NULL);
+	void on_draw(Surface& dst_surface, const LuaCallbacks* callbacks = NULL);
+	bool on_input(InputEvent& event, const LuaCallbacks* callbacks = NULL);
+	bool on_key_pressed(InputEvent& event, const LuaCallbacks* callbacks = NULL);
+	bool on_key_released(InputEvent& event, const LuaCallbacks* callbacks = NULL);
+	bool on_character_pressed(InputEvent& event, const LuaCallbacks* callbacks = NULL);
+	void on_closed(const LuaCallbacks* callbacks = NULL);
 
 };
 
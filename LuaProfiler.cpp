@@ -0,0 +1,224 @@
+/** @file LuaProfiler.cpp */
+
+#include "LuaProfiler.h"
+#include "FileTools.h"
+#include "lua.hpp"
+#include <sstream>
+
+bool LuaProfiler::running = false;
+int LuaProfiler::sampling_interval = 1000;
+std::map<lua_State*, std::vector<LuaProfiler::Call> > LuaProfiler::calls;
+std::map<std::string, int> LuaProfiler::samples;
+
+/**
+* @brief Starts sampling the Lua stack.
+*
+* Samples of a previous run are discarded.
+* Existing coroutines must be hooked too with add_thread().
+*
+* @param l The main Lua state.
+* @param sampling_interval Number of Lua instructions between two samples.
+*/
+void LuaProfiler::start(lua_State* l, int sampling_interval)
+{
+	samples.clear();
+	calls.clear();
+	running = true;
+	LuaProfiler::sampling_interval = sampling_interval;
+	lua_sethook(l, hook, LUA_MASKCOUNT, sampling_interval);
+}
+
+/**
+* @brief Stops sampling the Lua stack.
+*
+* The samples are kept until the next start() so that they can be saved.
+* Known coroutines should be unhooked too with remove_thread().
+*
+* @param l The main Lua state.
+*/
+void LuaProfiler::stop(lua_State* l)
+{
+	lua_sethook(l, NULL, 0, 0);
+	running = false;
+	calls.clear();
+}
+
+/**
+* @brief Samples the stack of a Lua thread too.
+*
+* Does nothing if the profiler is not running.
+*
+* @param thread A coroutine.
+*/
+void LuaProfiler::add_thread(lua_State* thread)
+{
+	if(running)
+	{
+		lua_sethook(thread, hook, LUA_MASKCOUNT, sampling_interval);
+	}
+}
+
+/**
+* @brief Stops sampling the stack of a Lua thread.
+* @param thread A coroutine.
+*/
+void LuaProfiler::remove_thread(lua_State* thread)
+{
+	lua_sethook(thread, NULL, 0, 0);
+	calls.erase(thread);
+}
+
+/**
+* @brief Saves the samples in folded format.
+* @param file_name Name of the file to write, relative to the quest write directory.
+* @return true in case of success, false if there is no quest write directory.
+*/
+bool LuaProfiler::save(const std::string& file_name)
+{
+	const std::string& quest_write_dir = FileTools::get_quest_write_dir();
+	if(quest_write_dir.empty())
+	{
+		return false;
+	}
+
+	std::ostringstream oss;
+	std::map<std::string, int>::const_iterator it;
+	for(it = samples.begin(); it != samples.end(); ++it)
+	{
+		oss << it->first << ' ' << it->second << '\n';
+	}
+
+	const std::string& text = oss.str();
+	FileTools::data_file_save_buffer(quest_write_dir + "/" + file_name, text.c_str(), text.size());
+	return true;
+}
+
+/**
+* @brief Notifies the profiler that the engine is about to call a Lua function.
+*
+* Call this just before lua_pcall() and only if the profiler is running.
+*
+* @param l The Lua state profiled.
+* @param function_name A name describing the function called.
+*/
+void LuaProfiler::notify_call_started(lua_State* l, const std::string& function_name)
+{
+	Call call;
+	call.function_name = function_name;
+	call.level = get_stack_depth(l);
+	calls[l].push_back(call);
+}
+
+/**
+* @brief Notifies the profiler that a Lua function called by the engine has
+* returned.
+* @param l The Lua state profiled.
+*/
+void LuaProfiler::notify_call_finished(lua_State* l)
+{
+	std::map<lua_State*, std::vector<Call> >::iterator it = calls.find(l);
+	if(it != calls.end() && !it->second.empty())
+	{
+		it->second.pop_back();
+	}
+}
+
+/**
+* @brief Notifies the profiler that the engine is about to resume a coroutine.
+*
+* The body of the coroutine is named "coroutine" instead of the event on
+* top of the main thread. Call this only if the profiler is running.
+*
+* @param thread The coroutine.
+*/
+void LuaProfiler::notify_coroutine_resumed(lua_State* thread)
+{
+	std::vector<Call>& thread_calls = calls[thread];
+	if(thread_calls.empty())
+	{
+		Call call;
+		call.function_name = "coroutine";
+		call.level = 0;
+		thread_calls.push_back(call);
+	}
+}
+
+/**
+* @brief Returns the number of functions currently running in a Lua state.
+* @param l A Lua state.
+* @return The depth of its call stack.
+*/
+int LuaProfiler::get_stack_depth(lua_State* l)
+{
+	lua_Debug ar;
+	int depth = 0;
+	while(lua_getstack(l, depth, &ar))
+	{
+		depth++;
+	}
+	return depth;
+}
+
+/**
+* @brief The count hook: records the current stack.
+* @param l The Lua state profiled.
+*/
+void LuaProfiler::hook(lua_State* l, lua_Debug* /* ar */)
+{
+	if(!running)
+	{
+		// A thread that inherited the hook before stop().
+		lua_sethook(l, NULL, 0, 0);
+		return;
+	}
+
+	std::vector<std::string> frames;
+	lua_Debug frame;
+	for(int level = 0; lua_getstack(l, level, &frame); level++)
+	{
+		lua_getinfo(l, "Sln", &frame);
+
+		const char* source = frame.source;
+		if(*source == '@' || *source == '=')
+		{
+			source++;
+		}
+
+		std::ostringstream oss;
+		oss << (frame.name != NULL ? frame.name : "?") << '@' << source;
+		if(frame.currentline > 0)
+		{
+			oss << ':' << frame.currentline;
+		}
+		frames.push_back(oss.str());
+	}
+
+	// Name the functions called by the engine.
+	int depth = int(frames.size());
+	std::map<lua_State*, std::vector<Call> >::const_iterator thread_calls = calls.find(l);
+	if(thread_calls != calls.end())
+	{
+		std::vector<Call>::const_iterator it;
+		for(it = thread_calls->second.begin(); it != thread_calls->second.end(); ++it)
+		{
+			int index = depth - 1 - it->level;
+			if(index >= 0 && index < depth && frames[index].compare(0, 2, "?@") == 0)
+			{
+				frames[index] = it->function_name + frames[index].substr(1);
+			}
+		}
+	}
+
+	// Fold the stack, starting from the outermost function.
+	std::string stack;
+	std::vector<std::string>::const_reverse_iterator it2;
+	for(it2 = frames.rbegin(); it2 != frames.rend(); ++it2)
+	{
+		if(!stack.empty())
+		{
+			stack += ';';
+		}
+		stack += *it2;
+	}
+	samples[stack]++;
+}
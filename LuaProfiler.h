@@ -0,0 +1,86 @@
+/** @file LuaProfiler.h */
+
+#ifndef KQ_LUA_PROFILER_H
+#define KQ_LUA_PROFILER_H
+
+#include "Common.h"
+#include <string>
+#include <vector>
+#include <map>
+
+struct lua_State;
+struct lua_Debug;
+
+/**
+* @brief Sampling profiler of the quest scripts.
+*
+* While running, a Lua count hook samples the Lua call stack every given
+* number of instructions. Each stack is recorded as a list of frames
+* "function@source:line" from the outermost one, and identical stacks are
+* counted together. The result is saved in the folded format read by
+* flame graph tools: one stack per line, frames separated by ';', followed
+* by the number of samples.
+*
+* Functions called by the engine (kq.main.on_draw(), menu events, timer
+* callbacks...) have no name from the Lua point of view: LuaContext
+* notifies the profiler of each call so that these frames get the name of
+* the event. These calls are kept per Lua thread, and the body of a
+* coroutine resumed by the engine is named "coroutine".
+*
+* Hooks belong to each Lua thread: the main state and the coroutines known
+* when the profiler starts are hooked, and new threads inherit the hook of
+* their creator. A thread that still has the hook after stop() removes it
+* at its next sample.
+*
+* When the profiler is not running, no hook is installed and the only cost
+* is one test per call from C++ to Lua.
+*/
+class LuaProfiler
+{
+public:
+
+	static bool is_running();
+	static void start(lua_State* l, int sampling_interval);
+	static void stop(lua_State* l);
+	static void add_thread(lua_State* thread);
+	static void remove_thread(lua_State* thread);
+	static bool save(const std::string& file_name);
+
+	static void notify_call_started(lua_State* l, const std::string& function_name);
+	static void notify_call_finished(lua_State* l);
+	static void notify_coroutine_resumed(lua_State* thread);
+
+private:
+
+	/**
+	* @brief A Lua function called by the engine.
+	*/
+	struct Call
+	{
+		std::string function_name;	/**< Name describing the function. */
+		int level;					/**< Level of the function in the stack, from the bottom. */
+	};
+
+	// we don't need to instantiate this class
+	LuaProfiler();
+
+	static void hook(lua_State* l, lua_Debug* ar);
+	static int get_stack_depth(lua_State* l);
+
+	static bool running;						/**< Indicates that the hook is installed. */
+	static int sampling_interval;				/**< Number of Lua instructions between two samples. */
+	static std::map<lua_State*, std::vector<Call> >
+		calls;									/**< Lua functions currently called by the engine, by thread. */
+	static std::map<std::string, int> samples;	/**< Number of samples of each folded stack. */
+};
+
+/**
+* @brief Returns whether the profiler is running.
+* @return true if stacks are being sampled.
+*/
+inline bool LuaProfiler::is_running()
+{
+	return running;
+}
+
+#endif
@@ -0,0 +1,387 @@
+/** @file LuaWorker.cpp */
+
+#include "LuaWorker.h"
+#include "LuaContext.h"
+#include "lua.hpp"
+#include <iostream>
+
+const int LuaMessage::max_depth = 32;
+const int LuaWorker::stop_check_interval = 10000;
+
+/**
+* @brief Creates a nil message.
+*/
+LuaMessage::LuaMessage(): type(LUA_TNIL), boolean(false), number(0.0)
+{
+}
+
+/**
+* @brief Copies a value of a Lua stack into this message.
+* @param l A Lua state.
+* @param index Index of the value to copy.
+* @param error Receives the reason of the failure if the value cannot be copied.
+* @return true in case of success.
+*/
+bool LuaMessage::read(lua_State* l, int index, std::string& error)
+{
+	return read(l, index, 0, error);
+}
+
+/**
+* @brief Copies a value of a Lua stack into this message.
+* @param l A Lua state.
+* @param index Index of the value to copy.
+* @param depth Number of tables containing this value.
+* @param error Receives the reason of the failure if the value cannot be copied.
+* @return true in case of success.
+*/
+bool LuaMessage::read(lua_State* l, int index, int depth, std::string& error)
+{
+	index = LuaContext::get_positive_index(l, index);
+	type = lua_type(l, index);
+
+	switch(type)
+	{
+	case LUA_TNIL:
+		break;
+
+	case LUA_TBOOLEAN:
+		boolean = lua_toboolean(l, index) != 0;
+		break;
+
+	case LUA_TNUMBER:
+		number = lua_tonumber(l, index);
+		break;
+
+	case LUA_TSTRING:
+		{
+			size_t size;
+			const char* value = lua_tolstring(l, index, &size);
+			string.assign(value, size);
+		}
+		break;
+
+	case LUA_TTABLE:
+		if(depth >= max_depth)
+		{
+			error = "tables are nested too deeply (or contain themselves)";
+			return false;
+		}
+		lua_pushnil(l);
+		while(lua_next(l, index) != 0)
+		{
+			fields.push_back(LuaMessage());
+			fields.push_back(LuaMessage());
+			size_t i = fields.size() - 2;
+			if(!fields[i].read(l, -2, depth + 1, error)
+				|| !fields[i + 1].read(l, -1, depth + 1, error))
+			{
+				lua_pop(l, 2);
+				return false;
+			}
+			lua_pop(l, 1);
+		}
+		break;
+
+	default:
+		error = std::string("cannot send a value of type ") + lua_typename(l, type);
+		return false;
+	}
+	return true;
+}
+
+/**
+* @brief Pushes a copy of this message onto a Lua stack.
+* @param l A Lua state.
+*/
+void LuaMessage::push(lua_State* l) const
+{
+	switch(type)
+	{
+	case LUA_TBOOLEAN:
+		lua_pushboolean(l, boolean);
+		break;
+
+	case LUA_TNUMBER:
+		lua_pushnumber(l, number);
+		break;
+
+	case LUA_TSTRING:
+		lua_pushlstring(l, string.data(), string.size());
+		break;
+
+	case LUA_TTABLE:
+		lua_createtable(l, 0, int(fields.size() / 2));
+		for(size_t i = 0; i < fields.size(); i += 2)
+		{
+			fields[i].push(l);
+			fields[i + 1].push(l);
+			lua_rawset(l, -3);
+		}
+		break;
+
+	default:
+		lua_pushnil(l);
+		break;
+	}
+}
+
+/**
+* @brief Creates a worker. Call start() to run it.
+* @param script_name Name of the script (used as chunk name).
+* @param script Content of the script file.
+*/
+LuaWorker::LuaWorker(const std::string& script_name, const std::string& script):
+	script_name(script_name), script(script), l(NULL), running(false), stopping(false)
+{
+}
+
+/**
+* @brief Destroys the worker, stopping its thread if necessary.
+*/
+LuaWorker::~LuaWorker()
+{
+	stop();
+}
+
+/**
+* @brief Returns the name identifying this type in Lua.
+* @return The name identifying this type in Lua.
+*/
+const std::string& LuaWorker::get_lua_type_name() const
+{
+	return LuaContext::worker_module_name;
+}
+
+/**
+* @brief Starts the worker thread.
+*
+* The thread runs the script, then handles messages until stop() is called.
+*/
+void LuaWorker::start()
+{
+	running = true;
+	thread = std::thread(&LuaWorker::run, this);
+}
+
+/**
+* @brief Stops the worker thread and waits for it to finish.
+*
+* Messages not handled yet are dropped. Does nothing if the worker is
+* already stopped.
+*/
+void LuaWorker::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	message_sent.notify_one();
+
+	if(thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+/**
+* @brief Returns whether the worker thread is running.
+* @return false if the worker was stopped or its script failed to load.
+*/
+bool LuaWorker::is_running()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return running;
+}
+
+/**
+* @brief Sends a message to the worker (called by the main thread).
+* @param message The message.
+*/
+void LuaWorker::send(const LuaMessage& message)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		inbox.push_back(message);
+	}
+	message_sent.notify_one();
+}
+
+/**
+* @brief Takes the messages posted by the worker (called by the main thread).
+* @param messages Receives the messages, in the order they were posted.
+*/
+void LuaWorker::receive(std::list<LuaMessage>& messages)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	messages.splice(messages.end(), outbox);
+}
+
+/**
+* @brief Body of the worker thread.
+*/
+void LuaWorker::run()
+{
+	if(open())
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(!stopping)
+		{
+			if(inbox.empty())
+			{
+				message_sent.wait(lock);
+				continue;
+			}
+
+			std::list<LuaMessage> messages;
+			messages.splice(messages.end(), inbox);
+			lock.unlock();
+
+			std::list<LuaMessage>::const_iterator it;
+			for(it = messages.begin(); it != messages.end() && !stopping; ++it)
+			{
+				handle_message(*it);
+			}
+			lock.lock();
+		}
+	}
+
+	if(l != NULL)
+	{
+		lua_close(l);
+		l = NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	running = false;
+}
+
+/**
+* @brief Creates the sandboxed Lua state and runs the script.
+* @return true in case of success.
+*/
+bool LuaWorker::open()
+{
+	l = luaL_newstate();
+
+	// Only libraries without access to files or to the system.
+	static const lua_CFunction libraries[] =
+	{
+		luaopen_base,
+		luaopen_table,
+		luaopen_string,
+		luaopen_math
+	};
+	for(size_t i = 0; i < sizeof(libraries) / sizeof(libraries[0]); i++)
+	{
+		lua_pushcfunction(l, libraries[i]);
+		lua_call(l, 0, 0);
+	}
+	lua_pushnil(l);
+	lua_setglobal(l, "dofile");
+	lua_pushnil(l);
+	lua_setglobal(l, "loadfile");
+
+	lua_pushlightuserdata(l, this);
+	lua_setfield(l, LUA_REGISTRYINDEX, "kq.worker");
+	lua_sethook(l, check_stopping, LUA_MASKCOUNT, stop_check_interval);
+
+	lua_newtable(l);
+	lua_pushlightuserdata(l, this);
+	lua_pushcclosure(l, l_post, 1);
+	lua_setfield(l, -2, "post");
+	lua_setglobal(l, "worker");
+
+	if(luaL_loadbuffer(l, script.data(), script.size(), script_name.c_str()) != 0
+		|| lua_pcall(l, 0, 0, 0) != 0)
+	{
+		if(!stopping)
+		{
+			std::cerr << "Error in worker '" << script_name << "': " << lua_tostring(l, -1) << std::endl;
+		}
+		return false;
+	}
+	return true;
+}
+
+/**
+* @brief Calls worker.on_message() in the worker state.
+* @param message The message received.
+*/
+void LuaWorker::handle_message(const LuaMessage& message)
+{
+	lua_getglobal(l, "worker");
+	lua_getfield(l, -1, "on_message");
+	if(!lua_isfunction(l, -1))
+	{
+		lua_pop(l, 2);
+		return;
+	}
+
+	message.push(l);
+	if(lua_pcall(l, 1, 0, 0) != 0)
+	{
+		if(!stopping)
+		{
+			std::cerr << "Error in worker '" << script_name << "': " << lua_tostring(l, -1) << std::endl;
+		}
+		lua_pop(l, 1);
+	}
+	lua_pop(l, 1);
+}
+
+/**
+* @brief Implementation of worker.post() in the worker state.
+* @param l The worker Lua state.
+* @return Number of values to return to Lua.
+*/
+int LuaWorker::l_post(lua_State* l)
+{
+	LuaWorker* worker = static_cast<LuaWorker*>(lua_touserdata(l, lua_upvalueindex(1)));
+
+	// Lua errors must not skip the destructors: raise them out of this block.
+	bool posted;
+	{
+		LuaMessage message;
+		std::string error;
+		posted = message.read(l, 1, error);
+		if(posted)
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			worker->outbox.push_back(message);
+		}
+		else
+		{
+			lua_pushstring(l, error.c_str());
+		}
+	}
+
+	if(!posted)
+	{
+		luaL_argerror(l, 1, lua_tostring(l, -1));
+	}
+	return 0;
+}
+
+/**
+* @brief Hook of the worker state: aborts the script if the worker is
+* being stopped.
+*
+* Once the worker is stopping, the hook is called at each instruction and
+* raises the error again: a script that catches it with pcall() cannot run
+* any further, so stop() only waits for the error to reach the engine.
+*
+* @param l The worker Lua state.
+*/
+void LuaWorker::check_stopping(lua_State* l, lua_Debug* /* ar */)
+{
+	lua_getfield(l, LUA_REGISTRYINDEX, "kq.worker");
+	LuaWorker* worker = static_cast<LuaWorker*>(lua_touserdata(l, -1));
+	lua_pop(l, 1);
+
+	if(worker->stopping)
+	{
+		lua_sethook(l, check_stopping, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+		luaL_error(l, "worker stopped");
+	}
+}
@@ -0,0 +1,101 @@
+/** @file LuaWorker.h */
+
+#ifndef KQ_LUA_WORKER_H
+#define KQ_LUA_WORKER_H
+
+#include "Common.h"
+#include "ExportableToLua.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+struct lua_State;
+struct lua_Debug;
+
+/**
+* @brief A plain Lua value copied out of a Lua state.
+*
+* Only nil, booleans, numbers, strings and tables of these can be copied,
+* so that a message never refers to an object of the state it comes from.
+*/
+class LuaMessage
+{
+public:
+	LuaMessage();
+
+	bool read(lua_State* l, int index, std::string& error);
+	void push(lua_State* l) const;
+
+private:
+	bool read(lua_State* l, int index, int depth, std::string& error);
+
+	static const int max_depth;		/**< Maximum nesting of tables (also stops cycles). */
+
+	int type;						/**< Lua type of the value (LUA_TNIL, LUA_TBOOLEAN...). */
+	bool boolean;					/**< The value if it is a boolean. */
+	double number;					/**< The value if it is a number. */
+	std::string string;				/**< The value if it is a string. */
+	std::vector<LuaMessage> fields;	/**< Keys and values alternately if it is a table. */
+};
+
+/**
+* @brief A script running in its own Lua state on a separate thread.
+*
+* The worker state has no access to the engine: it only has the base,
+* table, string and math libraries (without the file functions) and a
+* global table "worker" to communicate:
+* - worker.on_message(message), defined by the script, is called for each
+*   message sent by the main thread;
+* - worker.post(message) sends a message to the main thread.
+*
+* Messages are copied (see LuaMessage). Messages posted by the worker are
+* delivered on the main thread when LuaContext::update() polls them.
+*
+* stop() interrupts the script even in the middle of a long job, so that
+* the main thread never waits for more than a few thousand instructions,
+* even if the script catches the interruption with pcall().
+*/
+class LuaWorker: public ExportableToLua
+{
+public:
+	LuaWorker(const std::string& script_name, const std::string& script);
+	~LuaWorker();
+
+	void start();
+	void stop();
+	bool is_running();
+
+	void send(const LuaMessage& message);
+	void receive(std::list<LuaMessage>& messages);
+
+	virtual const std::string& get_lua_type_name() const;
+
+private:
+	void run();
+	bool open();
+	void handle_message(const LuaMessage& message);
+
+	static int l_post(lua_State* l);
+	static void check_stopping(lua_State* l, lua_Debug* ar);
+
+	static const int stop_check_interval;	/**< Number of instructions between two checks of stop requests. */
+
+	std::string script_name;			/**< Name of the script, for error messages. */
+	std::string script;					/**< Source or bytecode of the script. */
+	lua_State* l;						/**< The worker Lua state (only used by the worker thread). */
+	std::thread thread;					/**< The worker thread. */
+
+	std::mutex mutex;					/**< Protects the fields below. */
+	std::condition_variable message_sent;	/**< Wakes up the worker thread. */
+	std::list<LuaMessage> inbox;		/**< Messages sent by the main thread, not handled yet. */
+	std::list<LuaMessage> outbox;		/**< Messages posted by the worker, not received yet. */
+	bool running;						/**< Indicates that the worker thread is running. */
+	std::atomic<bool> stopping;			/**< Indicates that the worker thread should finish
+										 * (also read by the worker without the mutex). */
+};
+
+#endif
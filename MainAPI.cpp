@@ -4,9 +4,13 @@
 #include "FileTools.h"
 #include "MainLoop.h"
 #include "Settings.h"
+#include "LuaProfiler.h"
+#include "Drawable.h"
+#include "System.h"
 #include "lua.hpp"
 #include <sstream>
 #include <cmath>
+#include <vector>
 
 const std::string LuaContext::main_module_name = "kq.main";
 
@@ -22,7 +26,17 @@ void LuaContext::register_main_module()
 		{ "get_quest_write_dir", main_api_get_quest_write_dir },
 		{ "set_quest_write_dir", main_api_set_quest_write_dir }*/,
 		{ "load_settings", main_api_load_settings },
-		{ "save_settings", main_api_save_settings },/*
+		{ "save_settings", main_api_save_settings },
+		{ "get_gc_budget", main_api_get_gc_budget },
+		{ "set_gc_budget", main_api_set_gc_budget },
+		{ "is_gc_paused", main_api_is_gc_paused },
+		{ "set_gc_paused", main_api_set_gc_paused },
+		{ "start_profiler", main_api_start_profiler },
+		{ "stop_profiler", main_api_stop_profiler },
+		{ "start_coroutine", main_api_start_coroutine },
+		{ "sleep", main_api_sleep },
+		{ "wait_frames", main_api_wait_frames },
+		{ "wait_for", main_api_wait_for },/*
 		{ "get_distance", main_api_get_distance },
 		{ "get_angle", main_api_get_angle },*/
 		{ NULL, NULL }
@@ -80,10 +94,458 @@ int LuaContext::main_api_save_settings(lua_State* l)
 	return 1;
 }
 
+/**
+* @brief Implementation of kq.main.get_gc_budget().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_get_gc_budget(lua_State* l)
+{
+	lua_pushinteger(l, get_lua_context(l).get_gc_budget());
+	return 1;
+}
+
+/**
+* @brief Implementation of kq.main.set_gc_budget().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_set_gc_budget(lua_State* l)
+{
+	int gc_budget = luaL_checkint(l, 1);
+	if(gc_budget < 0)
+	{
+		luaL_argerror(l, 1, "the budget must be positive or zero");
+	}
+
+	get_lua_context(l).set_gc_budget(uint32_t(gc_budget));
+	return 0;
+}
+
+/**
+* @brief Implementation of kq.main.is_gc_paused().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_is_gc_paused(lua_State* l)
+{
+	lua_pushboolean(l, get_lua_context(l).is_gc_paused());
+	return 1;
+}
+
+/**
+* @brief Implementation of kq.main.set_gc_paused().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_set_gc_paused(lua_State* l)
+{
+	bool gc_paused = lua_isnone(l, 1) || lua_toboolean(l, 1);
+	get_lua_context(l).set_gc_paused(gc_paused);
+	return 0;
+}
+
+/**
+* @brief Implementation of kq.main.start_profiler().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_start_profiler(lua_State* l)
+{
+	int sampling_interval = luaL_optint(l, 1, 1000);
+	if(sampling_interval <= 0)
+	{
+		luaL_argerror(l, 1, "the sampling interval must be positive");
+	}
+
+	// Hooks are per thread: hook the main state even if called from a coroutine.
+	LuaContext& lua_context = get_lua_context(l);
+	LuaProfiler::start(lua_context.l, sampling_interval);
+	std::map<lua_State*, LuaCoroutineData>::const_iterator it;
+	for(it = lua_context.coroutines.begin(); it != lua_context.coroutines.end(); ++it)
+	{
+		LuaProfiler::add_thread(it->first);
+	}
+	return 0;
+}
+
+/**
+* @brief Implementation of kq.main.stop_profiler().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_stop_profiler(lua_State* l)
+{
+	std::string file_name = luaL_optstring(l, 1, "profile.folded");
+
+	if(FileTools::get_quest_write_dir().empty())
+	{
+		luaL_error(l, "Cannot save the profile: no write directory was specified in quest.dat");
+	}
+
+	LuaContext& lua_context = get_lua_context(l);
+	std::map<lua_State*, LuaCoroutineData>::const_iterator it;
+	for(it = lua_context.coroutines.begin(); it != lua_context.coroutines.end(); ++it)
+	{
+		LuaProfiler::remove_thread(it->first);
+	}
+	LuaProfiler::stop(lua_context.l);
+	bool success = LuaProfiler::save(file_name);
+
+	lua_pushboolean(l, success);
+	return 1;
+}
+
+/**
+* @brief Implementation of kq.main.start_coroutine().
+*
+* The function starts running immediately, until it finishes or waits.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_start_coroutine(lua_State* l)
+{
+	luaL_checktype(l, 1, LUA_TFUNCTION);
+	int nb_arguments = lua_gettop(l) - 1;
+
+	LuaContext& lua_context = get_lua_context(l);
+	lua_State* thread = lua_newthread(l);
+	lua_insert(l, 1);
+									// thread function args...
+	lua_xmove(l, thread, nb_arguments + 1);
+									// thread
+	lua_pushvalue(l, 1);
+	int thread_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+
+	lua_context.add_coroutine(thread, thread_ref);
+	lua_context.resume_coroutine(thread, nb_arguments);
+
+	return 1;
+}
+
+/**
+* @brief Implementation of kq.main.sleep().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_sleep(lua_State* l)
+{
+	int delay = luaL_checkint(l, 1);
+	if(delay < 0)
+	{
+		luaL_argerror(l, 1, "the delay must be positive or zero");
+	}
+
+	LuaCoroutineData& coroutine = check_coroutine(l);
+	LuaContext& lua_context = get_lua_context(l);
+	lua_context.remove_coroutine_waits(l);
+	lua_context.sleeping_coroutines.insert(std::make_pair(System::now_ns() + uint64_t(delay) * 1000000, l));
+	coroutine.waiting = true;
+
+	return lua_yield(l, 0);
+}
+
+/**
+* @brief Implementation of kq.main.wait_frames().
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_wait_frames(lua_State* l)
+{
+	int nb_frames = luaL_optint(l, 1, 1);
+	if(nb_frames < 1)
+	{
+		luaL_argerror(l, 1, "the number of frames must be positive");
+	}
+
+	LuaCoroutineData& coroutine = check_coroutine(l);
+	LuaContext& lua_context = get_lua_context(l);
+	lua_context.remove_coroutine_waits(l);
+	lua_context.coroutines_waiting_frames.insert(std::make_pair(lua_context.nb_updates + uint32_t(nb_frames), l));
+	coroutine.waiting = true;
+
+	return lua_yield(l, 0);
+}
+
+/**
+* @brief Implementation of kq.main.wait_for().
+*
+* Waits until the transition of a drawable object finishes.
+* Returns immediately if the object has no transition.
+*
+* @param l the Lua context that is calling this function
+* @return number of values to return to Lua
+*/
+int LuaContext::main_api_wait_for(lua_State* l)
+{
+	Drawable& drawable = check_drawable(l, 1);
+	LuaCoroutineData& coroutine = check_coroutine(l);
+
+	if(drawable.get_transition() == NULL)
+	{
+		return 0;
+	}
+
+	LuaContext& lua_context = get_lua_context(l);
+	lua_context.remove_coroutine_waits(l);
+
+	// Keep the drawable alive while waiting for it.
+	lua_settop(l, 1);
+	lua_context.destroy_ref(coroutine.waited_object_ref);
+	coroutine.waited_object_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+
+	lua_context.coroutines_waiting_transitions.push_back(std::make_pair(l, &drawable));
+	coroutine.waiting = true;
+
+	return lua_yield(l, 0);
+}
+
+/**
+* @brief Registers a coroutine started by kq.main.start_coroutine().
+* @param thread The coroutine.
+* @param thread_ref Lua ref to the coroutine.
+*/
+void LuaContext::add_coroutine(lua_State* thread, int thread_ref)
+{
+	LuaCoroutineData& coroutine = coroutines[thread];
+	coroutine.ref = thread_ref;
+	coroutine.waiting = false;
+	coroutine.waited_object_ref = LUA_REFNIL;
+}
+
+/**
+* @brief Resumes a coroutine until it finishes or waits again.
+*
+* A coroutine that yields without calling sleep(), wait_frames() or
+* wait_for() is resumed at the next update.
+* A coroutine that finishes or raises an error is destroyed.
+*
+* @param thread The coroutine, with its arguments on top of its stack.
+* @param nb_arguments Number of arguments to pass to the coroutine.
+*/
+void LuaContext::resume_coroutine(lua_State* thread, int nb_arguments)
+{
+	std::map<lua_State*, LuaCoroutineData>::iterator it = coroutines.find(thread);
+	if(it == coroutines.end())
+	{
+		return;
+	}
+	it->second.waiting = false;
+	destroy_ref(it->second.waited_object_ref);
+	it->second.waited_object_ref = LUA_REFNIL;
+
+	if(LuaProfiler::is_running())
+	{
+		LuaProfiler::notify_coroutine_resumed(thread);
+	}
+	int status = lua_resume(thread, nb_arguments);
+
+	// The coroutine may have started or destroyed others: find it again.
+	it = coroutines.find(thread);
+	if(it == coroutines.end())
+	{
+		return;
+	}
+
+	if(status == LUA_YIELD)
+	{
+		if(!it->second.waiting)
+		{
+			// A plain coroutine.yield(): wait for the next update.
+			coroutines_waiting_frames.insert(std::make_pair(nb_updates + 1, thread));
+			it->second.waiting = true;
+		}
+		lua_settop(thread, 0);
+		return;
+	}
+
+	if(status != 0)
+	{
+		std::cerr << "Error in coroutine: " << lua_tostring(thread, -1) << std::endl;
+	}
+	destroy_coroutine(it);
+}
+
+/**
+* @brief Destroys a coroutine and forgets what it was waiting for.
+* @param it The coroutine to destroy.
+*/
+void LuaContext::destroy_coroutine(std::map<lua_State*, LuaCoroutineData>::iterator it)
+{
+	if(LuaProfiler::is_running())
+	{
+		LuaProfiler::remove_thread(it->first);
+	}
+	remove_coroutine_waits(it->first);
+	destroy_ref(it->second.waited_object_ref);
+	destroy_ref(it->second.ref);
+	coroutines.erase(it);
+}
+
+/**
+* @brief Removes a coroutine from the lists of coroutines to resume later.
+*
+* Called before a coroutine registers a new wait, so that a wait whose
+* yield failed (e.g. across a pcall) cannot resume it later.
+*
+* @param thread The coroutine.
+*/
+void LuaContext::remove_coroutine_waits(lua_State* thread)
+{
+	std::multimap<uint64_t, lua_State*>::iterator it = sleeping_coroutines.begin();
+	while(it != sleeping_coroutines.end())
+	{
+		if(it->second == thread)
+		{
+			sleeping_coroutines.erase(it++);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	std::multimap<uint32_t, lua_State*>::iterator it1 = coroutines_waiting_frames.begin();
+	while(it1 != coroutines_waiting_frames.end())
+	{
+		if(it1->second == thread)
+		{
+			coroutines_waiting_frames.erase(it1++);
+		}
+		else
+		{
+			++it1;
+		}
+	}
+
+	std::list<std::pair<lua_State*, Drawable*> >::iterator it2 = coroutines_waiting_transitions.begin();
+	while(it2 != coroutines_waiting_transitions.end())
+	{
+		if(it2->first == thread)
+		{
+			it2 = coroutines_waiting_transitions.erase(it2);
+		}
+		else
+		{
+			++it2;
+		}
+	}
+}
+
+/**
+* @brief Destroys immediately all coroutines.
+*/
+void LuaContext::destroy_coroutines()
+{
+	std::map<lua_State*, LuaCoroutineData>::iterator it;
+	for(it = coroutines.begin(); it != coroutines.end(); ++it)
+	{
+		destroy_ref(it->second.waited_object_ref);
+		destroy_ref(it->second.ref);
+	}
+	coroutines.clear();
+	sleeping_coroutines.clear();
+	coroutines_waiting_frames.clear();
+	coroutines_waiting_transitions.clear();
+}
+
+/**
+* @brief Resumes the coroutines whose wait is over.
+*
+* The coroutines to resume are collected first: the ones that wait again
+* during this update are resumed at the next one.
+*/
+void LuaContext::update_coroutines()
+{
+	nb_updates++;
+
+	std::vector<lua_State*> ready;
+	uint64_t now = System::now_ns();
+	std::multimap<uint64_t, lua_State*>::iterator it = sleeping_coroutines.begin();
+	while(it != sleeping_coroutines.end() && it->first <= now)
+	{
+		ready.push_back(it->second);
+		sleeping_coroutines.erase(it++);
+	}
+
+	std::multimap<uint32_t, lua_State*>::iterator it1 = coroutines_waiting_frames.begin();
+	while(it1 != coroutines_waiting_frames.end() && it1->first <= nb_updates)
+	{
+		ready.push_back(it1->second);
+		coroutines_waiting_frames.erase(it1++);
+	}
+
+	std::list<std::pair<lua_State*, Drawable*> >::iterator it2 = coroutines_waiting_transitions.begin();
+	while(it2 != coroutines_waiting_transitions.end())
+	{
+		// Drawables no longer updated will not finish their transition.
+		if(it2->second->get_transition() == NULL || !has_drawable(it2->second))
+		{
+			ready.push_back(it2->first);
+			it2 = coroutines_waiting_transitions.erase(it2);
+		}
+		else
+		{
+			++it2;
+		}
+	}
+
+	std::vector<lua_State*>::const_iterator it3;
+	for(it3 = ready.begin(); it3 != ready.end(); ++it3)
+	{
+		// Skip the entries of coroutines destroyed or resumed by a script meanwhile.
+		std::map<lua_State*, LuaCoroutineData>::iterator it4 = coroutines.find(*it3);
+		if(it4 == coroutines.end())
+		{
+			continue;
+		}
+
+		lua_State* thread = *it3;
+		if(lua_status(thread) == LUA_YIELD)
+		{
+			if(it4->second.waiting)
+			{
+				resume_coroutine(thread, 0);
+			}
+		}
+		else
+		{
+			// Not suspended: unless it is running, the coroutine finished
+			// or failed outside of resume_coroutine().
+			lua_Debug ar;
+			if(lua_status(thread) != 0 || lua_getstack(thread, 0, &ar) == 0)
+			{
+				destroy_coroutine(it4);
+			}
+		}
+	}
+}
+
+/**
+* @brief Returns the coroutine data of the running thread.
+*
+* Raises a Lua error if the thread was not started by
+* kq.main.start_coroutine().
+*
+* @param l The running thread.
+* @return The coroutine data.
+*/
+LuaContext::LuaCoroutineData& LuaContext::check_coroutine(lua_State* l)
+{
+	LuaContext& lua_context = get_lua_context(l);
+	std::map<lua_State*, LuaCoroutineData>::iterator it = lua_context.coroutines.find(l);
+	if(it == lua_context.coroutines.end())
+	{
+		luaL_error(l, "This function can only be called from a coroutine started by kq.main.start_coroutine()");
+	}
+	return it->second;
+}
+
 void LuaContext::main_on_started()
 {
 	push_main(l);
-	on_started();
+	on_started(&main_callbacks);
 	lua_pop(l, 1);
 }
 
@@ -95,7 +557,7 @@ void LuaContext::main_on_started()
 void LuaContext::main_on_finished()
 {
 	push_main(l);
-	on_finished();
+	on_finished(&main_callbacks);
 	remove_timers(-1);
 	remove_menus(-1);
 	lua_pop(l, 1);
@@ -108,9 +570,14 @@ void LuaContext::main_on_finished()
 */
 void LuaContext::main_on_update() 
 {
+	if(menus.empty() && !has_callback(&main_callbacks, CALLBACK_ON_UPDATE))
+	{
+		return;
+	}
+
 	push_main(l);
-	//on_update();  
-	//menus_on_update(-1);
+	on_update(&main_callbacks);
+	menus_on_update(-1);
 	lua_pop(l, 1);
 }
 
@@ -120,9 +587,14 @@ void LuaContext::main_on_update()
 */
 void LuaContext::main_on_draw(Surface& dst_surface) 
 {
+	if(menus.empty() && !has_callback(&main_callbacks, CALLBACK_ON_DRAW))
+	{
+		return;
+	}
+
 	push_main(l);
 	menus_on_draw(-1, dst_surface);
-	on_draw(dst_surface);
+	on_draw(dst_surface, &main_callbacks);
 	lua_pop(l, 1);
 }
 
@@ -138,7 +610,7 @@ bool LuaContext::main_on_input(InputEvent& event)
 {
   bool handled = false;
   push_main(l);
-  handled = on_input(event);
+  handled = on_input(event, &main_callbacks);
   if (!handled) 
   {
     handled = menus_on_input(-1, event);
@@ -11,12 +11,84 @@
 #include "LuaContext.h"
 #include "QuestProperties.h"
 #include "QuestResourceList.h"
+#include "LuaBytecodeCache.h"
+#include "Random.h"
+#include "Sound.h"
+#include "Music.h"
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <vector>
 
 /** @brief Missing debug_keys */
 
-MainLoop::MainLoop(int argc, char** argv): root_surface(NULL), lua_context(NULL), exiting(false), game(NULL), next_game(NULL) 
+MainLoop::MainLoop(int argc, char** argv): root_surface(NULL), lua_context(NULL), exiting(false), game(NULL), next_game(NULL),
+	nb_benchmark_frames(0), nb_benchmark_timers(0), precompiling(false), input_recording(NULL), frame_stats_enabled(false),
+	nb_frames(0), max_frame_time(0), frame_gc_time(0), total_gc_time(0), max_gc_time(0)
 {
-	System::initialize(argc, argv);
+	//check the -lua-benchmark=N, -timer-benchmark=N, -lua-precompile, -frame-stats,
+	//-record-input=FILE and -replay-input=FILE options
+	std::string record_file_name;
+	std::string replay_file_name;
+	for(int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if(arg.find("-lua-benchmark=") == 0)
+		{
+			nb_benchmark_frames = std::atoi(arg.substr(15).c_str());
+		}
+		else if(arg.find("-timer-benchmark=") == 0)
+		{
+			nb_benchmark_timers = std::atoi(arg.substr(17).c_str());
+		}
+		else if(arg == "-lua-precompile")
+		{
+			precompiling = true;
+		}
+		else if(arg == "-frame-stats")
+		{
+			frame_stats_enabled = true;
+		}
+		else if(arg.find("-record-input=") == 0)
+		{
+			record_file_name = arg.substr(14);
+		}
+		else if(arg.find("-replay-input=") == 0)
+		{
+			replay_file_name = arg.substr(14);
+		}
+	}
+
+	//a replay runs headless on a virtual clock, as fast as possible
+	//(the audio is mixed in software unless another -audio-backend is given)
+	std::vector<char*> args(argv, argv + argc);
+	static char no_video_arg[] = "-no-video";
+	static char virtual_clock_arg[] = "-virtual-clock";
+	static char null_audio_arg[] = "-audio-backend=null";
+	if(!replay_file_name.empty())
+	{
+		args.insert(args.begin() + 1, null_audio_arg);
+		args.push_back(no_video_arg);
+		args.push_back(virtual_clock_arg);
+	}
+
+	System::initialize(int(args.size()), &args[0]);
+
+	if(!replay_file_name.empty())
+	{
+		input_recording = InputRecording::load_replay(replay_file_name);
+		if(input_recording == NULL)
+		{
+			exiting = true;
+			return;
+		}
+		Random::set_seed(input_recording->get_seed());
+	}
+	else if(!record_file_name.empty())
+	{
+		input_recording = InputRecording::create_recording(record_file_name, Random::get_seed());
+	}
 	
 	//Read the general properties of the quest
 	QuestProperties quest_properties(*this);
@@ -29,6 +101,13 @@ MainLoop::MainLoop(int argc, char** argv): root_surface(NULL), lua_context(NULL)
 	root_surface->increment_refcount();
 
 	lua_context = new LuaContext(*this);
+	if(precompiling)
+	{
+		//Compile the scripts for the bytecode cache without running them
+		LuaBytecodeCache::precompile_all();
+		exiting = true;
+		return;
+	}
 	lua_context->initialize();
 
 }
@@ -37,9 +116,13 @@ MainLoop::MainLoop(int argc, char** argv): root_surface(NULL), lua_context(NULL)
 
 MainLoop::~MainLoop()
 {
+	delete input_recording;
 	delete lua_context;
-	root_surface->decrement_refcount();
-	delete root_surface;
+	if(root_surface != NULL)
+	{
+		root_surface->decrement_refcount();
+		delete root_surface;
+	}
 	QuestResourceList::quit();
 	System::quit();
 }
@@ -112,18 +195,39 @@ void MainLoop::set_game(Game* game)
 
 void MainLoop::run()
 {
+	if(is_exiting())
+	{
+		return;
+	}
+	if(nb_benchmark_frames > 0)
+	{
+		run_lua_benchmark();
+		return;
+	}
+	if(nb_benchmark_timers > 0)
+	{
+		lua_context->run_timer_benchmark(nb_benchmark_timers);
+		return;
+	}
+
+	//dates are in nanoseconds on the engine clock (which may be virtual: see System::set_clock())
+	static const int64_t ms = 1000000;
 	InputEvent* event;
-	uint32_t now;
-	uint32_t next_frame_date = System::now();
-	uint32_t frame_interval = 25;      //time interval between two drawings
-	int delay;
+	uint64_t now;
+	uint64_t start_date = System::now_ns();
+	uint64_t last_frame_date = start_date;
+	uint64_t next_frame_date = System::now_ns();
+	uint64_t real_start_date = System::get_real_time_ns();
+	uint64_t gc_budget_left = lua_context->get_gc_budget() * ms;
+	int64_t frame_interval = 25 * ms;      //time interval between two drawings
+	int64_t delay;
 	bool just_redrawn = false;  //to detect when the FPS number needs to be decreased
 
 	//main loop
 	while(!is_exiting())
 	{
 		//handle input events
-	    event = InputEvent::get_event();
+		event = get_input_event();
 		if(event != NULL)
 		{
 			notify_input(*event);
@@ -154,35 +258,69 @@ void MainLoop::run()
 		}
 		else
 		{*/
-			now = System::now();
-			delay = next_frame_date - now;
+			now = System::now_ns();
+			delay = int64_t(next_frame_date - now);
 			//delay is the time remaining before next drawing
 
 			if(delay <= 0)
 			{
 				//time to redraw
-				if(just_redrawn && frame_interval <= 30)
+				if(just_redrawn && frame_interval <= 30 * ms)
 				{
 					//redraw less often
-					frame_interval += 5;
+					frame_interval += 5 * ms;
 				}
 				next_frame_date = now + frame_interval;
 				just_redrawn = true;
 				draw();
+
+				nb_frames++;
+				max_frame_time = std::max(max_frame_time, uint32_t((now - last_frame_date) / ms));
+				last_frame_date = now;
+				total_gc_time += frame_gc_time;
+				max_gc_time = std::max(max_gc_time, frame_gc_time);
+				frame_gc_time = 0;
+				gc_budget_left = lua_context->get_gc_budget() * ms;
 			}
 			else
 			{
 				just_redrawn = false;
-				//sleep, if there's time
-				System::sleep(1);
-				if(delay >= 15)
+				//collect Lua garbage in the spare time, or sleep if there is nothing to do
+				//the deadline is on the real clock: collecting takes real time even with a virtual clock
+				//(in ns: most steps take less than a millisecond)
+				uint64_t gc_deadline = System::get_real_time_ns() + std::min(gc_budget_left, uint64_t(delay));
+				uint64_t gc_time = lua_context->collect_garbage(gc_deadline);
+				gc_budget_left -= std::min(gc_budget_left, gc_time);
+				frame_gc_time += gc_time;
+				if(gc_time == 0 || input_recording != NULL)
+				{
+					//when recording or replaying, every cycle advances the clock the same way
+					System::sleep(1);
+				}
+				if(delay >= 15 * ms)
 				{
 					//increase the FPS if there's a lot of time
-					frame_interval--;
+					frame_interval -= ms;
 				}
 			}
 		//}
 	}
+
+	if(frame_stats_enabled)
+	{
+		print_frame_stats(uint32_t((System::now_ns() - start_date) / ms));
+	}
+	if(input_recording != NULL)
+	{
+		if(input_recording->is_replaying())
+		{
+			print_replay_summary(System::now_ns() - start_date, System::get_real_time_ns() - real_start_date);
+		}
+		else
+		{
+			input_recording->finish(nb_frames);
+		}
+	}
 	/*
 	if(game != NULL)
 	{
@@ -192,6 +330,132 @@ void MainLoop::run()
 	}*/
 }
 
+/**
+* @brief Measures the per-frame cost of the quest scripts.
+*
+* Runs nb_benchmark_frames cycles of Lua updates and drawings as fast as
+* possible (no input, no sleeping, nothing sent to the screen) and prints
+* the time spent. Run the same quest with -no-video on a Lua 5.1 build and
+* on a LuaJIT build (KQ_LUAJIT) to compare the backends.
+*/
+void MainLoop::run_lua_benchmark()
+{
+#ifdef KQ_LUAJIT
+	static const std::string backend = "LuaJIT";
+#else
+	static const std::string backend = "Lua 5.1";
+#endif
+
+	//timed on the real clock: the game clock may be virtual
+	System::update();
+	uint64_t start_date = System::get_real_time_ns();
+	for(int i = 0; i < nb_benchmark_frames && !is_exiting(); i++)
+	{
+		lua_context->update();
+		lua_context->main_on_draw(*root_surface);
+		System::update();
+	}
+	double duration = (System::get_real_time_ns() - start_date) / 1000000.0;
+
+	std::cout << "Lua benchmark (" << backend << "): " << nb_benchmark_frames << " frames in "
+		<< duration << " ms, " << duration / nb_benchmark_frames << " ms per frame" << std::endl;
+}
+
+/**
+* @brief Prints the frame statistics collected by run() with -frame-stats.
+* @param duration Total running time in ms.
+*/
+void MainLoop::print_frame_stats(uint32_t duration)
+{
+	std::cout << "Frames: " << nb_frames << " in " << duration << " ms";
+	if(nb_frames > 0)
+	{
+		std::cout << ", " << double(duration) / nb_frames << " ms per frame, longest " << max_frame_time << " ms";
+	}
+	std::cout << "\nLua garbage collection: " << total_gc_time / 1000000.0 << " ms, longest "
+		<< max_gc_time / 1000000.0 << " ms per frame";
+
+	if(Sound::is_initialized())
+	{
+		Sound::Stats audio;
+		Sound::get_stats(audio);
+		int nb_preloads_done, nb_preloads;
+		Sound::get_preload_progress(nb_preloads_done, nb_preloads);
+
+		std::cout << "\nAudio decoding: " << audio.nb_decodes << " sounds, " << audio.decode_time / 1000000 << " ms, "
+			<< audio.bytes_decoded / 1024 << " KB, longest " << audio.max_decode_time / 1000000 << " ms";
+		if(!audio.slowest_sound.empty())
+		{
+			std::cout << " (" << audio.slowest_sound << ")";
+		}
+		std::cout << ", " << nb_preloads_done << "/" << nb_preloads << " preloaded"
+			<< "\nAudio voices: " << audio.nb_active_voices << "/" << audio.nb_voices << " active, "
+			<< audio.nb_voice_steals << " steals, " << audio.nb_voice_failures << " failures"
+			<< "\nAudio memory: " << audio.resident_bytes / 1024 << " KB, " << audio.nb_evictions << " evictions"
+			<< "\nAudio update: " << audio.update_time / 1000000 << " ms, longest " << audio.max_update_time / 1000 << " us"
+			<< "\nMusic: " << Music::get_nb_buffer_refills() << " buffer refills, " << Music::get_nb_underruns() << " underruns, "
+			<< Music::get_update_time() / 1000000 << " ms in the audio thread";
+	}
+	std::cout << std::endl;
+}
+
+/**
+* @brief Returns the next input event to handle.
+*
+* The event comes from the replayed recording if any. Otherwise it comes from
+* the system and it is recorded if -record-input was passed.
+* The program exits when the replay is over.
+*
+* @return The event (to be deleted after use), or NULL if there is no event.
+*/
+InputEvent* MainLoop::get_input_event()
+{
+	if(input_recording == NULL)
+	{
+		return InputEvent::get_event();
+	}
+
+	if(input_recording->is_replaying())
+	{
+		if(input_recording->is_finished(nb_frames))
+		{
+			exiting = true;
+			return NULL;
+		}
+		return input_recording->get_event(nb_frames);
+	}
+
+	input_recording->update(nb_frames);
+	InputEvent* event = InputEvent::get_event();
+	if(event != NULL)
+	{
+		input_recording->record(*event, nb_frames);
+	}
+	return event;
+}
+
+/**
+* @brief Prints the result of a replay run with -replay-input.
+*
+* The state hash must be the same for two runs of the same recording:
+* otherwise the game logic diverged. The real time measures the build.
+*
+* @param duration Duration of the session on the engine clock in ns.
+* @param real_duration Real time spent replaying in ns.
+*/
+void MainLoop::print_replay_summary(uint64_t duration, uint64_t real_duration)
+{
+	double real_ms = real_duration / 1000000.0;
+	std::cout << "Replay: " << input_recording->get_nb_events() << " events, " << nb_frames << " frames, "
+		<< duration / 1000000 << " ms of game in " << real_ms << " ms";
+	if(nb_frames > 0)
+	{
+		std::cout << ", " << real_ms / nb_frames << " ms per frame";
+	}
+	std::cout << "\nState hash: " << std::hex << std::setw(8) << std::setfill('0')
+		<< InputRecording::get_state_hash(*root_surface, nb_frames) << std::dec << std::endl;
+}
+
 /** @brief Needs Game. 
  *  
  *  It handles the events common to all screens:
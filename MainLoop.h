@@ -9,6 +9,7 @@
 #include "InputEvent.h"
 #include "Game.h"
 #include "LuaContext.h"
+#include "InputRecording.h"
 
 class MainLoop
 {
@@ -18,10 +19,26 @@ private:
 	bool exiting;				/**<Indicates that the program is about to stop */
 	Game* game;					/**<The current game, if any, NULL otherwise. */
 	Game* next_game;			/**<The game to start at next cycle (NULL means resetting the game). */
+	int nb_benchmark_frames;	/**<Number of cycles to run with -lua-benchmark=N (0 to run normally). */
+	int nb_benchmark_timers;	/**<Number of pending timers with -timer-benchmark=N (0 to run normally). */
+	bool precompiling;			/**<Indicates that -lua-precompile was passed: only compile the quest scripts. */
+	InputRecording* input_recording;	/**<Input events being recorded (-record-input) or replayed (-replay-input), or NULL. */
+
+	//frame instrumentation (-frame-stats)
+	bool frame_stats_enabled;	/**<Indicates that frame statistics are printed when the program stops. */
+	uint32_t nb_frames;			/**<Number of frames drawn. */
+	uint32_t max_frame_time;	/**<Longest time between two frames in ms. */
+	uint64_t frame_gc_time;		/**<Time spent collecting Lua garbage since the last frame in ns. */
+	uint64_t total_gc_time;		/**<Time spent collecting Lua garbage in ns. */
+	uint64_t max_gc_time;		/**<Longest garbage collection time between two frames in ns. */
 
 	void notify_input(InputEvent& event);
 	void draw();
 	void update();
+	void run_lua_benchmark();
+	void print_frame_stats(uint32_t duration);
+	InputEvent* get_input_event();
+	void print_replay_summary(uint64_t duration, uint64_t real_duration);
 
 public:
 	MainLoop(int argc, char** argv);
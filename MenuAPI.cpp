@@ -19,6 +19,26 @@ void LuaContext::register_menu_module()
 	register_functions(menu_module_name, functions);
 }
 
+/**
+* @brief Returns the key of the menus of a context.
+*
+* Menus are plain Lua tables: there is no C++ menu type to bind.
+* A userdata context is identified by its C++ object, a table by itself.
+*
+* @param l A Lua state.
+* @param context_index Index of a table or userdata in the stack.
+* @return The key of its menus.
+*/
+const void* LuaContext::get_menu_context(lua_State* l, int context_index)
+{
+	if(lua_type(l, context_index) == LUA_TUSERDATA)
+	{
+		ExportableToLua** userdata = static_cast<ExportableToLua**>(lua_touserdata(l, context_index));
+		return *userdata;
+	}
+	return lua_topointer(l, context_index);
+}
+
 /**
 * @brief Registers a menu into a context (table or a userdata).
 *
@@ -29,20 +49,17 @@ void LuaContext::register_menu_module()
 */
 void LuaContext::add_menu(int menu_ref, int context_index) 
 {
-	const void* context;
-	if (lua_type(l, context_index) == LUA_TUSERDATA) 
-	{
-		ExportableToLua** userdata = static_cast<ExportableToLua**>(lua_touserdata(l, context_index));
-		context = *userdata;
-	}
-	else 
-	{
-		context = lua_topointer(l, context_index);
-	}
+	const void* context = get_menu_context(l, context_index);
+
+	std::list<LuaMenuData>& context_menus = menus[context];
+	context_menus.push_back(LuaMenuData(menu_ref, context));
+	LuaCallbacks& callbacks = context_menus.back().callbacks;
+
+	push_ref(l, menu_ref);
+	enable_callbacks(-1, callbacks);
+	lua_pop(l, 1);
 
-	menus.push_back(LuaMenuData(menu_ref, context));
-	
-	menu_on_started(menu_ref);
+	menu_on_started(menu_ref, &callbacks);
 }
 
 /**
@@ -54,29 +71,30 @@ void LuaContext::add_menu(int menu_ref, int context_index)
 */
 void LuaContext::remove_menus(int context_index) 
 {
-  const void* context;
-  if (lua_type(l, context_index) == LUA_TUSERDATA) 
-  {
-    ExportableToLua** userdata = static_cast<ExportableToLua**>(lua_touserdata(l, context_index));
-    context = *userdata;
-  }
-  else 
+  const void* context = get_menu_context(l, context_index);
+
+  std::map<const void*, std::list<LuaMenuData> >::iterator menus_it = menus.find(context);
+  if (menus_it == menus.end()) 
   {
-    context = lua_topointer(l, context_index);
+    return;
   }
 
+  std::list<LuaMenuData>& context_menus = menus_it->second;
   std::list<LuaMenuData>::iterator it;
-  for (it = menus.begin(); it != menus.end(); ++it) 
+  for (it = context_menus.begin(); it != context_menus.end(); ++it) 
   {
     int menu_ref = it->ref;
-    if (it->context == context) 
+    if (menu_ref != LUA_REFNIL) 
 	{
-      menu_on_finished(menu_ref);
+      menu_on_finished(menu_ref, &it->callbacks);
+      push_ref(l, menu_ref);
+      disable_callbacks(-1, it->callbacks);
+      lua_pop(l, 1);
       destroy_ref(menu_ref);
       it->ref = LUA_REFNIL;
-      it->context = NULL;
     }
   }
+  contexts_with_removed_menus.insert(context);
 }
 
 /**
@@ -86,17 +104,25 @@ void LuaContext::remove_menus(int context_index)
 */
 void LuaContext::remove_menus() 
 {
-  std::list<LuaMenuData>::iterator it;
-  for (it = menus.begin(); it != menus.end(); ++it) 
+  std::map<const void*, std::list<LuaMenuData> >::iterator menus_it;
+  for (menus_it = menus.begin(); menus_it != menus.end(); ++menus_it) 
   {
-    int menu_ref = it->ref;
-    if (menu_ref != LUA_REFNIL) 
-	{
-      menu_on_finished(menu_ref);
-      destroy_ref(menu_ref);
-      it->ref = LUA_REFNIL;
-      it->context = NULL;
+    std::list<LuaMenuData>& context_menus = menus_it->second;
+    std::list<LuaMenuData>::iterator it;
+    for (it = context_menus.begin(); it != context_menus.end(); ++it) 
+    {
+      int menu_ref = it->ref;
+      if (menu_ref != LUA_REFNIL) 
+	  {
+        menu_on_finished(menu_ref, &it->callbacks);
+        push_ref(l, menu_ref);
+        disable_callbacks(-1, it->callbacks);
+        lua_pop(l, 1);
+        destroy_ref(menu_ref);
+        it->ref = LUA_REFNIL;
+      }
     }
+    contexts_with_removed_menus.insert(menus_it->first);
   }
 }
 
@@ -105,16 +131,22 @@ void LuaContext::remove_menus()
 */
 void LuaContext::destroy_menus() 
 {
-  std::list<LuaMenuData>::iterator it;
-  for (it = menus.begin(); it != menus.end(); ++it) 
+  std::map<const void*, std::list<LuaMenuData> >::iterator menus_it;
+  for (menus_it = menus.begin(); menus_it != menus.end(); ++menus_it) 
   {
-    int menu_ref = it->ref;
-    if (menu_ref != LUA_REFNIL) 
-	{
-      destroy_ref(menu_ref);
+    std::list<LuaMenuData>& context_menus = menus_it->second;
+    std::list<LuaMenuData>::iterator it;
+    for (it = context_menus.begin(); it != context_menus.end(); ++it) 
+    {
+      int menu_ref = it->ref;
+      if (menu_ref != LUA_REFNIL) 
+	  {
+        destroy_ref(menu_ref);
+      }
     }
   }
   menus.clear();
+  contexts_with_removed_menus.clear();
 }
 
 /**
@@ -122,21 +154,39 @@ void LuaContext::destroy_menus()
 *
 * Note that the on_update() is called by the context of each menu, not
 * by this function.
+* Removed menus are only erased here, so that the menu lists stay valid
+* while callbacks run. Only contexts that lost menus are visited.
 */
 void LuaContext::update_menus() 
 {
-  // Destroy the ones that should be removed.
-  std::list<LuaMenuData>::iterator it;
-  for (it = menus.begin(); it != menus.end(); ++it) {
+  std::set<const void*>::iterator context_it;
+  for (context_it = contexts_with_removed_menus.begin();
+      context_it != contexts_with_removed_menus.end(); ++context_it) 
+  {
+    std::map<const void*, std::list<LuaMenuData> >::iterator menus_it = menus.find(*context_it);
+    if (menus_it == menus.end()) 
+	{
+      continue;
+    }
+
+    // Destroy the ones that should be removed.
+    std::list<LuaMenuData>& context_menus = menus_it->second;
+    std::list<LuaMenuData>::iterator it;
+    for (it = context_menus.begin(); it != context_menus.end(); ++it) 
+	{
+      if (it->ref == LUA_REFNIL) 
+	  {
+        // LUA_REFNIL on a menu means that we should remove it.
+        context_menus.erase(it--);
+      }
+    }
 
-    if (it->ref == LUA_REFNIL) 
+    if (context_menus.empty()) 
 	{
-      // LUA_REFNIL on a menu means that we should remove it.
-      // In this case, context must also be NULL.
-      //Debug::check_assertion(it->context == NULL, "Menu with context and no ref");
-      menus.erase(it--);
+      menus.erase(menus_it);
     }
   }
+  contexts_with_removed_menus.clear();
 }
 
 /**
@@ -161,34 +211,48 @@ int LuaContext::menu_api_start(lua_State *l) {
   return 0;
 }
 
-void LuaContext::menu_on_started(int menu_ref)
+void LuaContext::menu_on_started(int menu_ref, const LuaCallbacks* callbacks)
 {
 	push_ref(l, menu_ref);
-	on_started();
+	on_started(callbacks);
 	lua_pop(l, 1);
 }
 
 /**
 * \brief Calls the on_finished() method of a Lua menu.
 * \param menu_ref A reference to the menu object.
+* \param callbacks Cached event handlers of the menu, or NULL.
 */
-void LuaContext::menu_on_finished(int menu_ref) 
+void LuaContext::menu_on_finished(int menu_ref, const LuaCallbacks* callbacks) 
 {
   push_ref(l, menu_ref);
-  on_finished();
+  on_finished(callbacks);
   remove_timers(-1); // Stop timers associated to this menu.
   lua_pop(l, 1);
 }
 
+/**
+* @brief Calls the on_update() method of a Lua menu.
+* @param menu_ref A reference to the menu object.
+* @param callbacks Cached event handlers of the menu, or NULL.
+*/
+void LuaContext::menu_on_update(int menu_ref, const LuaCallbacks* callbacks) 
+{
+  push_ref(l, menu_ref);
+  on_update(callbacks);
+  lua_pop(l, 1);
+}
+
 /**
 * @brief Calls the on_draw() method of a Lua menu.
 * @param menu_ref A reference to the menu object.
 * @param dst_surface The destination surface.
+* @param callbacks Cached event handlers of the menu, or NULL.
 */
-void LuaContext::menu_on_draw(int menu_ref, Surface& dst_surface) 
+void LuaContext::menu_on_draw(int menu_ref, Surface& dst_surface, const LuaCallbacks* callbacks) 
 {
   push_ref(l, menu_ref);
-  on_draw(dst_surface);
+  on_draw(dst_surface, callbacks);
   lua_pop(l, 1);
 }
 
@@ -196,15 +260,16 @@ void LuaContext::menu_on_draw(int menu_ref, Surface& dst_surface)
 * @brief Calls an input callback method of a Lua menu.
 * @param menu_ref A reference to the menu object.
 * @param event The input event to forward.
+* @param callbacks Cached event handlers of the menu, or NULL.
 * @return \c true if the event was handled and should stop being propagated.
 */
-bool LuaContext::menu_on_input(int menu_ref, InputEvent& event) 
+bool LuaContext::menu_on_input(int menu_ref, InputEvent& event, const LuaCallbacks* callbacks) 
 {
   // Get the Lua menu.
   push_ref(l, menu_ref);
 
   // Trigger its appropriate callback if it exists.
-  bool handled = on_input(event);
+  bool handled = on_input(event, callbacks);
 
   // Remove the menu from the stack.
   lua_pop(l, 1);
@@ -212,6 +277,32 @@ bool LuaContext::menu_on_input(int menu_ref, InputEvent& event)
   return handled;
 }
 
+/**
+* @brief Calls the on_update() method of the menus associated to a context.
+* @param context_index Index of an object with menus.
+*/
+void LuaContext::menus_on_update(int context_index) 
+{
+  const void* context = get_menu_context(l, context_index);
+
+  std::map<const void*, std::list<LuaMenuData> >::iterator menus_it = menus.find(context);
+  if (menus_it == menus.end()) 
+  {
+    return;
+  }
+
+  std::list<LuaMenuData>& context_menus = menus_it->second;
+  std::list<LuaMenuData>::iterator it;
+  for (it = context_menus.begin(); it != context_menus.end(); ++it) 
+  {
+    int menu_ref = it->ref;
+    if (menu_ref != LUA_REFNIL && has_callback(&it->callbacks, CALLBACK_ON_UPDATE)) 
+	{
+      menu_on_update(menu_ref, &it->callbacks);
+    }
+  }
+}
+
 /**
 * @brief Calls the on_draw() method of the menus associated to a context.
 * @param context_index Index of an object with menus.
@@ -219,24 +310,22 @@ bool LuaContext::menu_on_input(int menu_ref, InputEvent& event)
 */
 void LuaContext::menus_on_draw(int context_index, Surface& dst_surface) 
 {
-  const void* context;
-  if (lua_type(l, context_index) == LUA_TUSERDATA) 
-  {
-    ExportableToLua** userdata = static_cast<ExportableToLua**>(lua_touserdata(l, context_index));
-    context = *userdata;
-  }
-  else 
+  const void* context = get_menu_context(l, context_index);
+
+  std::map<const void*, std::list<LuaMenuData> >::iterator menus_it = menus.find(context);
+  if (menus_it == menus.end()) 
   {
-    context = lua_topointer(l, context_index);
+    return;
   }
 
+  std::list<LuaMenuData>& context_menus = menus_it->second;
   std::list<LuaMenuData>::iterator it;
-  for (it = menus.begin(); it != menus.end(); ++it) 
+  for (it = context_menus.begin(); it != context_menus.end(); ++it) 
   {
     int menu_ref = it->ref;
-    if (it->context == context) 
+    if (menu_ref != LUA_REFNIL && has_callback(&it->callbacks, CALLBACK_ON_DRAW)) 
 	{
-      menu_on_draw(menu_ref, dst_surface);
+      menu_on_draw(menu_ref, dst_surface, &it->callbacks);
     }
   }
 }
@@ -249,25 +338,23 @@ void LuaContext::menus_on_draw(int context_index, Surface& dst_surface)
 */
 bool LuaContext::menus_on_input(int context_index, InputEvent& event) 
 {
-  const void* context;
-  if (lua_type(l, context_index) == LUA_TUSERDATA) 
-  {
-    ExportableToLua** userdata = static_cast<ExportableToLua**>(lua_touserdata(l, context_index));
-    context = *userdata;
-  }
-  else 
+  const void* context = get_menu_context(l, context_index);
+
+  std::map<const void*, std::list<LuaMenuData> >::iterator menus_it = menus.find(context);
+  if (menus_it == menus.end()) 
   {
-    context = lua_topointer(l, context_index);
+    return false;
   }
 
   bool handled = false;
+  std::list<LuaMenuData>& context_menus = menus_it->second;
   std::list<LuaMenuData>::reverse_iterator it;
-  for (it = menus.rbegin(); it != menus.rend() && !handled; ++it) 
+  for (it = context_menus.rbegin(); it != context_menus.rend() && !handled; ++it) 
   {
     int menu_ref = it->ref;
-    if (it->context == context) 
+    if (menu_ref != LUA_REFNIL) 
 	{
-      handled = menu_on_input(menu_ref, event);
+      handled = menu_on_input(menu_ref, event, &it->callbacks);
     }
   }
 
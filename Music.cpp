@@ -2,66 +2,74 @@
 
 #include "Music.h"
 #include "FileTools.h"
+#include "System.h"
+#include <chrono>
 
 const int Music::nb_buffers;
-float Music::volume = 1.0;
-Music* Music::current_music = NULL;
-std::map<std::string, Music> Music::all_musics;
+const int Music::buffer_size;
+const size_t Music::ring_size;
 
 const std::string Music::none = "none";
 const std::string Music::unchanged = "same";
 
-/**
-* \brief Creates a new music.
-* \param music_id id of the music (file name without extension)
-*/
-Music::Music(const std::string& music_id): id(music_id), format(OGG), initialized(false)
-{
-	if(!is_initialized() || music_id == none)
-	{
-		return;
-	}
-	
-	for(int i = 0; i < nb_buffers; i++)
-	{
-		buffers[i] = AL_NONE;
-	}
-	source = AL_NONE;
-}
-
-/**
-* \brief Destroys the music.
-*/
-Music::~Music() 
-{
-  if (!is_initialized()) 
-  {
-    return;
-  }
-
-  if(current_music == this) 
-  {
-    stop();
-  }
-}
+bool Music::initialized = false;
+float Music::volume = 1.0;
+std::string Music::current_music_id = Music::none;
+bool Music::paused = false;
+SpscQueue<Music::Command> Music::commands(64);
+std::thread Music::audio_thread;
+
+std::atomic<bool> Music::audio_thread_stopping(false);
+std::atomic<uint32_t> Music::nb_underruns(0);
+std::atomic<uint32_t> Music::nb_buffer_refills(0);
+std::atomic<uint64_t> Music::update_time(0);
+
+ALuint Music::source = AL_NONE;
+ALuint Music::buffers[Music::nb_buffers];
+bool Music::streaming = false;
+bool Music::stream_paused = false;
+bool Music::stream_started = false;
+bool Music::starving = false;
+ALenum Music::format = AL_NONE;
+ALsizei Music::sample_rate = 0;
+std::vector<ALuint> Music::free_buffers;
+std::thread Music::decoding_thread;
+
+OggVorbis_File Music::ogg_file;
+Sound::SoundFromMemory Music::ogg_mem;
+std::atomic<bool> Music::decoding_stopping(false);
+SpscQueue<char> Music::ring(Music::ring_size);
 
 /**
 * \brief Initializes the music system.
+*
+* Starts the audio thread. Sound::initialize() must have opened the
+* audio output before.
 */
 void Music::initialize() 
 {
+  audio_thread_stopping = false;
+  nb_underruns = 0;
+  nb_buffer_refills = 0;
+  update_time = 0;
+  audio_thread = std::thread(audio_thread_main);
   initialized = true;
   set_volume(100);
 }
 
 /**
 * \brief Exits the music system.
+*
+* Stops the music and waits for the audio thread to finish.
 */
 void Music::quit() 
 {
   if (is_initialized()) 
   {
-    all_musics.clear();
+    audio_thread_stopping = true;
+    audio_thread.join();
+    current_music_id = none;
+    initialized = false;
   }
 }
 
@@ -92,19 +100,97 @@ void Music::set_volume(int volume)
   volume = std::min(100, std::max(0, volume));
   Music::volume = volume / 100.0;
 
-  if (current_music != NULL) 
+  Command command;
+  command.type = Command::VOLUME;
+  command.value = volume;
+  send_command(command);
+}
+
+/**
+* \brief Returns the file name of a music.
+* \param music_id id of the music (file name without extension)
+* \param file_name receives the name of the file, or an empty string if the music does not exist
+*/
+void Music::find_music_file(const std::string& music_id, std::string& file_name) 
+{
+  file_name = "";
+
+  std::string file_name_start = "musics/" + music_id;
+  if (FileTools::data_file_exists(file_name_start + ".ogg")) 
   {
-    alSourcef(current_music->source, AL_GAIN, Music::volume);
+    file_name = file_name_start + ".ogg";
   }
 }
 
 /**
-* \brief Returns the music currently playing.
-* \return the current music, or NULL if no music is being played
+* \brief Returns whether a music exists.
+* \param music_id id of the music to test
+* \return true if the music exists
 */
-Music* Music::get_current_music() 
+bool Music::exists(const std::string& music_id) 
 {
-  return current_music;
+  if (music_id == none || music_id == unchanged) 
+  {
+    return true;
+  }
+
+  std::string file_name;
+  find_music_file(music_id, file_name);
+  return !file_name.empty();
+}
+
+/**
+* \brief Plays a music.
+*
+* If the music is already playing, nothing happens.
+* The file is loaded and decoded by the audio thread: this function returns immediately.
+*
+* \param music_id id of the music to play (file name without extension), or none to stop the music
+*/
+void Music::play(const std::string& music_id) 
+{
+  if (music_id == unchanged || music_id == current_music_id) 
+  {
+    return;
+  }
+
+  if (music_id == none) 
+  {
+    stop();
+    return;
+  }
+
+  Command command;
+  command.type = Command::PLAY;
+  command.value = 0;
+  find_music_file(music_id, command.file_name);
+  if (command.file_name.empty()) 
+  {
+    std::cerr << "Cannot find music file 'musics/" << music_id << "'\n";
+    return;
+  }
+
+  send_command(command);
+  current_music_id = music_id;
+  paused = false;
+}
+
+/**
+* \brief Stops the music currently playing, if any.
+*/
+void Music::stop() 
+{
+  if (current_music_id == none) 
+  {
+    return;
+  }
+
+  Command command;
+  command.type = Command::STOP;
+  command.value = 0;
+  send_command(command);
+  current_music_id = none;
+  paused = false;
 }
 
 /**
@@ -113,23 +199,339 @@ Music* Music::get_current_music()
 */
 const std::string& Music::get_current_music_id() 
 {
-  return current_music != NULL ? current_music->id : none;
+  return current_music_id;
 }
 
+/**
+* \brief Returns whether the music is paused.
+* \return true if the music is paused
+*/
+bool Music::is_paused() 
+{
+  return paused;
+}
 
+/**
+* \brief Pauses or resumes the music.
+* \param pause true to pause the music, false to resume it
+*/
+void Music::set_paused(bool pause) 
+{
+  if (pause == paused) 
+  {
+    return;
+  }
 
+  Command command;
+  command.type = Command::PAUSE;
+  command.value = pause ? 1 : 0;
+  send_command(command);
+  paused = pause;
+}
 
+/**
+* \brief Returns the number of underruns since the music system was initialized.
+*
+* An underrun happens when the source needs samples and the decoding thread
+* did not provide them in time: the music is interrupted until it catches up.
+*
+* \return the number of underruns
+*/
+uint32_t Music::get_nb_underruns() 
+{
+  return nb_underruns;
+}
 
+/**
+* \brief Returns the number of buffers of music decoded and queued since the music system was initialized.
+* \return the number of buffer refills
+*/
+uint32_t Music::get_nb_buffer_refills() 
+{
+  return nb_buffer_refills;
+}
 
+/**
+* \brief Returns the time spent by the audio thread to refill the buffers.
+* \return the total time in nanoseconds (real clock)
+*/
+uint64_t Music::get_update_time() 
+{
+  return update_time;
+}
 
+/**
+* \brief Sends a command to the audio thread without waiting for it.
+* \param command the command to send
+*/
+void Music::send_command(const Command& command) 
+{
+  if (!is_initialized()) 
+  {
+    return;
+  }
 
+  if (!commands.push(command)) 
+  {
+    std::cerr << "Too many music commands pending: command ignored\n";
+  }
+}
+
+/**
+* \brief Main function of the audio thread.
+*
+* Executes the commands of the main thread and keeps the source fed
+* until quit() is called.
+*/
+void Music::audio_thread_main() 
+{
+  AudioBackend& backend = Sound::get_backend();
+  source = backend.create_source();
+  for (int i = 0; i < nb_buffers; i++) 
+  {
+    buffers[i] = backend.create_buffer();
+  }
+
+  while (!audio_thread_stopping) 
+  {
+    Command command;
+    while (commands.pop(command)) 
+	{
+      execute_command(command);
+    }
+
+    uint64_t start_date = System::get_real_time_ns();
+    update_stream();
+    update_time += System::get_real_time_ns() - start_date;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+
+  stop_stream();
+  for (int i = 0; i < nb_buffers; i++) 
+  {
+    backend.delete_buffer(buffers[i]);
+  }
+  backend.delete_source(source);
+  source = AL_NONE;
+}
+
+/**
+* \brief Executes a command of the main thread (audio thread only).
+* \param command the command to execute
+*/
+void Music::execute_command(const Command& command) 
+{
+  AudioBackend& backend = Sound::get_backend();
+  switch (command.type) 
+  {
+    case Command::PLAY:
+      stop_stream();
+      start_stream(command.file_name);
+      break;
+
+    case Command::STOP:
+      stop_stream();
+      break;
+
+    case Command::PAUSE:
+      stream_paused = (command.value != 0);
+      if (streaming && stream_started) 
+	  {
+        if (stream_paused) 
+		{
+          backend.pause(source);
+        }
+        else 
+		{
+          backend.play(source);
+        }
+      }
+      break;
+
+    case Command::VOLUME:
+      backend.set_gain(source, command.value / 100.0f);
+      break;
+  }
+}
+
+/**
+* \brief Opens a music file and starts decoding it (audio thread only).
+* \param file_name name of the .ogg file to stream
+*/
+void Music::start_stream(const std::string& file_name) 
+{
+  ogg_mem.loop = false;
+  ogg_mem.position = 0;
+  FileTools::data_file_open_buffer(file_name, &ogg_mem.data, &ogg_mem.size);
+
+  int error = ov_open_callbacks(&ogg_mem, &ogg_file, NULL, 0, Sound::ogg_callbacks);
+  if (error) 
+  {
+    std::cerr << "Cannot load music file '" << file_name << "' from memory: error " << error << "\n";
+    FileTools::data_file_close_buffer(ogg_mem.data);
+    return;
+  }
+
+  vorbis_info* info = ov_info(&ogg_file, -1);
+  format = (info->channels == 1) ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16;
+  sample_rate = info->rate;
+
+  free_buffers.assign(buffers, buffers + nb_buffers);
+  streaming = true;
+  stream_started = false;
+  starving = false;
+
+  decoding_stopping = false;
+  decoding_thread = std::thread(decoding_thread_main);
+}
+
+/**
+* \brief Stops the music and its decoding thread (audio thread only).
+*/
+void Music::stop_stream() 
+{
+  if (!streaming) 
+  {
+    return;
+  }
 
+  decoding_stopping = true;
+  decoding_thread.join();
+  ov_clear(&ogg_file);
+  FileTools::data_file_close_buffer(ogg_mem.data);
 
+  Sound::get_backend().stop(source);
+  Sound::get_backend().set_source_buffer(source, AL_NONE);
+  ring.clear();
 
+  streaming = false;
+  stream_started = false;
+}
+
+/**
+* \brief Refills the buffers already played by the source (audio thread only).
+*/
+void Music::update_stream() 
+{
+  if (!streaming) 
+  {
+    return;
+  }
+
+  AudioBackend& backend = Sound::get_backend();
+  int nb_processed = backend.get_nb_processed_buffers(source);
+  for (int i = 0; i < nb_processed; i++) 
+  {
+    free_buffers.push_back(backend.unqueue_buffer(source));
+  }
+
+  bool starved = false;
+  while (!free_buffers.empty()) 
+  {
+    ALuint buffer = free_buffers.back();
+    if (!fill_buffer(buffer)) 
+	{
+      starved = true;
+      break;
+    }
+    backend.queue_buffer(source, buffer);
+    free_buffers.pop_back();
+    nb_buffer_refills++;
+  }
+
+  if (!stream_paused && !backend.is_playing(source) && backend.get_nb_queued_buffers(source) > 0) 
+  {
+    // the source is not started yet, or it ran out of buffers
+    if (stream_started) 
+	{
+      nb_underruns++;
+    }
+    backend.play(source);
+    stream_started = true;
+  }
+  else if (starved && !starving && stream_started && !stream_paused) 
+  {
+    // the source still plays, but on fewer buffers than expected
+    nb_underruns++;
+  }
+  starving = starved;
+}
 
+/**
+* \brief Fills a buffer with the samples available in the ring (audio thread only).
+* \param buffer the buffer to fill
+* \return false if the ring was empty
+*/
+bool Music::fill_buffer(ALuint buffer) 
+{
+  char data[buffer_size];
+  size_t size = ring.pop(data, buffer_size);
+  if (size == 0) 
+  {
+    return false;
+  }
 
+  Sound::get_backend().set_buffer_data(buffer, format, data, size, sample_rate);
+  return true;
+}
 
+/**
+* \brief Main function of the decoding thread.
+*
+* Decodes the music ahead of the playback, as long as the ring has
+* space, and loops at the end of the file.
+*/
+void Music::decoding_thread_main() 
+{
+  char data[4096];
 
+  while (!decoding_stopping) 
+  {
+    size_t free_space = ring.get_free_space();
+    if (free_space < sizeof(data)) 
+	{
+      // the ring is full: let the audio thread consume it
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      continue;
+    }
 
+    long size = decode_ogg(data, sizeof(data));
+    if (size == OV_HOLE) 
+	{
+      // interruption in the data: vorbisfile skips it
+      continue;
+    }
+    if (size < 0) 
+	{
+      std::cerr << "Error while decoding the music: " << size << "\n";
+      return;
+    }
+    ring.push(data, (size_t) size);
+  }
+}
 
+/**
+* \brief Decodes the next samples of the music (decoding thread only).
+*
+* Restarts from the beginning when the end of the file is reached.
+*
+* \param destination buffer where to write the samples
+* \param size maximum number of bytes to decode
+* \return number of bytes decoded, or a negative vorbisfile error code
+*/
+long Music::decode_ogg(char* destination, int size) 
+{
+  int bitstream;
+  long bytes_read = ov_read(&ogg_file, destination, size, 0, 2, 1, &bitstream);
 
+  if (bytes_read == 0) 
+  {
+    // end of the music: loop
+    if (ov_pcm_seek(&ogg_file, 0) != 0) 
+	{
+      return OV_EREAD;
+    }
+    bytes_read = ov_read(&ogg_file, destination, size, 0, 2, 1, &bitstream);
+  }
+  return bytes_read;
+}
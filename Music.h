@@ -1,19 +1,32 @@
-/** @file Music.h"
+/** @file Music.h */
 
 #ifndef KQ_MUSIC_H
 #define KQ_MUSIC_H
 
 #include "Common.h"
 #include "Sound.h"
+#include "SpscQueue.h"
+#include <string>
+#include <thread>
+#include <atomic>
 
 /**
-* \brief Represents a music that can be played.
+* \brief Plays the music.
 *
 * A music should be in format .ogg. 
 * Only one music can be played at a time.
 * Before using this class, the audio system should have been
 * initialized, by calling Sound::initialize().
 * Sound and Music are the only classes that depends on audio libraries.
+*
+* The music is streamed by a dedicated audio thread, independently of the
+* main loop: a long frame or a loading stall does not interrupt it.
+* - The main thread sends commands (play, stop, pause, volume) to the
+*   audio thread through a lock-free queue, and never waits for it.
+* - A decoding thread decodes the music with decode_ogg() into a lock-free
+*   ring of PCM samples, ahead of the playback.
+* - The audio thread refills the buffers of the source from this ring.
+* When the ring is empty while the source needs data, an underrun is counted.
 */
 class Music
 {
@@ -21,13 +34,9 @@ public:
 	static const std::string none;		/**< special id indicating that there is no music */
 	static const std::string unchanged; /**< special id indicating that the music is the same as before */
 	
-	Music(const std::string& music_id = none);
-	~Music();
-	
 	static void initialize();
 	static void quit();
 	static bool is_initialized();
-	static void update();
 	
 	static int get_volume();
 	static void set_volume(int volume);
@@ -35,35 +44,82 @@ public:
 	static void find_music_file(const std::string& music_id, std::string& file_name);
 	static bool exists(const std::string& music_id);
 	static void play(const std::string& music_id);
-	static Music* get_current_music();
+	static void stop();
 	static const std::string& get_current_music_id();
-	
-	bool start();
-	void stop();
-	bool is_paused();
-	void set_paused(bool pause);
-	
-	void decode_ogg(ALuint destination_buffer, ALsizei nb_samples);
+	static bool is_paused();
+	static void set_paused(bool pause);
+
+	static uint32_t get_nb_underruns();
+	static uint32_t get_nb_buffer_refills();
+	static uint64_t get_update_time();
 	
 private:
-	
-	std::string id; 											/**< id of this music */
-    std::string file_name; 										/**< name of the file to play */
-    
-    // OGG specific
-    OggVorbis_File ogg_file; 									/**< the file used by the vorbisfile lib */
-    Sound::SoundFromMemory ogg_mem; 							/**< the encoded music loaded in memory, 
-																 *passed to the vorbisfile lib as user data */
 
-    static const int nb_buffers = 8;
-    ALuint buffers[nb_buffers]; 								/**< multiple buffers used to stream the music */
-    ALuint source; 												/**< the OpenAL source streaming the buffers */
+	// we don't need to instantiate this class
+	Music();
+
+	/**
+	* \brief A request from the main thread to the audio thread.
+	*/
+	struct Command
+	{
+		enum Type
+		{
+			PLAY,		/**< start streaming file_name */
+			STOP,		/**< stop the music */
+			PAUSE,		/**< pause or resume (value is 1 or 0) */
+			VOLUME		/**< change the volume (value is 0 to 100) */
+		};
+
+		Type type;
+		std::string file_name;
+		int value;
+	};
+
+	static void send_command(const Command& command);
+	static void audio_thread_main();
+	static void execute_command(const Command& command);
+	static void start_stream(const std::string& file_name);
+	static void stop_stream();
+	static void update_stream();
+	static bool fill_buffer(ALuint buffer);
+	static void decoding_thread_main();
+	static long decode_ogg(char* destination, int size);
+
+	static const int nb_buffers = 8;							/**< number of buffers queued to the source */
+	static const int buffer_size = 8192;						/**< maximum size of a buffer in bytes */
+	static const size_t ring_size = 256 * 1024;					/**< size of the ring of decoded samples in bytes */
+
+	// main thread
+	static bool initialized;									/**< indicates that the audio thread is running */
+	static float volume; 										/**< volume of musics (0.0 to 1.0) */
+	static std::string current_music_id;						/**< the music currently played, or none */
+	static bool paused;											/**< indicates that the music is paused */
+	static SpscQueue<Command> commands;							/**< commands sent to the audio thread */
+	static std::thread audio_thread;							/**< the thread streaming the music */
+
+	// shared
+	static std::atomic<bool> audio_thread_stopping;				/**< tells the audio thread to finish */
+	static std::atomic<uint32_t> nb_underruns;					/**< number of times the ring was empty when the source needed data */
+	static std::atomic<uint32_t> nb_buffer_refills;				/**< number of buffers filled and queued to the source */
+	static std::atomic<uint64_t> update_time;					/**< time spent refilling the source in nanoseconds */
 
-    static float volume; 										/**< volume of musics (0.0 to 1.0) */
-	bool initialized;
-    static Music* current_music; 								/**< the music currently played (if any) */
-    static std::map<std::string, Music> all_musics; 			/**< all musics created before */
+	// audio thread
+	static ALuint source; 										/**< the source streaming the buffers */
+	static ALuint buffers[nb_buffers]; 							/**< multiple buffers used to stream the music */
+	static bool streaming;										/**< indicates that a music is open */
+	static bool stream_paused;									/**< indicates that the playback is paused */
+	static bool stream_started;									/**< indicates that the source has been played since the music was opened */
+	static bool starving;										/**< indicates that the ring was empty at the last update */
+	static ALenum format;										/**< format of the samples of the music */
+	static ALsizei sample_rate;									/**< sample rate of the music */
+	static std::vector<ALuint> free_buffers;					/**< buffers waiting for data */
+	static std::thread decoding_thread;							/**< the thread decoding the music */
 
-    void update_playing();
+	// decoding thread (while it runs)
+	static OggVorbis_File ogg_file; 							/**< the file used by the vorbisfile lib */
+	static Sound::SoundFromMemory ogg_mem; 						/**< the encoded music loaded in memory */
+	static std::atomic<bool> decoding_stopping;					/**< tells the decoding thread to finish */
+	static SpscQueue<char> ring;								/**< decoded samples, from the decoding thread to the audio thread */
 };
-#endif
\ No newline at end of file
+#endif
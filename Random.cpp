@@ -6,19 +6,43 @@
 #include <ctime>
 #include <cstdlib>
 
+uint32_t Random::seed = 0;
+
 Random::Random()
 {
 }
 
 void Random::initialize()
 {
-	srand((int) time(NULL));
+	set_seed((uint32_t) time(NULL));
 }
 
 void Random::quit()
 {
 }
 
+/**
+* @brief Returns the seed used to initialize the random numbers.
+* @return the seed
+*/
+uint32_t Random::get_seed()
+{
+	return seed;
+}
+
+/**
+* @brief Restarts the sequence of random numbers.
+*
+* The same seed gives the same sequence, which makes replays deterministic.
+*
+* @param seed the new seed
+*/
+void Random::set_seed(uint32_t seed)
+{
+	Random::seed = seed;
+	srand(seed);
+}
+
 /**
 * @brief Returns a random integer number in [0, x[ with a uniform distribution.
 *
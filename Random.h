@@ -10,12 +10,17 @@
 class Random
 {
 private:
+	static uint32_t seed;	/**< the seed of the current sequence */
+
 	Random();
 
 public:
 	static void initialize();
 	static void quit();
 
+	static uint32_t get_seed();
+	static void set_seed(uint32_t seed);
+
 	static int get_number(unsigned int x);
 	static int get_number(unsigned int x, unsigned int y);
 };
@@ -1,25 +1,60 @@
 /** @file Sound.cpp */
 
 #include <cstring>
+#include <cstdio>
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
 #include <sstream>
 #include <vector>
 #include "Sound.h"
+#include "SoundCache.h"
+#include "Music.h"
+#include "Adpcm.h"
 #include "FileTools.h"
+#include "DataFileReader.h"
+#include "System.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KQ_SSE2
+#endif
 
-ALCdevice* Sound::device = NULL;
-ALCcontext* Sound::context = NULL;
+AudioBackend* Sound::backend = NULL;
 bool Sound::initialized = false;
 bool Sound::sounds_preloaded = false;
 float Sound::volume = 1.0;
-std::list<Sound*> Sound::current_sounds;
+bool Sound::mono_to_stereo = false;
 std::map<std::string, Sound> Sound::all_sounds;
+const int Sound::max_voices;
+const uint32_t Sound::decode_option_stereo;
+size_t Sound::memory_budget = 64 * 1024 * 1024;
+size_t Sound::resident_bytes = 0;
+uint32_t Sound::nb_uses = 0;
+uint32_t Sound::nb_evictions = 0;
+std::map<std::string, Sound::StorageClass> Sound::storage_classes;
+Sound::DecodedSound Sound::play_samples;
+Sound::Voice Sound::voice_pool[max_voices];
+int Sound::nb_voices = 0;
+std::vector<int> Sound::free_voices;
+Sound::PlayingSlot Sound::playing_slots[max_voices];
+int Sound::nb_playing_slots = 0;
+uint32_t Sound::nb_voices_started = 0;
+uint32_t Sound::nb_voice_steals = 0;
+Sound::Stats Sound::stats = Sound::Stats();
+std::vector<std::thread> Sound::preload_threads;
+std::mutex Sound::preload_mutex;
+std::condition_variable Sound::preload_condition;
+std::deque<Sound*> Sound::preload_queue;
+std::list<std::pair<Sound*, Sound::DecodedSound*> > Sound::preload_results;
+bool Sound::preload_stopping = false;
+int Sound::nb_preloads = 0;
+int Sound::nb_preloads_done = 0;
 ov_callbacks Sound::ogg_callbacks = 
 {
 	cb_read,
+	cb_seek,
 	NULL,
-	NULL,
-	NULL
+	cb_tell
 };
 
 /**
@@ -27,7 +62,19 @@ ov_callbacks Sound::ogg_callbacks =
 * @param sound_id id of the sound: name of a .ogg file in the sounds subdirectory,
 * without the extension (.ogg is added automatically)
 */
-Sound::Sound(const std::string& sound_id): id(sound_id), buffer(AL_NONE) 
+Sound::Sound(const std::string& sound_id):
+  id(sound_id),
+  buffer(AL_NONE),
+  priority(0),
+  preloading(false),
+  buffer_size(0),
+  storage(STORAGE_PCM),
+  compressed_format(AL_NONE),
+  compressed_sample_rate(0),
+  compressed_decoded_size(0),
+  pinned(false),
+  last_use(0),
+  decode_time(0) 
 {
 }
 
@@ -39,16 +86,14 @@ Sound::~Sound()
   if (is_initialized())
   {
     // stop the sources where this buffer is attached
-    std::list<ALuint>::iterator it;
-    for (it = sources.begin(); it != sources.end(); it++) 
+    for (int i = nb_playing_slots - 1; i >= 0; i--) 
 	{
-		ALuint source = (*it);
-		alSourceStop(source);
-		alSourcei(source, AL_BUFFER, 0);
-		alDeleteSources(1, &source);
+      if (playing_slots[i].sound == this) 
+	  {
+        release_voice(playing_slots[i].voice);
+      }
     }
-    alDeleteBuffers(1, &buffer);
-    current_sounds.remove(this);
+    unload();
   }
 }
 
@@ -58,6 +103,13 @@ Sound::~Sound()
 * This method should be called when the application starts.
 * If the argument -no-audio is provided, this function has no effect and
 * there will be no sound.
+* The argument -audio-backend=openal|null|wav:FILE selects the output
+* (see create_backend()).
+* If the argument -mono-to-stereo is provided, mono sounds are converted
+* to stereo when they are loaded (this doubles their size but makes them
+* audible on some machines that cannot play mono buffers).
+* The argument -sound-memory=MB sets the memory budget of the decoded
+* sounds (64 MB by default, 0 for no limit): see set_memory_budget().
 *
 * @param argc command-line arguments number
 * @param argv command-line arguments
@@ -67,35 +119,37 @@ void Sound::initialize(int argc, char** argv)
 	//check the no-audio option
 	//implement later
 
-	//initialize OpenAL
-	device = alcOpenDevice(NULL);
-	if(!device)
+	//check the -mono-to-stereo and -sound-memory options
+	for(int i = 1; i < argc; i++)
 	{
-		std::cout << "Error:  could not open audio device\n";
+		const std::string arg = argv[i];
+		if(arg == "-mono-to-stereo")
+		{
+			mono_to_stereo = true;
+		}
+		else if(arg.find("-sound-memory=") == 0)
+		{
+			memory_budget = size_t(std::atoi(arg.substr(14).c_str())) * 1024 * 1024;
+		}
 	}
-	ALCint attr[] = {ALC_FREQUENCY, 32000, 0};
-	context = alcCreateContext(device, attr);
-	if(!context)
+
+	//check the -pcm-cache option
+	SoundCache::initialize(argc, argv);
+
+	//open the audio output
+	create_backend(argc, argv);
+	if(backend == NULL)
 	{
-		std::cout << "Error:  could not create audio context\n";
-		alcCloseDevice(device);
 		return;
 	}
-	if (!alcMakeContextCurrent(context)) 
-	{
-		std::cout << "Cannot activate audio context\n";
-		alcDestroyContext(context);
-		alcCloseDevice(device);
-		return;
-    }
 
-	alGenBuffers(0, AL_NONE);  // Necessary on some systems to avoid errors with the first sound loaded
+	create_voices();
 
 	initialized = true;
     set_volume(100);
 
 	//initialize the music system
-	//Music::initialize();
+	Music::initialize();
 }
 
 /**
@@ -108,23 +162,332 @@ void Sound::quit()
   if (is_initialized()) 
   {
     // uninitialize the music subsystem
-    //Music::quit();
+    Music::quit();
 
     // clear the sounds
+    stop_preloading();
     all_sounds.clear();
+    destroy_voices();
 
-    // uninitialize OpenAL
-
-    alcMakeContextCurrent(NULL);
-    alcDestroyContext(context);
-    context = NULL;
-    alcCloseDevice(device);
-    device = NULL;
+    // close the audio output
+    backend->close();
+    delete backend;
+    backend = NULL;
 
     initialized = false;
   }
 }
 
+/**
+* @brief Opens the audio output selected on the command line.
+*
+* -audio-backend=openal (the default) plays on the sound device.
+* -audio-backend=null mixes the sounds in software and discards the result.
+* -audio-backend=wav:FILE mixes the sounds in software into a WAV file.
+* If the sound device cannot be opened, the null output is used instead, so
+* that the audio code still runs on machines without a sound device.
+* backend is NULL if no output could be opened.
+*
+* @param argc command-line arguments number
+* @param argv command-line arguments
+*/
+void Sound::create_backend(int argc, char** argv) 
+{
+  std::string backend_name = "openal";
+  const std::string option = "-audio-backend=";
+  for (int i = 1; i < argc; i++) 
+  {
+    const std::string arg = argv[i];
+    if (arg.find(option) == 0) 
+	{
+      backend_name = arg.substr(option.size());
+    }
+  }
+
+  if (backend_name == "openal") 
+  {
+    backend = new OpenALBackend();
+  }
+  else if (backend_name == "null") 
+  {
+    backend = new MixerBackend();
+  }
+  else if (backend_name.find("wav:") == 0) 
+  {
+    backend = new MixerBackend(backend_name.substr(4));
+  }
+  else 
+  {
+    std::cerr << "Unknown audio backend '" << backend_name << "': using OpenAL\n";
+    backend = new OpenALBackend();
+  }
+
+  if (!backend->open()) 
+  {
+    delete backend;
+    backend = NULL;
+    if (backend_name == "openal") 
+	{
+      std::cerr << "No audio device: mixing the audio in software without output\n";
+      backend = new MixerBackend();
+      if (!backend->open()) 
+	  {
+        delete backend;
+        backend = NULL;
+      }
+    }
+  }
+}
+
+/**
+* @brief Returns the audio output.
+*
+* The audio system must be initialized.
+*
+* @return the backend where sources and buffers are created
+*/
+AudioBackend& Sound::get_backend() 
+{
+  return *backend;
+}
+
+/**
+* @brief Creates the pool of sources used to play sounds.
+*
+* Sources are created once here rather than for each sound played, so that
+* playing a sound never allocates anything from the driver. Some
+* implementations have less than max_voices sources: the pool then gets
+* as many as possible.
+*/
+void Sound::create_voices() 
+{
+  nb_voices = 0;
+  free_voices.clear();
+  free_voices.reserve(max_voices);
+  while (nb_voices < max_voices) 
+  {
+    Voice& voice = voice_pool[nb_voices];
+    voice.source = backend->create_source();
+    if (voice.source == AL_NONE) 
+	{
+      break;
+    }
+    voice.buffer = backend->create_buffer();
+    voice.priority = 0;
+    voice.age = 0;
+    voice.slot = -1;
+    free_voices.push_back(nb_voices);
+    nb_voices++;
+  }
+
+  if (nb_voices < max_voices) 
+  {
+    std::cerr << "Only " << nb_voices << " audio sources are available for sounds" << std::endl;
+  }
+}
+
+/**
+* @brief Destroys the pool of sources.
+*/
+void Sound::destroy_voices() 
+{
+  for (int i = 0; i < nb_voices; i++) 
+  {
+    backend->stop(voice_pool[i].source);
+    backend->set_source_buffer(voice_pool[i].source, AL_NONE);
+    backend->delete_source(voice_pool[i].source);
+    backend->delete_buffer(voice_pool[i].buffer);
+  }
+  nb_voices = 0;
+  free_voices.clear();
+  nb_playing_slots = 0;
+}
+
+/**
+* @brief Gets a voice to play a sound.
+*
+* A free voice is taken if any, in constant time. Otherwise, a voice
+* is stolen from a playing sound (see find_voice_to_steal()).
+* The voice is added to the playing slots.
+*
+* @param sound The sound to play.
+* @param priority Priority of the sound.
+* @return Index of the voice, or -1 if all voices play more important sounds.
+*/
+int Sound::acquire_voice(Sound* sound, int priority) 
+{
+  if (free_voices.empty()) 
+  {
+    int victim = find_voice_to_steal(priority);
+    if (victim == -1) 
+	{
+      stats.nb_voice_failures++;
+      return -1;
+    }
+
+    if (backend->is_playing(voice_pool[victim].source)) 
+	{
+      nb_voice_steals++;
+    }
+    release_voice(victim);
+  }
+
+  int index = free_voices.back();
+  free_voices.pop_back();
+
+  Voice& voice = voice_pool[index];
+  voice.priority = priority;
+  voice.age = nb_voices_started++;
+  voice.slot = nb_playing_slots;
+
+  PlayingSlot& slot = playing_slots[nb_playing_slots++];
+  slot.source = voice.source;
+  slot.sound = sound;
+  slot.voice = index;
+  return index;
+}
+
+/**
+* @brief Stops a voice and makes it available again.
+*
+* The last playing slot is moved to the slot of this voice,
+* so that the playing slots stay packed.
+*
+* @param index Index of a voice in use.
+*/
+void Sound::release_voice(int index) 
+{
+  Voice& voice = voice_pool[index];
+  backend->stop(voice.source);
+  backend->set_source_buffer(voice.source, AL_NONE);
+
+  PlayingSlot& last = playing_slots[--nb_playing_slots];
+  playing_slots[voice.slot] = last;
+  voice_pool[last.voice].slot = voice.slot;
+  voice.slot = -1;
+
+  free_voices.push_back(index);
+}
+
+/**
+* @brief Chooses the voice to interrupt when all voices are in use.
+*
+* A voice that has finished playing but was not released yet is preferred.
+* Otherwise, the voice with the lowest priority is chosen, provided that
+* it is not higher than the requested one. Among those, the quietest
+* voice is chosen, and then the oldest one.
+*
+* @param priority Priority of the sound that needs a voice.
+* @return Index of the voice to steal, or -1 if there is none.
+*/
+int Sound::find_voice_to_steal(int priority) 
+{
+  int best = -1;
+  ALfloat best_gain = 0.0f;
+  for (int i = 0; i < nb_playing_slots; i++) 
+  {
+    int index = playing_slots[i].voice;
+    const Voice& voice = voice_pool[index];
+    if (!backend->is_playing(voice.source)) 
+	{
+      return index;
+    }
+
+    if (voice.priority > priority) 
+	{
+      continue;
+    }
+
+    ALfloat gain = backend->get_gain(voice.source);
+    if (best == -1
+        || voice.priority < voice_pool[best].priority
+        || (voice.priority == voice_pool[best].priority
+            && (gain < best_gain || (gain == best_gain && voice.age < voice_pool[best].age)))) 
+	{
+      best = index;
+      best_gain = gain;
+    }
+  }
+  return best;
+}
+
+/**
+* @brief Returns the number of sources of the voice pool.
+* @return The number of sounds that can play at the same time.
+*/
+int Sound::get_nb_voices() 
+{
+  return nb_voices;
+}
+
+/**
+* @brief Returns the number of voices currently playing a sound.
+* @return The number of active voices.
+*/
+int Sound::get_nb_active_voices() 
+{
+  return nb_playing_slots;
+}
+
+/**
+* @brief Returns the number of times a playing sound was interrupted to play another one.
+* @return The number of voice steals since the program started.
+*/
+uint32_t Sound::get_nb_voice_steals() 
+{
+  return nb_voice_steals;
+}
+
+/**
+* @brief Returns the counters of the sound effects.
+* @param counters receives the counters
+*/
+void Sound::get_stats(Stats& counters) 
+{
+  counters = stats;
+  counters.nb_voices = nb_voices;
+  counters.nb_active_voices = nb_playing_slots;
+  counters.nb_voice_steals = nb_voice_steals;
+  counters.resident_bytes = resident_bytes;
+  counters.nb_evictions = nb_evictions;
+}
+
+/**
+* @brief Returns the time spent decoding each sound.
+* @param decode_times receives the total decoding time in nanoseconds of each
+* sound decoded at least once, by sound id
+*/
+void Sound::get_decode_times(std::map<std::string, uint64_t>& decode_times) 
+{
+  decode_times.clear();
+  std::map<std::string, Sound>::const_iterator it;
+  for (it = all_sounds.begin(); it != all_sounds.end(); ++it) 
+  {
+    if (it->second.decode_time != 0) 
+	{
+      decode_times[it->first] = it->second.decode_time;
+    }
+  }
+}
+
+/**
+* @brief Counts a decoding of this sound in the statistics.
+* @param time time spent decoding in nanoseconds
+* @param size size of the samples decoded in bytes
+*/
+void Sound::add_decode_stats(uint64_t time, size_t size) 
+{
+  decode_time += time;
+  stats.nb_decodes++;
+  stats.decode_time += time;
+  stats.bytes_decoded += size;
+  if (time > stats.max_decode_time) 
+  {
+    stats.max_decode_time = time;
+    stats.slowest_sound = id;
+  }
+}
+
 /**
 * @brief Returns whether the audio (music and sound) system is initialized.
 * @return true if the audio (music and sound) system is initilialized
@@ -136,158 +499,596 @@ bool Sound::is_initialized()
 
 /**
 * @brief Loads and decodes all sounds listed in the game database.
+*
+* The sounds are decoded in the background by a few threads, and their
+* OpenAL buffers are created by update() on the main thread. This function
+* returns immediately: the game keeps running while sounds are loaded.
+* Playing a sound that is not loaded yet waits for this sound only.
+*/
+void Sound::load_all() 
+{
+	
+  if (is_initialized() && !sounds_preloaded) 
+  {
+    // open the resource database file
+    static const std::string file_name = "project_db.dat";
+    DataFileReader database_file(file_name);
+    StringSlice line;
+
+    while (database_file.read_line(line)) 
+	{
+      if (line.is_empty()) 
+	  {
+        continue;
+      }
+
+      int resource_type;
+      StringSlice type_token, id_token;
+      if (!line.next_token(type_token) || !type_token.to_int(resource_type) || !line.next_token(id_token)) 
+	  {
+        std::cerr << "Invalid line " << database_file.get_line_number() << " in '" << file_name << "'\n";
+        continue;
+      }
+
+      if (resource_type == 4) 
+	  { 
+		// it's a sound
+        std::string resource_id = id_token.to_string();
+        if (all_sounds.count(resource_id) == 0) 
+		{
+          all_sounds[resource_id] = Sound(resource_id);
+        }
+        Sound& sound = all_sounds[resource_id];
+        if (!sound.is_loaded() && !sound.preloading) 
+		{
+          sound.storage = get_storage_class(resource_id);
+          sound.preloading = true;
+          preload_queue.push_back(&sound);
+          nb_preloads++;
+        }
+      }
+    }
+
+    // decode on all cores but one, which runs the game
+    unsigned int nb_threads = std::thread::hardware_concurrency();
+    nb_threads = (nb_threads > 1) ? nb_threads - 1 : 1;
+    nb_threads = std::min(nb_threads, unsigned(preload_queue.size()));
+    preload_stopping = false;
+    for (unsigned int i = 0; i < nb_threads; i++) 
+	{
+      preload_threads.push_back(std::thread(preload_thread));
+    }
+ 
+    sounds_preloaded = true;
+  }
+}
+
+/**
+* @brief Returns whether sounds queued by load_all() are still being loaded.
+* @return true if the preloading is not finished
+*/
+bool Sound::is_preloading() 
+{
+  return nb_preloads_done < nb_preloads;
+}
+
+/**
+* @brief Returns the progress of the loading started by load_all().
+* @param nb_done number of sounds loaded so far
+* @param nb_total number of sounds to load
+*/
+void Sound::get_preload_progress(int& nb_done, int& nb_total) 
+{
+  nb_done = nb_preloads_done;
+  nb_total = nb_preloads;
+}
+
+/**
+* @brief Main function of the preloading threads.
+*
+* Decodes queued sounds until the queue is empty.
+* PhysicsFS and libvorbisfile can be used from several threads as long as
+* each thread has its own files.
+*/
+void Sound::preload_thread() 
+{
+  while (true) 
+  {
+    Sound* sound;
+    {
+      std::lock_guard<std::mutex> lock(preload_mutex);
+      if (preload_stopping || preload_queue.empty()) 
+	  {
+        return;
+      }
+      sound = preload_queue.front();
+      preload_queue.pop_front();
+    }
+
+    DecodedSound* decoded = new DecodedSound();
+    load_file(sound->get_file_name(), sound->storage, *decoded);
+
+    {
+      std::lock_guard<std::mutex> lock(preload_mutex);
+      preload_results.push_back(std::make_pair(sound, decoded));
+    }
+    preload_condition.notify_all();
+  }
+}
+
+/**
+* @brief Creates the buffers of the sounds decoded by the preloading threads.
+*
+* This is called by update() on the main thread.
+*/
+void Sound::update_preloading() 
+{
+  if (!is_preloading() && preload_threads.empty()) 
+  {
+    return;
+  }
+
+  std::list<std::pair<Sound*, DecodedSound*> > results;
+  {
+    std::lock_guard<std::mutex> lock(preload_mutex);
+    results.swap(preload_results);
+  }
+
+  std::list<std::pair<Sound*, DecodedSound*> >::iterator it;
+  for (it = results.begin(); it != results.end(); ++it) 
+  {
+    finish_preload(it->first, it->second);
+  }
+
+  if (!is_preloading()) 
+  {
+    // the queue is empty: the threads are finished or about to be
+    for (size_t i = 0; i < preload_threads.size(); i++) 
+	{
+      preload_threads[i].join();
+    }
+    preload_threads.clear();
+  }
+}
+
+/**
+* @brief Stops the preloading threads and drops the sounds not loaded yet.
+*/
+void Sound::stop_preloading() 
+{
+  {
+    std::lock_guard<std::mutex> lock(preload_mutex);
+    preload_stopping = true;
+    preload_queue.clear();
+  }
+
+  for (size_t i = 0; i < preload_threads.size(); i++) 
+  {
+    preload_threads[i].join();
+  }
+  preload_threads.clear();
+
+  std::list<std::pair<Sound*, DecodedSound*> >::iterator it;
+  for (it = preload_results.begin(); it != preload_results.end(); ++it) 
+  {
+    delete it->second;
+  }
+  preload_results.clear();
+  nb_preloads = nb_preloads_done = 0;
+}
+
+/**
+* @brief Creates the buffer of a sound decoded in the background.
+* @param sound the sound
+* @param decoded its samples (deleted by this function)
+*/
+void Sound::finish_preload(Sound* sound, DecodedSound* decoded) 
+{
+  if (decoded->format != AL_NONE) 
+  {
+    sound->attach_buffer(*decoded);
+  }
+  delete decoded;
+  sound->preloading = false;
+  nb_preloads_done++;
+}
+
+/**
+* @brief Waits until this sound, queued by load_all(), is loaded.
+*
+* If no thread has started decoding the sound yet, it is decoded right now
+* instead. Other sounds are not waited for.
+*/
+void Sound::wait_preloaded() 
+{
+  std::unique_lock<std::mutex> lock(preload_mutex);
+
+  std::deque<Sound*>::iterator queued = std::find(preload_queue.begin(), preload_queue.end(), this);
+  if (queued != preload_queue.end()) 
+  {
+    preload_queue.erase(queued);
+    lock.unlock();
+    DecodedSound* decoded = new DecodedSound();
+    load_file(get_file_name(), storage, *decoded);
+    finish_preload(this, decoded);
+    return;
+  }
+
+  // a thread is decoding it
+  while (true) 
+  {
+    std::list<std::pair<Sound*, DecodedSound*> >::iterator it;
+    for (it = preload_results.begin(); it != preload_results.end(); ++it) 
+	{
+      if (it->first == this) 
+	  {
+        DecodedSound* decoded = it->second;
+        preload_results.erase(it);
+        lock.unlock();
+        finish_preload(this, decoded);
+        return;
+      }
+    }
+    preload_condition.wait(lock);
+  }
+}
+
+/**
+* \brief Returns the current volume of sound effects.
+* \return the volume (0 to 100)
+*/
+int Sound::get_volume() 
+{
+  return (int) (volume * 100.0 + 0.5);
+}
+
+/**
+* @brief Sets the volume of sound effects.
+* @param volume the new volume (0 to 100)
+*/
+void Sound::set_volume(int volume) 
+{
+  volume = std::min(100, std::max(0, volume));
+  Sound::volume = volume / 100.0;
+}
+
+/**
+* @brief Updates the audio (music and sound) system.
+*
+* This function is called repeatedly by the game.
+*/
+void Sound::update() 
+{
+  if (!is_initialized()) 
+  {
+    return;
+  }
+  uint64_t start_date = System::get_real_time_ns();
+
+  // mix the audio if the output is in software
+  backend->update();
+
+  // create the buffers of the sounds preloaded in the background
+  update_preloading();
+
+  // release the voices that have finished playing, in one pass over the
+  // playing slots (a released slot is replaced by the last one)
+  int i = 0;
+  while (i < nb_playing_slots) 
+  {
+    if (!backend->is_playing(playing_slots[i].source)) 
+	{
+      release_voice(playing_slots[i].voice);
+    }
+    else 
+	{
+      i++;
+    }
+  }
+
+  uint64_t update_time = System::get_real_time_ns() - start_date;
+  stats.nb_updates++;
+  stats.update_time += update_time;
+  stats.max_update_time = std::max(stats.max_update_time, update_time);
+}
+
+/**
+* @brief Returns whether a sound exists.
+* @param sound_id id of the sound to test
+* @return true if the sound exists
+*/
+bool Sound::exists(const std::string& sound_id) 
+{
+  std::ostringstream oss;
+  oss << "sounds/" << sound_id << ".ogg";
+  return FileTools::data_file_exists(oss.str());
+}
+
+/**
+* @brief Starts playing the specified sound.
+* @param sound_id id of the sound to play
+*/
+void Sound::play(const std::string& sound_id) 
+{
+  if (all_sounds.count(sound_id) == 0) 
+  {
+    all_sounds[sound_id] = Sound(sound_id);
+  }
+
+  all_sounds[sound_id].start();
+}
+
+/**
+* @brief Returns the priority of a sound.
+* @param sound_id id of a sound
+* @return the priority of this sound (0 by default)
+*/
+int Sound::get_priority(const std::string& sound_id) 
+{
+  std::map<std::string, Sound>::iterator it = all_sounds.find(sound_id);
+  return it != all_sounds.end() ? it->second.priority : 0;
+}
+
+/**
+* @brief Sets the priority of a sound.
+*
+* When all voices are busy, a new sound interrupts a playing sound
+* of the same or a lower priority. Sounds of a higher priority are
+* never interrupted.
+*
+* @param sound_id id of a sound
+* @param priority the new priority (0 by default)
+*/
+void Sound::set_priority(const std::string& sound_id, int priority) 
+{
+  if (all_sounds.count(sound_id) == 0) 
+  {
+    all_sounds[sound_id] = Sound(sound_id);
+  }
+
+  all_sounds[sound_id].priority = priority;
+}
+
+/**
+* @brief Loads and decodes the sound into memory.
+*/
+void Sound::load() 
+{
+  std::string file_name = get_file_name();
+
+  // Create a buffer with the sound decoded by the library,
+  // or keep it compressed depending on its storage class.
+  storage = get_storage_class(id);
+  DecodedSound decoded;
+  if (load_file(file_name, storage, decoded)) 
+  {
+    attach_buffer(decoded);
+  }
+
+  // the sound is still not loaded if there was an error.
+}
+
+/**
+* @brief Creates the buffer of this sound from its decoded samples,
+* or keeps its compressed data.
+*
+* The memory budget is enforced, without evicting this sound.
+*
+* @param decoded the decoded samples or compressed data (the compressed data is taken)
+*/
+void Sound::attach_buffer(DecodedSound& decoded) 
+{
+  add_decode_stats(decoded.decode_time, decoded.storage == STORAGE_PCM ? decoded.get_size() : decoded.decoded_size);
+
+  storage = decoded.storage;
+  if (storage == STORAGE_PCM) 
+  {
+    buffer = create_buffer(get_file_name(), decoded);
+    if (buffer == AL_NONE) 
+	{
+      return;
+    }
+    buffer_size = decoded.get_size();
+  }
+  else 
+  {
+    compressed.swap(decoded.compressed);
+    compressed_format = decoded.format;
+    compressed_sample_rate = decoded.sample_rate;
+    compressed_decoded_size = decoded.decoded_size;
+    buffer_size = compressed.size();
+  }
+
+  resident_bytes += buffer_size;
+  last_use = nb_uses++;
+  enforce_memory_budget(this);
+}
+
+/**
+* @brief Returns whether the data of this sound is in memory.
+* @return true if the sound has a buffer or compressed data
+*/
+bool Sound::is_loaded() const 
+{
+  return buffer != AL_NONE || !compressed.empty();
+}
+
+/**
+* @brief Deletes the buffer of this sound, if any.
+*
+* The sound is decoded again (or read from the PCM cache) when it is played next.
+* The sound must not be playing.
+*/
+void Sound::unload() 
+{
+  if (buffer != AL_NONE) 
+  {
+    backend->delete_buffer(buffer);
+    buffer = AL_NONE;
+  }
+  std::vector<char>().swap(compressed);
+  resident_bytes -= buffer_size;
+  buffer_size = 0;
+}
+
+/**
+* @brief Returns whether a voice is playing this sound.
+* @return true if the sound is playing
+*/
+bool Sound::is_playing() const 
+{
+  for (int i = 0; i < nb_playing_slots; i++) 
+  {
+    if (playing_slots[i].sound == this && backend->is_playing(playing_slots[i].source)) 
+	{
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+* @brief Deletes the buffers of the least recently used sounds until
+* the memory budget is respected.
+*
+* Sounds that are pinned or playing are never evicted.
+*
+* @param sound_to_keep a sound not to evict (the one being loaded), or NULL
 */
-void Sound::load_all() 
+void Sound::enforce_memory_budget(const Sound* sound_to_keep) 
 {
-	
-  if (is_initialized() && !sounds_preloaded) 
+  while (memory_budget != 0 && resident_bytes > memory_budget) 
   {
-    // open the resource database file
-    static const std::string file_name = "project_db.dat";
-    std::istream& database_file = FileTools::data_file_open(file_name, false);
-    std::string line;
-
-    while (std::getline(database_file, line)) 
+    Sound* oldest = NULL;
+    std::map<std::string, Sound>::iterator it;
+    for (it = all_sounds.begin(); it != all_sounds.end(); ++it) 
 	{
-      if (line.size() == 0 || line[0] == '\r') 
+      Sound& sound = it->second;
+      if (!sound.is_loaded() || sound.pinned || &sound == sound_to_keep) 
 	  {
         continue;
       }
-
-      int resource_type;
-      std::string resource_id, resource_name;
-      std::istringstream iss(line);
-      FileTools::read(iss, resource_type);
-      FileTools::read(iss, resource_id);
-      FileTools::read(iss, resource_name);
-
-      if (resource_type == 4) 
-	  { 
-		// it's a sound
-        if (all_sounds.count(resource_id) == 0) 
+      if (oldest == NULL || sound.last_use < oldest->last_use) 
+	  {
+        if (!sound.is_playing()) 
 		{
-          all_sounds[resource_id] = Sound(resource_id);
-          all_sounds[resource_id].load();
+          oldest = &sound;
         }
       }
     }
-    FileTools::data_file_close(database_file);
- 
-    sounds_preloaded = true;
+
+    if (oldest == NULL) 
+	{
+      // everything left is pinned or playing
+      return;
+    }
+
+    // release the finished voices still attached to the buffer
+    for (int i = nb_playing_slots - 1; i >= 0; i--) 
+	{
+      if (playing_slots[i].sound == oldest) 
+	  {
+        release_voice(playing_slots[i].voice);
+      }
+    }
+    oldest->unload();
+    nb_evictions++;
   }
 }
 
 /**
-* \brief Returns the current volume of sound effects.
-* \return the volume (0 to 100)
+* @brief Returns the memory budget of the decoded sounds.
+* @return the maximum size of the sound buffers in bytes (0 means no limit)
 */
-int Sound::get_volume() 
+size_t Sound::get_memory_budget() 
 {
-  return (int) (volume * 100.0 + 0.5);
+  return memory_budget;
 }
 
 /**
-* @brief Sets the volume of sound effects.
-* @param volume the new volume (0 to 100)
+* @brief Sets the memory budget of the decoded sounds.
+*
+* When the buffers of the sounds exceed this size, the least recently used
+* sounds that are not playing and not pinned are unloaded. They are decoded
+* again when they are played next.
+*
+* @param budget the maximum size of the sound buffers in bytes (0 means no limit)
 */
-void Sound::set_volume(int volume) 
+void Sound::set_memory_budget(size_t budget) 
 {
-  volume = std::min(100, std::max(0, volume));
-  Sound::volume = volume / 100.0;
+  memory_budget = budget;
+  enforce_memory_budget(NULL);
 }
 
 /**
-* @brief Updates the audio (music and sound) system.
-*
-* This function is called repeatedly by the game.
+* @brief Returns the size of the sound buffers currently in memory.
+* @return the size of the buffers in bytes
 */
-void Sound::update() 
+size_t Sound::get_resident_bytes() 
 {
-  // update the playing sounds
-  Sound* sound;
-  std::list<Sound*> sounds_to_remove;
-  std::list<Sound*>::iterator it;
-  for (it = current_sounds.begin(); it != current_sounds.end(); it++) 
-  {
-    sound = *it;
-    if (!sound->update_playing()) 
-	{
-      sounds_to_remove.push_back(sound);
-    }
-  }
-
-  for (it = sounds_to_remove.begin(); it != sounds_to_remove.end(); it++) 
-  {
-    sound = *it;
-    current_sounds.remove(sound);
-  }
-
-  // also update the music
-  //Music::update();
+  return resident_bytes;
 }
 
 /**
-* @brief Updates this sound when it is playing.
-* @return true if the sound is still playing, false if it is finished.
+* @brief Returns the number of sounds unloaded to respect the memory budget.
+* @return the number of evictions since the program started
 */
-bool Sound::update_playing() 
+uint32_t Sound::get_nb_evictions() 
 {
-  // see whether a source playing this sound has finished playing
-  ALuint source = *sources.begin();
-  ALint status;
-  alGetSourcei(source, AL_SOURCE_STATE, &status);
-
-  if (status != AL_PLAYING) 
-  {
-    sources.pop_front();
-    alSourcei(source, AL_BUFFER, 0);
-    alDeleteSources(1, &source);
-  }
-
-  return sources.size() != 0;
+  return nb_evictions;
 }
 
 /**
-* @brief Returns whether a sound exists.
-* @param sound_id id of the sound to test
-* @return true if the sound exists
+* @brief Returns whether a sound is pinned in memory.
+* @param sound_id id of a sound
+* @return true if the sound is never unloaded
 */
-bool Sound::exists(const std::string& sound_id) 
+bool Sound::is_pinned(const std::string& sound_id) 
 {
-  std::ostringstream oss;
-  oss << "sounds/" << sound_id << ".ogg";
-  return FileTools::data_file_exists(oss.str());
+  std::map<std::string, Sound>::iterator it = all_sounds.find(sound_id);
+  return it != all_sounds.end() && it->second.pinned;
 }
 
 /**
-* @brief Starts playing the specified sound.
-* @param sound_id id of the sound to play
+* @brief Pins a sound in memory or unpins it.
+*
+* A pinned sound is loaded now and never unloaded by the memory budget:
+* use this for sounds that must play without any delay.
+*
+* @param sound_id id of a sound
+* @param pinned true to pin the sound, false to let the budget unload it
 */
-void Sound::play(const std::string& sound_id) 
+void Sound::set_pinned(const std::string& sound_id, bool pinned) 
 {
   if (all_sounds.count(sound_id) == 0) 
   {
     all_sounds[sound_id] = Sound(sound_id);
   }
 
-  all_sounds[sound_id].start();
+  Sound& sound = all_sounds[sound_id];
+  sound.pinned = pinned;
+  if (pinned && is_initialized() && !sound.is_loaded() && !sound.preloading) 
+  {
+    sound.load();
+  }
+  else if (!pinned) 
+  {
+    enforce_memory_budget(NULL);
+  }
 }
 
 /**
-* @brief Loads and decodes the sound into memory.
+* @brief Returns the name of the file of this sound.
+* @return the file name, relative to the data directory
 */
-void Sound::load() 
+std::string Sound::get_file_name() const 
 {
   std::string file_name = (std::string) "sounds/" + id;
   if (id.find(".") == std::string::npos) 
   {
 	file_name += ".ogg";
   }
-
-  // Create an OpenAL buffer with the sound decoded by the library.
-  buffer = decode_file(file_name);
-
-  // buffer is now AL_NONE if there was an error.
+  return file_name;
 }
 
 /**
@@ -300,37 +1101,60 @@ bool Sound::start()
 
   if (is_initialized()) 
   {
-    if (buffer == AL_NONE) 
+    if (preloading) 
+	{
+      // still being loaded in the background
+      wait_preloaded();
+    }
+
+    if (!is_loaded()) 
 	{ 
-	  // first time: load and decode the file
+	  // first time, or unloaded by the memory budget: load and decode the file
       load();
     }
+    last_use = nb_uses++;
+
+    int voice = -1;
+    if (is_loaded()) 
+	{
+      // take a source from the pool
+      voice = acquire_voice(this, priority);
+    }
+
+    ALuint play_buffer = buffer;
+    if (voice != -1 && storage != STORAGE_PCM) 
+	{
+      // decode the compressed sound into the buffer of the voice
+      play_buffer = voice_pool[voice].buffer;
+      uint64_t start_date = System::get_real_time_ns();
+      bool decoded = decode_compressed(play_samples);
+      add_decode_stats(System::get_real_time_ns() - start_date, play_samples.get_size());
+      if (!decoded
+          || !backend->set_buffer_data(play_buffer, play_samples.format, play_samples.get_data(),
+                                       play_samples.get_size(), play_samples.sample_rate)) 
+	  {
+        std::cerr << "Cannot decode sound '" << id << "'";
+        release_voice(voice);
+        voice = -1;
+      }
+    }
 
-    if (buffer != AL_NONE) 
+    if (voice != -1) 
 	{
-      // create a source
-      ALuint source;
-      alGenSources(1, &source);
-      alSourcei(source, AL_BUFFER, buffer);
-      alSourcef(source, AL_GAIN, volume);
+      ALuint source = voice_pool[voice].source;
+      backend->set_gain(source, volume);
 
       // play the sound
-      int error = alGetError();
-      if (error != AL_NO_ERROR) 
+      if (!backend->set_source_buffer(source, play_buffer)) 
 	  {
-        std::cerr << "Cannot attach buffer " << buffer << " to the source to play sound '" << id << "': error " << error;
-        alDeleteSources(1, &source);
+        std::cerr << "Cannot attach buffer " << play_buffer << " to the source to play sound '" << id << "'";
+        release_voice(voice);
       }
       else 
 	  {
-        sources.push_back(source);
-        current_sounds.remove(this); // to avoid duplicates
-        current_sounds.push_back(this);
-        alSourcePlay(source);
-        error = alGetError();
-        if (error != AL_NO_ERROR) 
+        if (!backend->play(source)) 
 		{
-          std::cerr << "Cannot play sound '" << id << "': error " << error;
+          std::cerr << "Cannot play sound '" << id << "'";
         }
         else 
 		{
@@ -343,25 +1167,76 @@ bool Sound::start()
 }
 
 /**
-* @brief Loads the specified sound file and decodes its content into an OpenAL buffer.
+* @brief Loads the specified sound file and decodes its content.
+*
+* This function does not use OpenAL, so that it can run on the preloading
+* threads. Use create_buffer() on the main thread to play the result.
+*
 * @param file_name name of the file to open
-* @return the buffer created, or AL_NONE if the sound could not be loaded
+* @param decoded the decoded samples and their properties
+* @return true in case of success
 */
-ALuint Sound::decode_file(const std::string& file_name) 
+bool Sound::decode_file(const std::string& file_name, DecodedSound& decoded) 
 {
-  ALuint buffer = AL_NONE;
+  decoded.samples.clear();
+  decoded.format = AL_NONE;
+  decoded.sample_rate = 0;
 
   if (!FileTools::data_file_exists(file_name)) 
   {
     std::cerr << "Cannot find sound file '" << file_name << "'";
-    return AL_NONE;
+    return false;
   }
 
   // load the sound file
+  char* data;
+  size_t size;
+  FileTools::data_file_open_buffer(file_name, &data, &size);
+
+  // use the samples decoded by a previous launch if possible
+  uint64_t hash = 0;
+  if (SoundCache::is_enabled()) 
+  {
+    hash = SoundCache::get_hash(data, size, mono_to_stereo ? decode_option_stereo : 0);
+    if (SoundCache::load(file_name, hash, decoded)) 
+	{
+      FileTools::data_file_close_buffer(data);
+      return true;
+    }
+  }
+
+  if (decode_ogg(file_name, data, size, decoded) && SoundCache::is_enabled()) 
+  {
+    SoundCache::save(file_name, hash, decoded);
+  }
+
+  FileTools::data_file_close_buffer(data);
+
+  return decoded.format != AL_NONE;
+}
+
+/**
+* @brief Decodes an Ogg Vorbis sound from memory.
+*
+* This function can be called from the preloading threads.
+*
+* @param file_name name of the sound file, for error messages
+* @param data the encoded sound
+* @param size size of the encoded sound in bytes
+* @param decoded receives the samples (its memory is reused)
+* @return true in case of success
+*/
+bool Sound::decode_ogg(const std::string& file_name, const char* data, size_t size, DecodedSound& decoded) 
+{
+  decoded.samples.clear();
+  decoded.format = AL_NONE;
+  decoded.sample_rate = 0;
+
   SoundFromMemory mem;
+  mem.data = const_cast<char*>(data);
+  mem.size = size;
   mem.loop = false;
   mem.position = 0;
-  FileTools::data_file_open_buffer(file_name, &mem.data, &mem.size);
 
   OggVorbis_File file;
   int error = ov_open_callbacks(&mem, &file, NULL, 0, ogg_callbacks);
@@ -392,15 +1267,26 @@ ALuint Sound::decode_file(const std::string& file_name)
     }
     else 
 	{
-      // decode the sound with vorbisfile
-      std::vector<char> samples;
+      // decode the sound with vorbisfile, directly into a buffer of the final size
+      // (the size is only a hint: the buffer still grows if the file lies)
+      std::vector<char>& samples = decoded.samples;
+      ogg_int64_t nb_samples = ov_pcm_total(&file, -1);
+      if (nb_samples > 0) 
+	  {
+        samples.resize(size_t(nb_samples) * info->channels * 2);
+      }
+
       int bitstream;
       long bytes_read;
-      long total_bytes_read = 0;
-      char samples_buffer[4096];
+      size_t total_bytes_read = 0;
       do 
 	  {
-        bytes_read = ov_read(&file, samples_buffer, 4096, 0, 2, 1, &bitstream);
+        if (samples.size() - total_bytes_read < 4096) 
+		{
+          samples.resize(total_bytes_read + 4096);
+        }
+        int chunk_size = int(std::min(samples.size() - total_bytes_read, size_t(65536)));
+        bytes_read = ov_read(&file, &samples[total_bytes_read], chunk_size, 0, 2, 1, &bitstream);
         if (bytes_read < 0) 
 		{
           std::cerr << "Error while decoding ogg chunk in sound file '" << file_name << "': " << bytes_read;
@@ -408,55 +1294,308 @@ ALuint Sound::decode_file(const std::string& file_name)
         else 
 		{
           total_bytes_read += bytes_read;
-          if (format == AL_FORMAT_STEREO16) 
-		  {
-            samples.insert(samples.end(), samples_buffer, samples_buffer + bytes_read);
-          }
-          else 
-		  {
-            // mono sound files make no sound on some machines
-            // workaround: convert them on-the-fly into stereo sounds
-            // TODO find a better solution
-            for (int i = 0; i < bytes_read; i += 2) 
-			{
-              samples.insert(samples.end(), samples_buffer + i, samples_buffer + i + 2);
-              samples.insert(samples.end(), samples_buffer + i, samples_buffer + i + 2);
-            }
-            total_bytes_read += bytes_read;
-          }
         }
       }
       while (bytes_read > 0);
+      samples.resize(total_bytes_read);
 
-      // copy the samples into an OpenAL buffer
-      alGenBuffers(1, &buffer);
-      alBufferData(buffer, AL_FORMAT_STEREO16, (ALshort*) &samples[0], ALsizei(total_bytes_read), sample_rate);
-      if (alGetError() != AL_NO_ERROR) 
+      if (format == AL_FORMAT_MONO16 && mono_to_stereo && !samples.empty()) 
 	  {
-        std::cerr << "Cannot copy the sound samples of '" << file_name << " into buffer " << buffer << std::endl;
-        buffer = AL_NONE;
+        // mono sound files make no sound on some machines
+        // workaround: convert them into stereo sounds
+        size_t nb_mono_samples = samples.size() / 2;
+        std::vector<char> stereo_samples(nb_mono_samples * 4);
+        expand_mono_to_stereo((const int16_t*) &samples[0], (int16_t*) &stereo_samples[0], nb_mono_samples);
+        samples.swap(stereo_samples);
+        format = AL_FORMAT_STEREO16;
       }
+
+      decoded.format = format;
+      decoded.sample_rate = sample_rate;
     }
     ov_clear(&file);
   }
 
-  FileTools::data_file_close_buffer(mem.data);
+  return decoded.format != AL_NONE;
+}
+
+/**
+* @brief Loads a sound file as required by a storage class.
+*
+* For STORAGE_PCM, the sound is decoded (see decode_file()).
+* For STORAGE_VORBIS, the file is only read, and its header is checked.
+* For STORAGE_ADPCM, the sound is decoded and then compressed.
+* This function can be called from the preloading threads.
+*
+* @param file_name name of the sound file
+* @param storage the storage class
+* @param decoded receives the samples or the compressed data
+* @return true in case of success
+*/
+bool Sound::load_file(const std::string& file_name, StorageClass storage, DecodedSound& decoded) 
+{
+  uint64_t start_date = System::get_real_time_ns();
+  decoded.storage = STORAGE_PCM;
+  decoded.compressed.clear();
+  decoded.decoded_size = 0;
+  decoded.decode_time = 0;
+
+  if (storage == STORAGE_VORBIS) 
+  {
+    if (!FileTools::data_file_exists(file_name)) 
+	{
+      std::cerr << "Cannot find sound file '" << file_name << "'";
+      return false;
+    }
+
+    SoundFromMemory mem;
+    mem.loop = false;
+    mem.position = 0;
+    FileTools::data_file_open_buffer(file_name, &mem.data, &mem.size);
+
+    OggVorbis_File file;
+    int error = ov_open_callbacks(&mem, &file, NULL, 0, ogg_callbacks);
+    if (error) 
+	{
+      std::cerr << "Cannot load sound file '" << file_name << "' from memory: error " << error;
+    }
+    else 
+	{
+      vorbis_info* info = ov_info(&file, -1);
+      if (info->channels != 1 && info->channels != 2) 
+	  {
+        std::cerr << "Invalid audio format for sound file '" << file_name << "'";
+      }
+      else 
+	  {
+        decoded.format = (info->channels == 2 || mono_to_stereo) ? AL_FORMAT_STEREO16 : AL_FORMAT_MONO16;
+        decoded.sample_rate = ALsizei(info->rate);
+        decoded.compressed.assign(mem.data, mem.data + mem.size);
+        decoded.storage = STORAGE_VORBIS;
+      }
+      ov_clear(&file);
+    }
+
+    FileTools::data_file_close_buffer(mem.data);
+    decoded.decode_time = System::get_real_time_ns() - start_date;
+    return decoded.storage == STORAGE_VORBIS;
+  }
+
+  if (!decode_file(file_name, decoded)) 
+  {
+    return false;
+  }
+
+  if (storage == STORAGE_ADPCM) 
+  {
+    int nb_channels = (decoded.format == AL_FORMAT_STEREO16) ? 2 : 1;
+    decoded.decoded_size = decoded.get_size();
+    Adpcm::encode((const int16_t*) decoded.get_data(), decoded.decoded_size / 2, nb_channels, decoded.compressed);
+    std::vector<char>().swap(decoded.samples);
+    decoded.storage = STORAGE_ADPCM;
+  }
+  decoded.decode_time = System::get_real_time_ns() - start_date;
+  return true;
+}
+
+/**
+* @brief Decodes the compressed data of this sound.
+* @param decoded receives the samples (its memory is reused)
+* @return true in case of success
+*/
+bool Sound::decode_compressed(DecodedSound& decoded) const 
+{
+  if (storage == STORAGE_VORBIS) 
+  {
+    return decode_ogg(get_file_name(), &compressed[0], compressed.size(), decoded);
+  }
+
+  int nb_channels = (compressed_format == AL_FORMAT_STEREO16) ? 2 : 1;
+  decoded.samples.resize(compressed_decoded_size);
+  if (!decoded.samples.empty()) 
+  {
+    Adpcm::decode(&compressed[0], compressed_decoded_size / 2, nb_channels, (int16_t*) &decoded.samples[0]);
+  }
+  decoded.format = compressed_format;
+  decoded.sample_rate = compressed_sample_rate;
+  return true;
+}
+
+/**
+* @brief Returns the storage class of a sound.
+*
+* This is the storage class set for the sound itself if any, otherwise
+* the one of the closest group (directory) containing it, otherwise STORAGE_PCM.
+*
+* @param sound_id id of a sound
+* @return its storage class
+*/
+Sound::StorageClass Sound::get_storage_class(const std::string& sound_id) 
+{
+  std::map<std::string, StorageClass>::const_iterator it = storage_classes.find(sound_id);
+  if (it != storage_classes.end()) 
+  {
+    return it->second;
+  }
+
+  size_t end = sound_id.rfind('/');
+  while (end != std::string::npos) 
+  {
+    it = storage_classes.find(sound_id.substr(0, end + 1));
+    if (it != storage_classes.end()) 
+	{
+      return it->second;
+    }
+    end = (end == 0) ? std::string::npos : sound_id.rfind('/', end - 1);
+  }
+  return STORAGE_PCM;
+}
+
+/**
+* @brief Sets how a sound or a group of sounds is kept in memory.
+*
+* Compressed storage classes use less memory, but the sound is decoded
+* each time it plays. They are meant for short effects.
+* Loaded sounds that are not playing are unloaded if their storage class
+* changes: they are loaded again with the new one when they play next.
+*
+* @param sound_or_group_id id of a sound, or a directory of sounds ending with '/'
+* (for example "enemies/")
+* @param storage the storage class
+*/
+void Sound::set_storage_class(const std::string& sound_or_group_id, StorageClass storage) 
+{
+  storage_classes[sound_or_group_id] = storage;
+
+  std::map<std::string, Sound>::iterator it;
+  for (it = all_sounds.begin(); it != all_sounds.end(); ++it) 
+  {
+    Sound& sound = it->second;
+    if (sound.is_loaded()
+        && sound.storage != get_storage_class(sound.id)
+        && !sound.is_playing()) 
+	{
+      for (int i = nb_playing_slots - 1; i >= 0; i--) 
+	  {
+        if (playing_slots[i].sound == &sound) 
+		{
+          release_voice(playing_slots[i].voice);
+        }
+      }
+      sound.unload();
+    }
+  }
+}
 
+/**
+* @brief Copies decoded samples into a new buffer of the backend.
+*
+* This function must be called from the main thread.
+*
+* @param file_name name of the sound file, for error messages
+* @param decoded the decoded samples
+* @return the buffer created, or AL_NONE in case of error
+*/
+ALuint Sound::create_buffer(const std::string& file_name, const DecodedSound& decoded) 
+{
+  ALuint buffer = backend->create_buffer();
+  if (!backend->set_buffer_data(buffer, decoded.format, decoded.get_data(), decoded.get_size(), decoded.sample_rate)) 
+  {
+    std::cerr << "Cannot copy the sound samples of '" << file_name << " into buffer " << buffer << std::endl;
+    backend->delete_buffer(buffer);
+    buffer = AL_NONE;
+  }
   return buffer;
 }
 
+/**
+* @brief Creates an empty decoded sound.
+*/
+Sound::DecodedSound::DecodedSound():
+  mapping(NULL),
+  mapping_size(0),
+  mapping_offset(0),
+  format(AL_NONE),
+  sample_rate(0),
+  storage(STORAGE_PCM),
+  decoded_size(0),
+  decode_time(0) 
+{
+}
+
+/**
+* @brief Destroys the decoded sound and releases its mapping if any.
+*/
+Sound::DecodedSound::~DecodedSound() 
+{
+  if (mapping != NULL) 
+  {
+    FileTools::data_file_unmap(mapping, mapping_size);
+  }
+}
+
+/**
+* @brief Returns the samples.
+* @return the samples, or NULL if there is none
+*/
+const char* Sound::DecodedSound::get_data() const 
+{
+  if (mapping != NULL) 
+  {
+    return mapping + mapping_offset;
+  }
+  return samples.empty() ? NULL : &samples[0];
+}
+
+/**
+* @brief Returns the size of the samples.
+* @return the size in bytes
+*/
+size_t Sound::DecodedSound::get_size() const 
+{
+  if (mapping != NULL) 
+  {
+    return mapping_size - mapping_offset;
+  }
+  return samples.size();
+}
+
+/**
+* @brief Duplicates each sample of a mono sound into the two channels of a stereo sound.
+* @param mono the mono samples
+* @param stereo destination of the stereo samples (2 * nb_samples values)
+* @param nb_samples number of mono samples
+*/
+void Sound::expand_mono_to_stereo(const int16_t* mono, int16_t* stereo, size_t nb_samples) 
+{
+  size_t i = 0;
+#ifdef KQ_SSE2
+  // 8 samples at a time: interleave each sample with itself
+  for (; i + 8 <= nb_samples; i += 8) 
+  {
+    __m128i samples = _mm_loadu_si128((const __m128i*) (mono + i));
+    _mm_storeu_si128((__m128i*) (stereo + 2 * i), _mm_unpacklo_epi16(samples, samples));
+    _mm_storeu_si128((__m128i*) (stereo + 2 * i + 8), _mm_unpackhi_epi16(samples, samples));
+  }
+#endif
+  for (; i < nb_samples; i++) 
+  {
+    stereo[2 * i] = mono[i];
+    stereo[2 * i + 1] = mono[i];
+  }
+}
+
 /**
 * @brief Loads an encoded sound from memory.
 *
 * This function respects the prototype specified by libvorbisfile.
 *
 * @param ptr pointer to a buffer to load
-* @param size size
 * @param nb_bytes number of bytes to load
 * @param datasource source of the data to read
 * @return number of bytes loaded
 */
-size_t Sound::cb_read(void* ptr, size_t size, size_t nb_bytes, void* datasource) 
+size_t Sound::cb_read(void* ptr, size_t /* size */, size_t nb_bytes, void* datasource) 
 {
   SoundFromMemory* mem = (SoundFromMemory*) datasource;
 
@@ -482,3 +1621,59 @@ size_t Sound::cb_read(void* ptr, size_t size, size_t nb_bytes, void* datasource)
   return nb_bytes;
 }
 
+/**
+* @brief Moves the current position in an encoded sound loaded in memory.
+*
+* This function respects the prototype specified by libvorbisfile.
+* Being able to seek lets libvorbisfile know the length of the sound.
+*
+* @param datasource source of the data to read
+* @param offset the new position, relative to whence
+* @param whence SEEK_SET, SEEK_CUR or SEEK_END
+* @return 0 in case of success, -1 otherwise
+*/
+int Sound::cb_seek(void* datasource, ogg_int64_t offset, int whence) 
+{
+  SoundFromMemory* mem = (SoundFromMemory*) datasource;
+
+  ogg_int64_t position;
+  switch (whence) 
+  {
+    case SEEK_SET:
+      position = offset;
+      break;
+
+    case SEEK_CUR:
+      position = ogg_int64_t(mem->position) + offset;
+      break;
+
+    case SEEK_END:
+      position = ogg_int64_t(mem->size) + offset;
+      break;
+
+    default:
+      return -1;
+  }
+
+  if (position < 0 || position > ogg_int64_t(mem->size)) 
+  {
+    return -1;
+  }
+
+  mem->position = size_t(position);
+  return 0;
+}
+
+/**
+* @brief Returns the current position in an encoded sound loaded in memory.
+*
+* This function respects the prototype specified by libvorbisfile.
+*
+* @param datasource source of the data to read
+* @return the current position in bytes
+*/
+long Sound::cb_tell(void* datasource) 
+{
+  SoundFromMemory* mem = (SoundFromMemory*) datasource;
+  return long(mem->position);
+}
@@ -5,11 +5,17 @@
 
 #include "Common.h"
 #include <string>
-#include <list>
 #include <map>
+#include <vector>
+#include <list>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "al.h"
 #include "alc.h"
 #include "vorbis/vorbisfile.h"
+#include "AudioBackend.h"
 
 
 //Finished
@@ -20,29 +26,190 @@
 * To create a sound, prefer the Sound::play() method
 * rather than calling directly the constructor of Sound.
 * This class is the only one that depends on the sound decoding library (libsndfile).
-* This class and the Music class are the only ones that depend on the audio mixer library (OpenAL).
+* This class and the Music class are the only ones that use the audio output (see AudioBackend).
 */
 
 class Sound
 {
+public:
+
+	/**
+	* @brief How a sound is kept in memory once loaded.
+	*/
+	enum StorageClass
+	{
+		STORAGE_PCM,		/**< decoded samples in a buffer: no cost to play (default) */
+		STORAGE_VORBIS,		/**< the original Ogg Vorbis file, decoded each time the sound plays */
+		STORAGE_ADPCM		/**< IMA-ADPCM samples (4 times smaller than PCM), decoded each time the sound plays */
+	};
+
+	/**
+	* @brief Decoded samples of a sound, ready to be copied into an audio buffer.
+	*
+	* The samples are either decoded into memory or mapped from the PCM cache
+	* (see SoundCache). The mapping is released with the object.
+	* For the compressed storage classes, only the compressed data is loaded.
+	*/
+	struct DecodedSound
+	{
+		DecodedSound();
+		~DecodedSound();
+
+		const char* get_data() const;
+		size_t get_size() const;
+
+		std::vector<char> samples;		/**< the PCM samples (16 bits), unless they are mapped */
+		const char* mapping;			/**< the cache file mapped in memory, or NULL */
+		size_t mapping_size;			/**< size of the mapping */
+		size_t mapping_offset;			/**< position of the samples in the mapping */
+		ALenum format;					/**< AL_FORMAT_MONO16 or AL_FORMAT_STEREO16, AL_NONE if decoding failed */
+		ALsizei sample_rate;			/**< number of samples per second */
+		StorageClass storage;			/**< STORAGE_PCM, or the storage class of the compressed data */
+		std::vector<char> compressed;	/**< the compressed data (if storage is not STORAGE_PCM) */
+		size_t decoded_size;			/**< size of the samples once decompressed in bytes */
+		uint64_t decode_time;			/**< time spent loading and decoding in nanoseconds */
+
+	private:
+		DecodedSound(const DecodedSound& other);				// not copyable
+		DecodedSound& operator=(const DecodedSound& other);
+	};
+
+	/**
+	* @brief Counters of the sound effects, to diagnose audio hitches.
+	*
+	* Times are in nanoseconds, measured on the real clock.
+	*/
+	struct Stats
+	{
+		uint32_t nb_decodes;			/**< number of sounds decoded (loaded or compressed ones played) */
+		uint64_t decode_time;			/**< total time spent decoding */
+		uint64_t max_decode_time;		/**< longest decoding */
+		std::string slowest_sound;		/**< id of the sound of the longest decoding */
+		uint64_t bytes_decoded;			/**< total size of the samples decoded in bytes */
+		int nb_voices;					/**< number of voices of the pool */
+		int nb_active_voices;			/**< number of voices currently playing */
+		uint32_t nb_voice_steals;		/**< number of playing sounds interrupted for another one */
+		uint32_t nb_voice_failures;		/**< number of sounds not played because no voice was available */
+		uint32_t nb_updates;			/**< number of calls to update() */
+		uint64_t update_time;			/**< total time spent in update() */
+		uint64_t max_update_time;		/**< longest update() */
+		size_t resident_bytes;			/**< size of the sounds in memory in bytes */
+		uint32_t nb_evictions;			/**< number of sounds unloaded by the memory budget */
+	};
+
 private:
 
-	static ALCdevice* device;		
-	static ALCcontext* context;		
+	static AudioBackend* backend;	/**< OpenAL, or the software mixer when there is no sound device */
+
+
+	/**
+	* @brief A source of the pool, with the sound it plays.
+	*/
+	struct Voice
+	{
+		ALuint source;		/**< the source, created once by initialize() */
+		ALuint buffer;		/**< buffer where compressed sounds are decoded when this voice plays them */
+		int priority;		/**< priority of the sound when it was started */
+		uint32_t age;		/**< order of the start, to find the oldest voice */
+		int slot;			/**< position of the voice in playing_slots, or -1 if the voice is free */
+	};
 
+	/**
+	* @brief A voice currently in use, with the sound it plays.
+	*/
+	struct PlayingSlot
+	{
+		ALuint source;		/**< the source of the voice */
+		Sound* sound;		/**< the sound playing */
+		int voice;			/**< index of the voice in voice_pool */
+	};
 
 	std::string id;									/**< id of this sound */
-	ALuint buffer;									/**< the OpenAL buffer containing the PCM decoded data of this sound */
-	std::list<ALuint> sources;						/**< the sources currently playing this sound */
-	static std::list<Sound*> current_sounds;		/**< the sounds currently playing */
+	ALuint buffer;									/**< the buffer containing the PCM decoded data of this sound */
+	int priority;									/**< voices of this sound can only be stolen by sounds with the same or
+													 * a higher priority */
+	bool preloading;								/**< true if the sound is queued for preloading and its
+													 * buffer is not created yet (main thread only) */
+	size_t buffer_size;								/**< size of the samples in the buffer or of the compressed data
+													 * in bytes (0 if not loaded) */
+	StorageClass storage;							/**< storage class of the data loaded */
+	std::vector<char> compressed;					/**< the compressed data, instead of buffer for the compressed
+													 * storage classes */
+	ALenum compressed_format;						/**< format of the compressed samples once decoded */
+	ALsizei compressed_sample_rate;					/**< sample rate of the compressed samples */
+	size_t compressed_decoded_size;					/**< size of the compressed samples once decoded in bytes */
+	bool pinned;									/**< true to never evict the buffer of this sound */
+	uint32_t last_use;								/**< value of nb_uses when the sound was last played or loaded */
+	uint64_t decode_time;							/**< total time spent decoding this sound in nanoseconds */
 	static std::map<std::string, Sound> all_sounds;	/**< all sounds created before */
 
 	static bool initialized;						/**< indicates that the audio system is initialized */
 	static bool sounds_preloaded;					/**< true if load_all() was called */
 	static float volume;							/**< the volume of sound effects (0.0 to 1.0) */
+	static bool mono_to_stereo;						/**< true to convert mono sounds to stereo (-mono-to-stereo) */
+	static const uint32_t decode_option_stereo = 1;	/**< decoding option: mono sounds are converted to stereo */
+
+	// memory budget
+	static size_t memory_budget;					/**< maximum size of the buffers in bytes (0: no limit) */
+	static size_t resident_bytes;					/**< current size of the buffers in bytes */
+	static uint32_t nb_uses;						/**< number of sounds played or loaded, to find the least recently used */
+	static uint32_t nb_evictions;					/**< number of buffers deleted to respect the budget */
+
+	// storage classes
+	static std::map<std::string, StorageClass>
+		storage_classes;							/**< storage class of sounds (by id) and of groups of sounds
+													 * (by directory, ending with '/') */
+	static DecodedSound play_samples;				/**< samples decoded to play a compressed sound (its memory is reused) */
+
+	void attach_buffer(DecodedSound& decoded);
+	void unload();
+	bool is_loaded() const;
+	bool decode_compressed(DecodedSound& decoded) const;
+	void add_decode_stats(uint64_t time, size_t size);
+	bool is_playing() const;
+	static void enforce_memory_budget(const Sound* sound_to_keep);
+
+	// voice pool
+	static const int max_voices = 32;				/**< number of sources created by initialize() */
+	static Voice voice_pool[max_voices];			/**< all voices (only the first nb_voices ones exist) */
+	static int nb_voices;							/**< number of sources actually created */
+	static std::vector<int> free_voices;			/**< index of the free voices */
+	static PlayingSlot playing_slots[max_voices];	/**< the voices in use, packed at the beginning */
+	static int nb_playing_slots;					/**< number of voices in use */
+	static uint32_t nb_voices_started;				/**< number of sounds started, to age the voices */
+	static uint32_t nb_voice_steals;				/**< number of voices taken from a playing sound */
+	static Stats stats;								/**< counters (the voice ones are filled by get_stats()) */
 
-	ALuint decode_file(const std::string &file_name);
-	bool update_playing();
+	static void create_backend(int argc, char** argv);
+	static void create_voices();
+	static void destroy_voices();
+	static int acquire_voice(Sound* sound, int priority);
+	static void release_voice(int voice);
+	static int find_voice_to_steal(int priority);
+
+	// background preloading (the threads only decode: the backend is only used by the main thread)
+	static std::vector<std::thread> preload_threads;	/**< threads decoding the sounds queued by load_all() */
+	static std::mutex preload_mutex;				/**< protects the queue and the results */
+	static std::condition_variable preload_condition;	/**< signaled when a sound is decoded */
+	static std::deque<Sound*> preload_queue;		/**< sounds waiting to be decoded */
+	static std::list<std::pair<Sound*, DecodedSound*> >
+		preload_results;							/**< sounds decoded, waiting for their buffer */
+	static bool preload_stopping;					/**< tells the threads to stop */
+	static int nb_preloads;							/**< number of sounds queued by load_all() */
+	static int nb_preloads_done;					/**< number of those sounds whose buffer is created */
+
+	static void preload_thread();
+	static void update_preloading();
+	static void stop_preloading();
+	static void finish_preload(Sound* sound, DecodedSound* decoded);
+	void wait_preloaded();
+
+	std::string get_file_name() const;
+	static bool load_file(const std::string& file_name, StorageClass storage, DecodedSound& decoded);
+	static bool decode_file(const std::string& file_name, DecodedSound& decoded);
+	static bool decode_ogg(const std::string& file_name, const char* data, size_t size, DecodedSound& decoded);
+	static ALuint create_buffer(const std::string& file_name, const DecodedSound& decoded);
+	static void expand_mono_to_stereo(const int16_t* mono, int16_t* stereo, size_t nb_samples);
 
 public:
 
@@ -62,6 +229,8 @@ public:
 	// functions to load the encoded sound from memory
 	 static ov_callbacks ogg_callbacks;           /**< vorbisfile object used to load the encoded sound from memory */
 	 static size_t cb_read(void* ptr, size_t size, size_t nmemb, void* datasource);
+	 static int cb_seek(void* datasource, ogg_int64_t offset, int whence);
+	 static long cb_tell(void* datasource);
 
 	 Sound(const std::string& sound_id = "");
 	 ~Sound();
@@ -69,15 +238,35 @@ public:
 	 bool start();
 
 	 static void load_all();
+	 static bool is_preloading();
+	 static void get_preload_progress(int& nb_done, int& nb_total);
 	 static bool exists(const std::string& sound_id);
 	 static void play(const std::string& sound_id);
+	 static int get_priority(const std::string& sound_id);
+	 static void set_priority(const std::string& sound_id, int priority);
 
 	 static void initialize(int argc, char** argv);
      static void quit();
      static bool is_initialized();
      static void update();
+     static AudioBackend& get_backend();
 
      static int get_volume();
      static void set_volume(int volume);
+
+     static int get_nb_voices();
+     static int get_nb_active_voices();
+     static uint32_t get_nb_voice_steals();
+     static void get_stats(Stats& counters);
+     static void get_decode_times(std::map<std::string, uint64_t>& decode_times);
+
+     static size_t get_memory_budget();
+     static void set_memory_budget(size_t budget);
+     static size_t get_resident_bytes();
+     static uint32_t get_nb_evictions();
+     static bool is_pinned(const std::string& sound_id);
+     static void set_pinned(const std::string& sound_id, bool pinned);
+     static StorageClass get_storage_class(const std::string& sound_id);
+     static void set_storage_class(const std::string& sound_or_group_id, StorageClass storage);
 };
 #endif
\ No newline at end of file
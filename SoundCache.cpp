@@ -0,0 +1,263 @@
+/** @file SoundCache.cpp */
+
+#include "SoundCache.h"
+#include "FileTools.h"
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+const char SoundCache::header_magic[8] = { 'K', 'Q', 'P', 'C', 'M', '0', '1', '\0' };
+bool SoundCache::enabled = false;
+size_t SoundCache::max_size = 64 * 1024 * 1024;
+size_t SoundCache::cache_size = 0;
+bool SoundCache::cache_size_known = false;
+std::mutex SoundCache::mutex;
+
+namespace
+{
+	/**
+	* @brief A cache file, to choose which ones to delete.
+	*/
+	struct CacheFile
+	{
+		std::string file_name;
+		int64_t modification_time;
+		size_t size;
+
+		bool operator<(const CacheFile& other) const
+		{
+			return modification_time < other.modification_time;
+		}
+	};
+}
+
+/**
+* @brief Checks the -pcm-cache[=MB] option.
+* @param argc command-line arguments number
+* @param argv command-line arguments
+*/
+void SoundCache::initialize(int argc, char** argv)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if(arg == "-pcm-cache")
+		{
+			enabled = true;
+		}
+		else if(arg.find("-pcm-cache=") == 0)
+		{
+			enabled = true;
+			max_size = size_t(std::atoi(arg.substr(11).c_str())) * 1024 * 1024;
+		}
+	}
+}
+
+/**
+* @brief Returns whether decoded sounds are cached.
+* @return true if -pcm-cache was passed.
+*/
+bool SoundCache::is_enabled()
+{
+	return enabled;
+}
+
+/**
+* @brief Computes the hash that identifies the decoded content of a sound.
+*
+* This is a 64-bit FNV-1a hash of the encoded file and of the options
+* that change the decoded samples.
+*
+* @param buffer The encoded sound file.
+* @param size Size of the buffer in bytes.
+* @param options Decoding options (Sound::decode_option_stereo...).
+* @return The hash.
+*/
+uint64_t SoundCache::get_hash(const char* buffer, size_t size, uint32_t options)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= uint8_t(buffer[i]);
+		hash *= 1099511628211ULL;
+	}
+	hash ^= options;
+	hash *= 1099511628211ULL;
+	return hash;
+}
+
+/**
+* @brief Returns the name of the cache file of a sound.
+* @param file_name Name of a sound file (e.g. "sounds/sword.ogg").
+* @return Name of its cache file relative to the write directory
+* (e.g. "<quest write dir>/pcm/sounds/sword.ogg.pcm").
+*/
+std::string SoundCache::get_cache_file_name(const std::string& file_name)
+{
+	return FileTools::get_quest_write_dir() + "/pcm/" + file_name + ".pcm";
+}
+
+/**
+* @brief Maps the cached samples of a sound if they are up to date.
+* @param file_name Name of the sound file.
+* @param hash Hash of the current content of the sound file.
+* @param decoded The mapped samples, with their format and rate.
+* @return true if the samples were found in the cache.
+*/
+bool SoundCache::load(const std::string& file_name, uint64_t hash, Sound::DecodedSound& decoded)
+{
+	if(FileTools::get_quest_write_dir().empty())
+	{
+		return false;
+	}
+
+	const std::string& cache_file_name = get_cache_file_name(file_name);
+	if(!FileTools::data_file_exists(cache_file_name))
+	{
+		return false;
+	}
+
+	const char* data;
+	size_t size;
+	if(!FileTools::data_file_map(cache_file_name, &data, &size))
+	{
+		return false;
+	}
+
+	Header header;
+	if(size < sizeof(header))
+	{
+		FileTools::data_file_unmap(data, size);
+		return false;
+	}
+	std::memcpy(&header, data, sizeof(header));
+	if(std::memcmp(header.magic, header_magic, sizeof(header_magic)) != 0
+		|| header.hash != hash
+		|| header.size != size - sizeof(header))
+	{
+		// Outdated or truncated: the sound will be decoded and cached again.
+		FileTools::data_file_unmap(data, size);
+		return false;
+	}
+
+	decoded.samples.clear();
+	decoded.mapping = data;
+	decoded.mapping_size = size;
+	decoded.mapping_offset = sizeof(header);
+	decoded.format = ALenum(header.format);
+	decoded.sample_rate = ALsizei(header.sample_rate);
+	return true;
+}
+
+/**
+* @brief Saves the decoded samples of a sound into the cache.
+*
+* Nothing is saved if the sound is larger than the maximum size of the cache.
+*
+* @param file_name Name of the sound file.
+* @param hash Hash of the content of the sound file.
+* @param decoded The decoded samples.
+*/
+void SoundCache::save(const std::string& file_name, uint64_t hash, const Sound::DecodedSound& decoded)
+{
+	if(FileTools::get_quest_write_dir().empty())
+	{
+		return;
+	}
+
+	Header header;
+	std::memcpy(header.magic, header_magic, sizeof(header_magic));
+	header.hash = hash;
+	header.format = uint32_t(decoded.format);
+	header.sample_rate = uint32_t(decoded.sample_rate);
+	header.size = decoded.get_size();
+
+	size_t file_size = sizeof(header) + decoded.get_size();
+	if(file_size > max_size)
+	{
+		return;
+	}
+
+	std::vector<char> buffer(file_size);
+	std::memcpy(&buffer[0], &header, sizeof(header));
+	if(decoded.get_size() > 0)
+	{
+		std::memcpy(&buffer[sizeof(header)], decoded.get_data(), decoded.get_size());
+	}
+
+	const std::string& cache_file_name = get_cache_file_name(file_name);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if(FileTools::data_file_exists(cache_file_name))
+	{
+		// Outdated version.
+		cache_size -= std::min(cache_size, FileTools::data_file_get_size(cache_file_name));
+	}
+	make_room(file_size);
+	FileTools::data_file_mkdir(cache_file_name.substr(0, cache_file_name.rfind('/')));
+	FileTools::data_file_save_buffer(cache_file_name, &buffer[0], buffer.size());
+	cache_size += file_size;
+}
+
+/**
+* @brief Computes the total size of the cache files.
+*
+* Call this with the mutex locked.
+*/
+void SoundCache::compute_cache_size()
+{
+	std::vector<std::string> file_names;
+	FileTools::data_files_find(FileTools::get_quest_write_dir() + "/pcm", ".pcm", file_names);
+
+	cache_size = 0;
+	std::vector<std::string>::const_iterator it;
+	for(it = file_names.begin(); it != file_names.end(); ++it)
+	{
+		cache_size += FileTools::data_file_get_size(*it);
+	}
+	cache_size_known = true;
+}
+
+/**
+* @brief Deletes the oldest cache files until a new file fits in the cache.
+*
+* Call this with the mutex locked.
+*
+* @param size Size of the new file in bytes.
+*/
+void SoundCache::make_room(size_t size)
+{
+	if(!cache_size_known)
+	{
+		compute_cache_size();
+	}
+
+	if(cache_size + size <= max_size)
+	{
+		return;
+	}
+
+	std::vector<std::string> file_names;
+	FileTools::data_files_find(FileTools::get_quest_write_dir() + "/pcm", ".pcm", file_names);
+
+	std::vector<CacheFile> files;
+	std::vector<std::string>::const_iterator it;
+	for(it = file_names.begin(); it != file_names.end(); ++it)
+	{
+		CacheFile file;
+		file.file_name = *it;
+		file.modification_time = FileTools::data_file_get_modification_time(*it);
+		file.size = FileTools::data_file_get_size(*it);
+		files.push_back(file);
+	}
+	std::sort(files.begin(), files.end());
+
+	std::vector<CacheFile>::const_iterator it2;
+	for(it2 = files.begin(); it2 != files.end() && cache_size + size > max_size; ++it2)
+	{
+		FileTools::data_file_delete(it2->file_name);
+		cache_size -= std::min(cache_size, it2->size);
+	}
+}
@@ -0,0 +1,66 @@
+/** @file SoundCache.h */
+
+#ifndef KQ_SOUND_CACHE_H
+#define KQ_SOUND_CACHE_H
+
+#include "Common.h"
+#include "Sound.h"
+#include <string>
+#include <mutex>
+
+/**
+* @brief Cache of decoded sound effects on the disk.
+*
+* Decoding Ogg Vorbis costs much more than reading raw samples. When the
+* cache is enabled (-pcm-cache[=MB]), the decoded samples of each sound
+* are saved with their format and rate into the quest write directory
+* ("pcm/<sound file>.pcm"). Next launches map this file into memory and
+* give it to OpenAL directly, as long as the hash of the encoded file and
+* the decoding options are unchanged.
+*
+* The total size of the cache is limited: the oldest files are deleted
+* to make room for new ones.
+*
+* The functions can be called from the preloading threads.
+*/
+class SoundCache
+{
+public:
+
+	static void initialize(int argc, char** argv);
+	static bool is_enabled();
+
+	static uint64_t get_hash(const char* buffer, size_t size, uint32_t options);
+	static bool load(const std::string& file_name, uint64_t hash, Sound::DecodedSound& decoded);
+	static void save(const std::string& file_name, uint64_t hash, const Sound::DecodedSound& decoded);
+
+private:
+
+	// we don't need to instantiate this class
+	SoundCache();
+
+	/**
+	* @brief Header of a cache file, followed by the samples.
+	*/
+	struct Header
+	{
+		char magic[8];			/**< identifies a cache file */
+		uint64_t hash;			/**< hash of the encoded file and of the decoding options */
+		uint32_t format;		/**< OpenAL format of the samples */
+		uint32_t sample_rate;	/**< number of samples per second */
+		uint64_t size;			/**< size of the samples in bytes */
+	};
+
+	static std::string get_cache_file_name(const std::string& file_name);
+	static void make_room(size_t size);
+	static void compute_cache_size();
+
+	static const char header_magic[8];	/**< first bytes of a cache file */
+	static bool enabled;				/**< indicates that -pcm-cache was passed */
+	static size_t max_size;				/**< maximum total size of the cache files in bytes */
+	static size_t cache_size;			/**< current total size of the cache files in bytes */
+	static bool cache_size_known;		/**< indicates that cache_size was computed */
+	static std::mutex mutex;			/**< protects the cache size and the writes */
+};
+
+#endif
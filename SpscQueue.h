@@ -0,0 +1,152 @@
+/** @file SpscQueue.h */
+
+#ifndef KQ_SPSC_QUEUE_H
+#define KQ_SPSC_QUEUE_H
+
+#include "Common.h"
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+/**
+* @brief A lock-free queue between exactly one producer thread and one consumer thread.
+*
+* The elements are stored in a ring of fixed capacity. Only the producer
+* calls push() and only the consumer calls pop(): each index is written by a
+* single thread, so no lock is needed and neither thread ever waits for the
+* other. push() fails when the queue is full and pop() when it is empty.
+*
+* The bulk versions copy several elements at once, which is what streaming
+* audio samples needs.
+*/
+template<typename T>
+class SpscQueue
+{
+public:
+
+	/**
+	* @brief Creates an empty queue.
+	* @param capacity Maximum number of elements in the queue.
+	*/
+	explicit SpscQueue(size_t capacity):
+		elements(capacity + 1),
+		read_index(0),
+		write_index(0)
+	{
+	}
+
+	/**
+	* @brief Returns the number of elements that can be popped.
+	*
+	* Exact for the consumer, a lower bound for the producer.
+	*
+	* @return The number of elements in the queue.
+	*/
+	size_t get_size() const
+	{
+		size_t write = write_index.load(std::memory_order_acquire);
+		size_t read = read_index.load(std::memory_order_acquire);
+		return (write + elements.size() - read) % elements.size();
+	}
+
+	/**
+	* @brief Returns the number of elements that can be pushed.
+	*
+	* Exact for the producer, a lower bound for the consumer.
+	*
+	* @return The free space in the queue.
+	*/
+	size_t get_free_space() const
+	{
+		return elements.size() - 1 - get_size();
+	}
+
+	/**
+	* @brief Adds an element (producer only).
+	* @param element The element to add.
+	* @return false if the queue is full.
+	*/
+	bool push(const T& element)
+	{
+		return push(&element, 1) == 1;
+	}
+
+	/**
+	* @brief Removes the oldest element (consumer only).
+	* @param element Receives the element.
+	* @return false if the queue is empty.
+	*/
+	bool pop(T& element)
+	{
+		return pop(&element, 1) == 1;
+	}
+
+	/**
+	* @brief Adds as many elements as possible (producer only).
+	* @param source The elements to add.
+	* @param count Number of elements to add.
+	* @return Number of elements added.
+	*/
+	size_t push(const T* source, size_t count)
+	{
+		size_t write = write_index.load(std::memory_order_relaxed);
+		size_t read = read_index.load(std::memory_order_acquire);
+		size_t capacity = elements.size();
+		size_t free_space = (read + capacity - write - 1) % capacity;
+		if(count > free_space)
+		{
+			count = free_space;
+		}
+
+		// at most two contiguous parts: until the end of the ring, then from the beginning
+		size_t first_part = std::min(count, capacity - write);
+		std::copy(source, source + first_part, elements.begin() + write);
+		std::copy(source + first_part, source + count, elements.begin());
+		write_index.store((write + count) % capacity, std::memory_order_release);
+		return count;
+	}
+
+	/**
+	* @brief Removes as many elements as possible (consumer only).
+	* @param destination Receives the elements.
+	* @param count Maximum number of elements to remove.
+	* @return Number of elements removed.
+	*/
+	size_t pop(T* destination, size_t count)
+	{
+		size_t read = read_index.load(std::memory_order_relaxed);
+		size_t write = write_index.load(std::memory_order_acquire);
+		size_t capacity = elements.size();
+		size_t size = (write + capacity - read) % capacity;
+		if(count > size)
+		{
+			count = size;
+		}
+
+		size_t first_part = std::min(count, capacity - read);
+		std::copy(elements.begin() + read, elements.begin() + read + first_part, destination);
+		std::copy(elements.begin(), elements.begin() + (count - first_part), destination + first_part);
+		read_index.store((read + count) % capacity, std::memory_order_release);
+		return count;
+	}
+
+	/**
+	* @brief Removes all elements (consumer only, or when no other thread uses the queue).
+	*/
+	void clear()
+	{
+		read_index.store(write_index.load(std::memory_order_acquire), std::memory_order_release);
+	}
+
+private:
+
+	SpscQueue(const SpscQueue& other);				// not copyable
+	SpscQueue& operator=(const SpscQueue& other);
+
+	std::vector<T> elements;			/**< The ring (one slot is always left empty). */
+	std::atomic<size_t> read_index;		/**< Next element to pop, written by the consumer only. */
+	std::atomic<size_t> write_index;	/**< Next slot to push, written by the producer only. */
+};
+
+#endif
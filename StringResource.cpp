@@ -1,7 +1,8 @@
 /** @file StringResource.cpp */
 
 #include "StringResource.h"
-#include "FileTools.h"
+#include "DataFileReader.h"
+#include <iostream>
 
 std::map<std::string, std::string> StringResource::strings;
 
@@ -24,45 +25,30 @@ StringResource::~StringResource()
 *
 * The strings are loaded from the language-specific file "text/strings.dat"
 * and stored into memory for future access by get_string().
+* Each line is a key, then spaces or tabs, then the value.
 */
 void StringResource::initialize()
 {
 	strings.clear();
-	std::istream& file = FileTools::data_file_open("text/strings.dat", false);
-	std::string line;
+	DataFileReader file("text/strings.dat");
+	StringSlice line;
 
 	//Read each line
-	int i = 0;
-	while(std::getline(file, line))
+	while(file.read_line(line))
 	{
-		i++;
-
 		//Ignore empty lines or lines starting with '#'
-		size_t index = line.find_first_of(" \t");
-		
-		//Insert Debug assertion
-
-		std::string key = line.substr(0, index);
-
-		//get the value
-		do
+		if(line.is_empty() || line[0] == '#')
 		{
-			index++;
-		} while (index < line.size() && (line[index] == ' ' || line[index] == '\t' || line[index] == '\r'));
-
-		//Insert Debug assertion
+			continue;
+		}
 
-		std::string value = line.substr(index);
+		//the key is the first word, the value is the rest of the line
+		StringSlice key;
+		line.next_token(key);
+		line.trim_left();
 
-		if(value[value.size() - 1] == '\r')
-		{
-			//If the file has DOS line endings, remove the trailing '\r'
-			value = value.substr(0, value.size() - 1);
-		}
-		strings[key] = value;
+		strings[key.to_string()] = line.to_string();
 	}
-
-	FileTools::data_file_close(file);
 }
 
 /**
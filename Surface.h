@@ -17,6 +17,7 @@ class Surface: public Drawable
 	friend class TextSurface;
 	friend class VideoManager;
 	friend class PixelBits;
+	friend class InputRecording;
 
 private:
 	SDL_Surface* internal_surface;				 /**< the SDL_Surface encapsulated */
@@ -2,6 +2,7 @@
 
 #include "lua.hpp"
 #include "LuaContext.h"
+#include "LuaBinding.h"
 #include "Color.h"
 #include "Surface.h"
 
@@ -34,6 +35,7 @@ void LuaContext::register_surface_module()
 		{ NULL, NULL }
 	};
 	register_type(surface_module_name, methods, metamethods);
+	LuaType<Surface>::bind(l, surface_module_name);
 }
 
 /**
@@ -45,7 +47,18 @@ void LuaContext::register_surface_module()
 */
 Surface& LuaContext::check_surface(lua_State* l, int index) 
 {
-  return static_cast<Surface&>(check_userdata(l, index, surface_module_name));
+  return LuaType<Surface>::check(l, index);
+}
+
+/**
+* @brief Returns whether a value is a userdata of type surface.
+* @param l a Lua context
+* @param index an index in the stack
+* @return true if the value at this index is a surface
+*/
+bool LuaContext::is_surface(lua_State* l, int index) 
+{
+  return LuaType<Surface>::is(l, index);
 }
 
 /**
@@ -3,6 +3,7 @@
 #include "System.h"
 #include "SDL.h"
 #include <iostream>
+#include <string>
 #include "VideoManager.h"
 #include "InputEvent.h"
 #include "FileTools.h"
@@ -10,13 +11,31 @@
 #include "Sprite.h"
 #include "Random.h"
 #include "Sound.h"
+#include "Clock.h"
 
-uint32_t System::ticks = 0;
+namespace
+{
+	RealClock real_clock;
+	VirtualClock virtual_clock;
+}
+
+Clock* System::clock = &real_clock;
+uint64_t System::ticks = 0;
 
 /** @brief Missing multiple initializations and destructors */
 
 void System::initialize(int argc, char** argv)
 {
+	//clock: -virtual-clock runs the engine on a clock that only advances by sleeping
+	for(int i = 1; i < argc; i++)
+	{
+		if(std::string(argv[i]) == "-virtual-clock")
+		{
+			set_clock(&virtual_clock);
+		}
+	}
+	ticks = clock->get_time_ns();
+
 	if((SDL_Init(SDL_INIT_VIDEO) == -1))
 	{
 		std::cout << "Could not initialize SDL: " << SDL_GetError();
@@ -61,21 +80,75 @@ void System::quit()
 
 void System::update()
 {
-	ticks = SDL_GetTicks();
-	//Sound::update();
+	ticks = clock->get_time_ns();
+	Sound::update();
+}
+
+/** @brief Returns the clock giving the time of the engine
+ *  @return the real clock or a virtual clock */
+
+Clock& System::get_clock()
+{
+	return *clock;
+}
+
+/** @brief Changes the clock giving the time of the engine
+ *
+ *  Call this before anything is scheduled: dates already computed
+ *  (timers, transitions...) refer to the previous clock.
+ *
+ *  @param clock the new clock, or NULL to use the real clock */
+
+void System::set_clock(Clock* clock)
+{
+	System::clock = (clock != NULL) ? clock : &real_clock;
+	ticks = System::clock->get_time_ns();
 }
 
-/** @brief Returns the number of milliseconds elapsed since the beginning of the program */
+/** @brief Returns the number of milliseconds elapsed since the beginning of the program
+ *
+ *  This wraps around after about 49 days: prefer now_ns() for new code. */
 
 uint32_t System::now()
+{
+	return uint32_t(ticks / 1000000);
+}
+
+/** @brief Returns the number of nanoseconds elapsed since the beginning of the program
+ *
+ *  This is the date of the engine clock at the last update. */
+
+uint64_t System::now_ns()
 {
 	return ticks;
 }
 
-/** @brief Makes the program sleep 
+/** @brief Returns the number of milliseconds elapsed since the beginning of the program,
+ *  read now instead of at the last update
+ *
+ *  Use this to measure durations within a cycle. This always reads the real clock,
+ *  even when the engine runs on a virtual clock. */
+
+uint32_t System::get_real_time()
+{
+	return uint32_t(real_clock.get_time_ns() / 1000000);
+}
+
+/** @brief Returns the number of nanoseconds elapsed since the beginning of the program,
+ *  read now from the real clock */
+
+uint64_t System::get_real_time_ns()
+{
+	return real_clock.get_time_ns();
+}
+
+/** @brief Makes the program sleep
+ *
+ *  With a virtual clock, this advances the clock instead of waiting.
+ *
  *  @param duration duration of the sleep in milliseconds */
 
 void System::sleep(uint32_t duration)
 {
-	SDL_Delay(duration);
+	clock->sleep(uint64_t(duration) * 1000000);
 }
\ No newline at end of file
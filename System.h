@@ -6,19 +6,28 @@
 #include "Common.h"
 #include <cstdint>
 
+class Clock;
+
 /** @brief Initializes all low level functions */
 
 class System
 {
 private:
-	static uint32_t ticks;
+	static Clock* clock;		/**< The clock giving the time of the engine. */
+	static uint64_t ticks;		/**< Date of the last update in nanoseconds. */
 
 public:
 	static void initialize(int argc, char** argv);
 	static void quit();
 	static void update();
 
+	static Clock& get_clock();
+	static void set_clock(Clock* clock);
+
 	static uint32_t now();
+	static uint64_t now_ns();
+	static uint32_t get_real_time();
+	static uint64_t get_real_time_ns();
 	static void sleep(uint32_t duration);
 };
 
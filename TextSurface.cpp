@@ -296,9 +296,9 @@ const std::string& TextSurface::get_text() {
 *
 * \param text the text to display (cannot be NULL)
 */
-void TextSurface::set_text(const std::string& text) {
+void TextSurface::set_text(const char* text) {
 
-  if (text != this->text) {
+  if (this->text != text) {
 
     // there is a change
     this->text = text;
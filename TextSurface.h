@@ -108,7 +108,7 @@ public:
     int get_y();
     void set_y(int y);
     const std::string& get_text();
-    void set_text(const std::string& text);
+    void set_text(const char* text);
     bool is_empty();
     void add_char(char c);
 
@@ -2,9 +2,11 @@
 
 #include "lua.hpp"
 #include "LuaContext.h"
+#include "LuaBinding.h"
 #include "TextSurface.h"
 #include "FileTools.h"
 #include "StringResource.h"
+#include <cstring>
 
 const std::string LuaContext::text_surface_module_name = "kq.text_surface";
 
@@ -36,24 +38,24 @@ void LuaContext::register_text_surface_module()
 	static const luaL_Reg methods[] = 
 	{
 		{ "create", text_surface_api_create },
+		{ "get_font", KQ_LUA_METHOD(&TextSurface::get_font) },
+		{ "set_font", KQ_LUA_METHOD(&TextSurface::set_font) },
+		{ "get_text", KQ_LUA_METHOD(&TextSurface::get_text) },
+		{ "set_text", KQ_LUA_METHOD(&TextSurface::set_text) },
+		{ "draw", drawable_api_draw },
+		{ "fade_out", drawable_api_fade_out },
 		/*{ "get_horizontal_alignment", text_surface_api_get_horizontal_alignment },
 		{ "set_horizontal_alignment", text_surface_api_set_horizontal_alignment },
 		{ "get_vertical_alignment", text_surface_api_get_vertical_alignment },
 		{ "set_vertical_alignment", text_surface_api_set_vertical_alignment },
-		{ "get_font", text_surface_api_get_font },
-		{ "set_font", text_surface_api_set_font },
 		{ "get_rendering_mode", text_surface_api_get_rendering_mode },
 		{ "set_rendering_mode", text_surface_api_set_rendering_mode },
 		{ "get_color", text_surface_api_get_color },
 		{ "set_color", text_surface_api_set_color },
-		{ "get_text", text_surface_api_get_text },
-		{ "set_text", text_surface_api_set_text },
 		{ "set_text_key", text_surface_api_set_text_key },
 		{ "get_size", text_surface_api_get_size },
-		{ "draw", drawable_api_draw },
 		{ "draw_region", drawable_api_draw_region },
 		{ "fade_in", drawable_api_fade_in },
-		{ "fade_out", drawable_api_fade_out },
 		{ "get_xy", drawable_api_get_xy },
 		{ "set_xy", drawable_api_set_xy },
 		{ "get_movement", drawable_api_get_movement },
@@ -67,6 +69,7 @@ void LuaContext::register_text_surface_module()
         { NULL, NULL }
     };
     register_type(text_surface_module_name, methods, metamethods);
+    LuaType<TextSurface>::bind(l, text_surface_module_name);
 }
 
 /**
@@ -94,39 +97,38 @@ int LuaContext::text_surface_api_create(lua_State* l)
 		lua_pushnil(l); //First key
 		while(lua_next(l, 1) != 0)
 		{
-			const std::string& key = luaL_checkstring(l, 2);
-			if (key == "font") 
+			const char* key = luaL_checkstring(l, 2);
+			if (std::strcmp(key, "font") == 0) 
 			{
 				const std::string& font_id = luaL_checkstring(l, 3);
 				text_surface->set_font(font_id);
 			}
-			else if (key == "rendering_mode")
+			else if (std::strcmp(key, "rendering_mode") == 0)
 			{
 				TextSurface::RenderingMode mode = check_enum<TextSurface::RenderingMode>(l, 3, rendering_mode_names);
 				text_surface->set_rendering_mode(mode);
 			}
-			else if (key == "horizontal_alignment") 
+			else if (std::strcmp(key, "horizontal_alignment") == 0) 
 			{
 				TextSurface::HorizontalAlignment alignment = check_enum<TextSurface::HorizontalAlignment>(l, 3, horizontal_alignment_names);
 				text_surface->set_horizontal_alignment(alignment);
 			}
-			else if (key == "vertical_alignment") 
+			else if (std::strcmp(key, "vertical_alignment") == 0) 
 			{
 				TextSurface::VerticalAlignment alignment =
 				check_enum<TextSurface::VerticalAlignment>(l, 3, vertical_alignment_names);
 				text_surface->set_vertical_alignment(alignment);
 			}
-			else if (key == "color") 
+			else if (std::strcmp(key, "color") == 0) 
 			{
 				Color color = check_color(l, 3);
 				text_surface->set_text_color(color);
 			}
-			else if (key == "text") 
+			else if (std::strcmp(key, "text") == 0) 
 			{
-				const std::string& text = luaL_checkstring(l, 3);
-				text_surface->set_text(text);
+				text_surface->set_text(luaL_checkstring(l, 3));
 			}
-			else if (key == "text_key") 
+			else if (std::strcmp(key, "text_key") == 0) 
 			{
 				const std::string& text_key = luaL_checkstring(l, 3);
 
@@ -135,7 +137,7 @@ int LuaContext::text_surface_api_create(lua_State* l)
 					delete text_surface;
 					std::cerr << "No value with key '" << text_key << "' in strings.dat\n";
 				}
-				text_surface->set_text(StringResource::get_string(text_key));
+				text_surface->set_text(StringResource::get_string(text_key).c_str());
 			}
 			else 
 			{
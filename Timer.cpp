@@ -4,6 +4,9 @@
 #include "Game.h"
 #include "LuaContext.h"
 #include "System.h"
+#include "TimerScheduler.h"
+
+const size_t Timer::not_scheduled = size_t(-1);
 
 //Just needs Sound in update()
 
@@ -12,11 +15,16 @@
 * @param delay duration of the timer in milliseconds
 */
 Timer::Timer(uint32_t delay):
-	expiration_date(System::now() + delay),
+	scheduler(NULL),
+	scheduler_index(not_scheduled),
+	delay(uint64_t(delay) * 1000000),
+	expiration_date(System::now_ns() + this->delay),
 	finished(false),
+	repeating(false),
 	suspended_with_map(false),
 	suspended(false),
 	when_suspended(0),
+	with_sound(false),
 	next_sound_date(0) 
 {
 }
@@ -26,6 +34,10 @@ Timer::Timer(uint32_t delay):
 */
 Timer::~Timer() 
 {
+  if (scheduler != NULL) 
+  {
+    scheduler->remove(*this);
+  }
 }
 
 /**
@@ -34,7 +46,7 @@ Timer::~Timer()
 */
 bool Timer::is_with_sound() 
 {
-  return next_sound_date != 0;
+  return with_sound;
 }
 
 /**
@@ -43,7 +55,13 @@ bool Timer::is_with_sound()
 */
 void Timer::set_with_sound(bool with_sound) 
 {
-  next_sound_date = with_sound ? System::now() : 0;
+  this->with_sound = with_sound;
+  next_sound_date = System::now_ns();
+
+  if (scheduler != NULL) 
+  {
+    scheduler->reschedule(*this);
+  }
 }
 
 /**
@@ -65,19 +83,23 @@ void Timer::set_suspended(bool suspended)
   if (suspended != this->suspended) {
     this->suspended = suspended;
 
-    uint32_t now = System::now();
+    uint64_t now = System::now_ns();
 
     if (suspended) {
       // the timer is being suspended
       when_suspended = now;
+      if (scheduler != NULL) {
+        scheduler->remove(*this);
+      }
     }
     else {
       // recalculate the expiration date
-      if (when_suspended != 0) {
-        expiration_date += now - when_suspended;
-        if (is_with_sound()) {
-          next_sound_date += now - when_suspended;
-        }
+      expiration_date += now - when_suspended;
+      if (is_with_sound()) {
+        next_sound_date += now - when_suspended;
+      }
+      if (scheduler != NULL && !finished) {
+        scheduler->add(*this);
       }
     }
   }
@@ -110,6 +132,96 @@ bool Timer::is_finished()
   return finished;
 }
 
+/**
+* @brief Returns the time remaining before the timer finishes.
+* @return The remaining time in milliseconds (0 if the timer is finished).
+*/
+uint32_t Timer::get_remaining_time() 
+{
+  if (finished) 
+  {
+    return 0;
+  }
+
+  uint64_t now = suspended ? when_suspended : System::now_ns();
+  return expiration_date > now ? uint32_t((expiration_date - now) / 1000000) : 0;
+}
+
+/**
+* @brief Changes the time remaining before the timer finishes.
+*
+* This has no effect on a finished timer.
+* The period of a repeating timer is not changed.
+*
+* @param remaining_time The new remaining time in milliseconds.
+*/
+void Timer::set_remaining_time(uint32_t remaining_time) 
+{
+  if (finished) 
+  {
+    return;
+  }
+
+  uint64_t now = suspended ? when_suspended : System::now_ns();
+  expiration_date = now + uint64_t(remaining_time) * 1000000;
+
+  if (scheduler != NULL) 
+  {
+    scheduler->reschedule(*this);
+  }
+}
+
+/**
+* @brief Returns whether the timer restarts automatically when finished.
+* @return true if the timer repeats.
+*/
+bool Timer::is_repeating() 
+{
+  return repeating;
+}
+
+/**
+* @brief Sets whether the timer restarts automatically when finished.
+*
+* The callback of a timer can also return true to repeat it once more.
+*
+* @param repeating true to repeat the timer.
+*/
+void Timer::set_repeating(bool repeating) 
+{
+  this->repeating = repeating;
+}
+
+/**
+* @brief Starts the timer again after it finished, for the same duration.
+*
+* The new expiration date is computed from the previous one rather than
+* from the current date, so that a repeating timer does not drift when
+* updates come late.
+*/
+void Timer::restart() 
+{
+  expiration_date += delay;
+  finished = false;
+}
+
+/**
+* @brief Returns the date when this timer needs to be updated next.
+*
+* This is the expiration date, or the date of the next clock sound if it
+* comes first.
+*
+* @return The date of the next event of this timer in nanoseconds.
+*/
+uint64_t Timer::get_next_date() 
+{
+  if (is_with_sound() && next_sound_date < expiration_date) 
+  {
+    return next_sound_date;
+  }
+  return expiration_date;
+}
+
 /**
 * @brief Needs Sound class
 */
@@ -122,28 +234,28 @@ void Timer::update()
   }
 
   // check the time
-  uint32_t now = System::now();
+  uint64_t now = System::now_ns();
   finished = (now >= expiration_date);
 
   // play the sound
   if (is_with_sound() && now >= next_sound_date) 
   {
-    uint32_t remaining_time = expiration_date - now;
-    if (remaining_time > 6000) 
+    uint64_t remaining_time = finished ? 0 : expiration_date - now;
+    if (remaining_time > 6000000000ULL) 
 	{
       //Sound::play("timer");
-      next_sound_date += 1000;
+      next_sound_date += 1000000000ULL;
     }
     else 
 	{
       //Sound::play("timer_hurry");
-      if (remaining_time > 2000) 
+      if (remaining_time > 2000000000ULL) 
 	  {
-        next_sound_date += 1000;
+        next_sound_date += 1000000000ULL;
       }
       else 
 	  {
-        next_sound_date += 250;
+        next_sound_date += 250000000ULL;
       }
     }
   }
@@ -21,6 +21,12 @@ public:
 	bool is_suspended_with_map();
 	void set_suspended_with_map(bool suspended_with_map);
 	bool is_finished();
+	uint32_t get_remaining_time();
+	void set_remaining_time(uint32_t remaining_time);
+	bool is_repeating();
+	void set_repeating(bool repeating);
+	void restart();
+	uint64_t get_next_date();
 
 	void update();
 	void notify_map_suspended(bool suspended);
@@ -28,15 +34,26 @@ public:
 	virtual const std::string& get_lua_type_name() const;
 
 private:
+	friend class TimerScheduler;
+
+	static const size_t not_scheduled;	/**< scheduler_index of a timer that is not in the heap */
+
+	//scheduling
+	TimerScheduler* scheduler;		/**< the scheduler that runs this timer, or NULL */
+	size_t scheduler_index;			/**< position of this timer in the heap of the scheduler */
+
 	//timer
-	uint32_t expiration_date;		/**< date when the timer is finished */
+	uint64_t delay;					/**< duration of the timer in ns (period if it repeats) */
+	uint64_t expiration_date;		/**< date when the timer is finished (System::now_ns()) */
 	bool finished;					/**< indicates that the timer is finished */
+	bool repeating;					/**< indicates that the timer restarts automatically when finished */
 
 	bool suspended_with_map;		/**< whether the timer should be suspended when the map is */
 	bool suspended;					/**< indicates whether the timer is suspended */
-	uint32_t when_suspended;		/**< date when the timer was suspended */
+	uint64_t when_suspended;		/**< date when the timer was suspended */
 
 	//sound
-	uint32_t next_sound_date;		/**< date when the next clock sound effect is played */
+	bool with_sound;				/**< indicates that a clock sound is played during the timer */
+	uint64_t next_sound_date;		/**< date when the next clock sound effect is played */
 };
 #endif
\ No newline at end of file
@@ -1,7 +1,12 @@
 /** @file TimerAPI.cpp */
 
 #include "LuaContext.h"
+#include "LuaBinding.h"
 #include "Timer.h"
+#include "System.h"
+#include <iostream>
+#include <vector>
+#include <algorithm>
 
 const std::string LuaContext::timer_module_name = "kq.timer";
 
@@ -18,14 +23,18 @@ void LuaContext::register_timer_module()
 
 	//Methods of the timer type
 	static const luaL_Reg methods[] = 
-	{/*
-      { "stop", timer_api_stop },
-      { "is_with_sound", timer_api_is_with_sound },
-      { "set_with_sound", timer_api_set_with_sound },
-      { "is_suspended", timer_api_is_suspended },
-      { "set_suspended", timer_api_set_suspended },
-      { "is_suspended_with_map", timer_api_is_suspended_with_map },
-      { "set_suspended_with_map", timer_api_set_suspended_with_map },*/
+	{
+      //{ "stop", timer_api_stop },
+      { "is_with_sound", KQ_LUA_METHOD(&Timer::is_with_sound) },
+      { "set_with_sound", KQ_LUA_METHOD(&Timer::set_with_sound) },
+      { "is_suspended", KQ_LUA_METHOD(&Timer::is_suspended) },
+      { "set_suspended", KQ_LUA_METHOD(&Timer::set_suspended) },
+      { "is_suspended_with_map", KQ_LUA_METHOD(&Timer::is_suspended_with_map) },
+      { "set_suspended_with_map", KQ_LUA_METHOD(&Timer::set_suspended_with_map) },
+      { "get_remaining_time", KQ_LUA_METHOD(&Timer::get_remaining_time) },
+      { "set_remaining_time", KQ_LUA_METHOD(&Timer::set_remaining_time) },
+      { "is_repeating", KQ_LUA_METHOD(&Timer::is_repeating) },
+      { "set_repeating", KQ_LUA_METHOD(&Timer::set_repeating) },
       { NULL, NULL }
     };
     static const luaL_Reg metamethods[] = 
@@ -34,6 +43,7 @@ void LuaContext::register_timer_module()
       { NULL, NULL }
     };
     register_type(timer_module_name, methods, metamethods);
+    LuaType<Timer>::bind(l, timer_module_name);
 
 }
 
@@ -84,6 +94,7 @@ void LuaContext::add_timer(Timer* timer, int context_index, int callback_index)
 	}
 	*/
 	timer->increment_refcount();
+	timer_scheduler.add(*timer);
 }
 
 /**
@@ -102,6 +113,7 @@ void LuaContext::remove_timer(Timer* timer)
       cancel_callback(timers[timer].callback_ref);
     }
     timers[timer].callback_ref = LUA_REFNIL;
+    timer_scheduler.remove(*timer);
     timers_to_remove.push_back(timer);
   }
 }
@@ -115,8 +127,6 @@ void LuaContext::remove_timer(Timer* timer)
 */
 void LuaContext::remove_timers(int context_index) 
 {
-  std::list<Timer*> timers_to_remove;
-
   const void* context;
   if (lua_type(l, context_index) == LUA_TUSERDATA) 
   {
@@ -139,6 +149,7 @@ void LuaContext::remove_timers(int context_index)
         destroy_ref(it->second.callback_ref);
       }
       it->second.callback_ref = LUA_REFNIL;
+      timer_scheduler.remove(*timer);
       timers_to_remove.push_back(timer);
     }
   }
@@ -149,6 +160,8 @@ void LuaContext::remove_timers(int context_index)
 */
 void LuaContext::destroy_timers() 
 {
+  timer_scheduler.clear();
+
   std::map<Timer*, LuaTimerData>::iterator it;
   for (it = timers.begin(); it != timers.end(); ++it) 
   {
@@ -164,24 +177,72 @@ void LuaContext::destroy_timers()
     }
   }
   timers.clear();
+  timers_to_remove.clear();
 }
 
 /**
-* @brief Updates all timers currently running for this script.
+* @brief Updates the timers whose next event has come.
+*
+* Only the timers due at this date are visited.
+* A timer that repeats (because it is set to, or because its callback
+* returned true) is restarted in place and fires at most once per update.
 */
 void LuaContext::update_timers() 
 {
-  // Update all timers.
-  std::map<Timer*, LuaTimerData>::iterator it;
-  for (it = timers.begin(); it != timers.end(); ++it) 
+  std::vector<Timer*> timers_restarted;
+
+  uint64_t now = System::now_ns();
+  Timer* timer = timer_scheduler.get_first();
+  while (timer != NULL && timer->get_next_date() <= now) 
   {
-    Timer* timer = it->first;
+    timer_scheduler.remove(*timer);
     timer->update();
-    if (timer->is_finished()) 
+    if (!timer->is_finished()) 
 	{
-      do_callback(it->second.callback_ref);
-      it->second.callback_ref = LUA_REFNIL;
-      timers_to_remove.push_back(timer);
+      // Only a clock sound was played: wait for the next event.
+      timer_scheduler.add(*timer);
+    }
+    else 
+	{
+      LuaTimerData& timer_data = timers[timer];
+      int callback_ref = timer_data.callback_ref;
+      timer_data.callback_ref = LUA_REFNIL;
+
+      bool repeat = timer->is_repeating();
+      push_callback(callback_ref);
+      if (call_function(0, 1, "timer callback")) 
+	  {
+        repeat = lua_toboolean(l, -1) || repeat;
+        lua_pop(l, 1);
+      }
+
+      // The callback may have stopped the timer.
+      bool removed = std::find(timers_to_remove.begin(), timers_to_remove.end(), timer) != timers_to_remove.end();
+      if (repeat && !removed) 
+	  {
+        timers[timer].callback_ref = callback_ref;
+        timer->restart();
+        timers_restarted.push_back(timer);
+      }
+      else 
+	  {
+        destroy_ref(callback_ref);
+        if (!removed) 
+		{
+          timers_to_remove.push_back(timer);
+        }
+      }
+    }
+    timer = timer_scheduler.get_first();
+  }
+
+  std::vector<Timer*>::const_iterator it3;
+  for (it3 = timers_restarted.begin(); it3 != timers_restarted.end(); ++it3) 
+  {
+    // A timer suspended by its callback is scheduled again when resumed.
+    if (!(*it3)->is_suspended()) 
+	{
+      timer_scheduler.add(**it3);
     }
   }
 
@@ -207,6 +268,59 @@ void LuaContext::update_timers()
   timers_to_remove.clear();
 }
 
+namespace {
+
+/**
+* @brief Callback of the timers created by the benchmark.
+* @return Number of values to return to Lua.
+*/
+int benchmark_callback(lua_State* /* l */)
+{
+  return 0;
+}
+
+}
+
+/**
+* @brief Measures the cost of updating timers while many are pending.
+*
+* Starts nb_timers timers that expire in one hour, then times 1000 updates
+* of the timers with one timer firing at each update. The per-update cost
+* should not depend on nb_timers.
+*
+* @param nb_timers Number of pending timers.
+*/
+void LuaContext::run_timer_benchmark(int nb_timers) 
+{
+  static const int nb_updates = 1000;
+
+  push_main(l);
+  lua_pushcfunction(l, benchmark_callback);
+  for (int i = 0; i < nb_timers; i++) 
+  {
+    add_timer(new Timer(3600000 + i), -2, -1);
+  }
+
+  uint32_t start_date = System::get_real_time();
+  for (int i = 0; i < nb_updates; i++) 
+  {
+    // One timer expires at each update.
+    add_timer(new Timer(0), -2, -1);
+    System::update();
+    update_timers();
+  }
+  uint32_t duration = System::get_real_time() - start_date;
+  lua_pop(l, 2);
+
+  std::cout << "Timer benchmark: " << nb_updates << " updates with " << nb_timers << " pending timers in "
+	  << duration << " ms, " << 1000.0 * duration / nb_updates << " us per update" << std::endl;
+
+  push_main(l);
+  remove_timers(-1);
+  lua_pop(l, 1);
+  update_timers();
+}
+
 int LuaContext::timer_api_start(lua_State* l)
 {
 	//Parameters: [context] delay callback
@@ -240,7 +354,11 @@ int LuaContext::timer_api_start(lua_State* l)
 	}
 	//Now the first parameter is the context
 
-	uint32_t delay = uint32_t(luaL_checkint(l, 2));
+	int delay = luaL_checkint(l, 2);
+	if(delay < 0)
+	{
+		luaL_argerror(l, 2, "the delay must be positive or zero");
+	}
 	luaL_checktype(l, 3, LUA_TFUNCTION);
 	
 
@@ -254,7 +372,7 @@ int LuaContext::timer_api_start(lua_State* l)
 	else
 	{
 		//Create the timer.
-		Timer* timer = new Timer(delay);
+		Timer* timer = new Timer(uint32_t(delay));
 		lua_context.add_timer(timer, 1, 3);
 		push_timer(l, *timer);
 	}
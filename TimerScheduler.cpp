@@ -0,0 +1,170 @@
+/** @file TimerScheduler.cpp */
+
+#include "TimerScheduler.h"
+#include "Timer.h"
+
+/**
+* @brief Creates an empty scheduler.
+*/
+TimerScheduler::TimerScheduler()
+{
+}
+
+/**
+* @brief Schedules a timer.
+*
+* Nothing happens if the timer is already scheduled.
+* A suspended timer is not scheduled: it schedules itself again when it
+* is resumed.
+*
+* @param timer The timer to schedule at its next date.
+*/
+void TimerScheduler::add(Timer& timer)
+{
+	timer.scheduler = this;
+	if(timer.scheduler_index != Timer::not_scheduled || timer.is_suspended())
+	{
+		return;
+	}
+
+	heap.push_back(&timer);
+	timer.scheduler_index = heap.size() - 1;
+	sift_up(timer.scheduler_index);
+}
+
+/**
+* @brief Unschedules a timer.
+*
+* The timer remembers this scheduler: it will schedule itself again when
+* it is resumed.
+*
+* @param timer The timer to unschedule (nothing happens if it is not scheduled).
+*/
+void TimerScheduler::remove(Timer& timer)
+{
+	size_t index = timer.scheduler_index;
+	if(index == Timer::not_scheduled || timer.scheduler != this)
+	{
+		return;
+	}
+
+	Timer* last = heap.back();
+	heap.pop_back();
+	timer.scheduler_index = Timer::not_scheduled;
+
+	if(last != &timer)
+	{
+		move(index, last);
+		sift_down(index);
+		sift_up(last->scheduler_index);
+	}
+}
+
+/**
+* @brief Moves a timer after the date of its next event has changed.
+* @param timer A scheduled timer (nothing happens if it is not scheduled).
+*/
+void TimerScheduler::reschedule(Timer& timer)
+{
+	if(timer.scheduler_index == Timer::not_scheduled || timer.scheduler != this)
+	{
+		return;
+	}
+
+	sift_up(timer.scheduler_index);
+	sift_down(timer.scheduler_index);
+}
+
+/**
+* @brief Unschedules all timers.
+*/
+void TimerScheduler::clear()
+{
+	std::vector<Timer*>::iterator it;
+	for(it = heap.begin(); it != heap.end(); ++it)
+	{
+		(*it)->scheduler_index = Timer::not_scheduled;
+		(*it)->scheduler = NULL;
+	}
+	heap.clear();
+}
+
+/**
+* @brief Returns the timer whose next event comes first.
+* @return The first timer, or NULL if no timer is scheduled.
+*/
+Timer* TimerScheduler::get_first()
+{
+	return heap.empty() ? NULL : heap.front();
+}
+
+/**
+* @brief Returns the number of scheduled timers.
+* @return The number of timers.
+*/
+size_t TimerScheduler::get_nb_timers()
+{
+	return heap.size();
+}
+
+/**
+* @brief Puts a timer at a position of the heap.
+* @param index The position.
+* @param timer The timer.
+*/
+void TimerScheduler::move(size_t index, Timer* timer)
+{
+	heap[index] = timer;
+	timer->scheduler_index = index;
+}
+
+/**
+* @brief Moves a timer up until its parent comes before it.
+* @param index Position of the timer.
+*/
+void TimerScheduler::sift_up(size_t index)
+{
+	Timer* timer = heap[index];
+	uint64_t date = timer->get_next_date();
+	while(index > 0)
+	{
+		size_t parent = (index - 1) / 2;
+		if(heap[parent]->get_next_date() <= date)
+		{
+			break;
+		}
+		move(index, heap[parent]);
+		index = parent;
+	}
+	move(index, timer);
+}
+
+/**
+* @brief Moves a timer down until its children come after it.
+* @param index Position of the timer.
+*/
+void TimerScheduler::sift_down(size_t index)
+{
+	Timer* timer = heap[index];
+	uint64_t date = timer->get_next_date();
+	size_t size = heap.size();
+	while(true)
+	{
+		size_t child = 2 * index + 1;
+		if(child >= size)
+		{
+			break;
+		}
+		if(child + 1 < size && heap[child + 1]->get_next_date() < heap[child]->get_next_date())
+		{
+			child++;
+		}
+		if(date <= heap[child]->get_next_date())
+		{
+			break;
+		}
+		move(index, heap[child]);
+		index = child;
+	}
+	move(index, timer);
+}
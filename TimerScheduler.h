@@ -0,0 +1,41 @@
+/** @file TimerScheduler.h */
+
+#ifndef KQ_TIMER_SCHEDULER_H
+#define KQ_TIMER_SCHEDULER_H
+
+#include "Common.h"
+#include <vector>
+#include <cstddef>
+
+/**
+* @brief Running timers ordered by the date of their next event.
+*
+* This is a binary min-heap. Each timer knows its position in the heap, so
+* that it can be removed or re-keyed in O(log n) when it is suspended,
+* resumed or changed. The main loop only looks at the first timers:
+* the cost of an update does not depend on the number of pending timers.
+*
+* Suspended and finished timers are not in the heap.
+*/
+class TimerScheduler
+{
+public:
+	TimerScheduler();
+
+	void add(Timer& timer);
+	void remove(Timer& timer);
+	void reschedule(Timer& timer);
+	void clear();
+
+	Timer* get_first();
+	size_t get_nb_timers();
+
+private:
+	void move(size_t index, Timer* timer);
+	void sift_up(size_t index);
+	void sift_down(size_t index);
+
+	std::vector<Timer*> heap;	/**< The scheduled timers. */
+};
+
+#endif
@@ -98,7 +98,7 @@ void Transition::set_suspended(bool suspended)
     this->suspended = suspended;
     if (suspended) 
 	{
-      when_suspended = System::now();
+      when_suspended = System::now_ns();
     }
     notify_suspended(suspended);
   }
@@ -108,7 +108,7 @@ void Transition::set_suspended(bool suspended)
 * @brief Returns the date when this transition was suspended if it is.
 * @return The date when this transition was suspended or 0.
 */
-uint32_t Transition::get_when_suspended() const 
+uint64_t Transition::get_when_suspended() const 
 {
   return when_suspended;
 }
\ No newline at end of file
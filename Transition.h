@@ -75,7 +75,7 @@ public:
 protected:
 	Transition(Direction direction);
 	Surface* get_previous_surface() const;
-	uint32_t get_when_suspended() const;
+	uint64_t get_when_suspended() const;
 
 	/**
 	* @brief Notifies the transition effect that it was just suspended
@@ -90,7 +90,7 @@ private:
     Surface* previous_surface;		/**< During an in transition, this is the surface that was displayed
 									 * when the out transition was played. */
     bool suspended;					/**< Indicates that the transition is currently paused. */
-    uint32_t when_suspended;		/**< Date when the transition was suspended. */
+    uint64_t when_suspended;		/**< Date when the transition was suspended (System::now_ns()). */
 
 };
 
@@ -52,7 +52,7 @@ void TransitionFade::set_delay(uint32_t delay)
 void TransitionFade::start() 
 {
   alpha = alpha_start;
-  next_frame_date = System::now();
+  next_frame_date = System::now_ns();
 }
 
 /**
@@ -82,7 +82,7 @@ void TransitionFade::notify_suspended(bool suspended)
 {
   if (!suspended) 
   {
-    next_frame_date += System::now() - get_when_suspended();
+    next_frame_date += System::now_ns() - get_when_suspended();
   }
 }
 
@@ -98,13 +98,13 @@ void TransitionFade::update()
     return;
   }
 
-  uint32_t now = System::now();
+  uint64_t now = System::now_ns();
 
   // update the transition effect if needed
   while (now >= next_frame_date && !finished) 
   {
     alpha += alpha_increment;
-    next_frame_date += delay; // 20 ms between two frame updates (default)
+    next_frame_date += uint64_t(delay) * 1000000; // 20 ms between two frame updates (default)
 
     if (dst_surface != NULL) 
 	{
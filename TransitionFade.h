@@ -16,7 +16,7 @@ private:
     int alpha_increment;
     int alpha; // current alpha value of the surface
 
-    uint32_t next_frame_date;
+    uint64_t next_frame_date;
     uint32_t delay;
 
     Surface* dst_surface;
@@ -49,6 +49,7 @@ class Treasure;
 class Map;
 class MapLoader;
 class Timer;
+class TimerScheduler;
 class GameoverSequence;
 class Camera;
 class Dialog;
@@ -58,6 +59,7 @@ class DialogBox;
 // Lua
 class ExportableToLua;
 class LuaContext;
+class LuaWorker;
 
 // drawable objects
 class Sprite;
@@ -0,0 +1,227 @@
+/** @file WorkerAPI.cpp */
+
+#include "LuaContext.h"
+#include "LuaBinding.h"
+#include "LuaWorker.h"
+#include "FileTools.h"
+#include "lua.hpp"
+
+const std::string LuaContext::worker_module_name = "kq.worker";
+
+void LuaContext::register_worker_module()
+{
+	//Functions of kq.worker
+	static const luaL_Reg functions[] =
+	{
+		{ "start", worker_api_start },
+		{ NULL, NULL }
+	};
+	register_functions(worker_module_name, functions);
+
+	//Methods of the worker type
+	static const luaL_Reg methods[] =
+	{
+		{ "send", worker_api_send },
+		{ "stop", worker_api_stop },
+		{ "is_running", KQ_LUA_METHOD(&LuaWorker::is_running) },
+		{ NULL, NULL }
+	};
+	static const luaL_Reg metamethods[] =
+	{
+		{ "__gc", userdata_meta_gc },
+		{ NULL, NULL }
+	};
+	register_type(worker_module_name, methods, metamethods);
+	LuaType<LuaWorker>::bind(l, worker_module_name);
+}
+
+/**
+* @brief Pushes a worker userdata onto the stack.
+* @param l A Lua context.
+* @param worker A worker.
+*/
+void LuaContext::push_worker(lua_State* l, LuaWorker& worker)
+{
+	push_userdata(l, worker);
+}
+
+/**
+* @brief Registers a worker started by a script.
+* @param worker A worker.
+* @param callback_index Index of the function to call with each message
+* posted by the worker.
+*/
+void LuaContext::add_worker(LuaWorker* worker, int callback_index)
+{
+	lua_pushvalue(l, callback_index);
+	workers[worker] = create_ref();
+	worker->increment_refcount();
+}
+
+/**
+* @brief Stops a worker and unregisters it.
+*
+* The worker is only destroyed at the next update, so this function can
+* be called from a callback of this worker.
+*
+* @param worker A worker.
+*/
+void LuaContext::remove_worker(LuaWorker* worker)
+{
+	worker->stop();
+	workers_to_remove.push_back(worker);
+}
+
+/**
+* @brief Stops and destroys immediately all workers.
+*/
+void LuaContext::destroy_workers()
+{
+	std::map<LuaWorker*, int>::iterator it;
+	for(it = workers.begin(); it != workers.end(); ++it)
+	{
+		LuaWorker* worker = it->first;
+		worker->stop();
+		destroy_ref(it->second);
+		worker->decrement_refcount();
+		if(worker->get_refcount() == 0)
+		{
+			delete worker;
+		}
+	}
+	workers.clear();
+	workers_to_remove.clear();
+}
+
+/**
+* @brief Delivers the messages posted by the workers to their callback.
+*/
+void LuaContext::update_workers()
+{
+	std::map<LuaWorker*, int>::iterator it;
+	for(it = workers.begin(); it != workers.end(); ++it)
+	{
+		std::list<LuaMessage> messages;
+		it->first->receive(messages);
+
+		std::list<LuaMessage>::const_iterator it2;
+		for(it2 = messages.begin(); it2 != messages.end(); ++it2)
+		{
+			push_ref(l, it->second);
+			it2->push(l);
+			call_function(1, 0, "worker callback");
+		}
+	}
+
+	// Destroy the ones that should be removed.
+	std::list<LuaWorker*>::iterator it3;
+	for(it3 = workers_to_remove.begin(); it3 != workers_to_remove.end(); ++it3)
+	{
+		LuaWorker* worker = *it3;
+		it = workers.find(worker);
+		if(it != workers.end())
+		{
+			destroy_ref(it->second);
+			workers.erase(it);
+			worker->decrement_refcount();
+			if(worker->get_refcount() == 0)
+			{
+				delete worker;
+			}
+		}
+	}
+	workers_to_remove.clear();
+}
+
+/**
+* @brief Implementation of kq.worker.start().
+* @param l The Lua context that is calling this function.
+* @return Number of values to return to Lua.
+*/
+int LuaContext::worker_api_start(lua_State* l)
+{
+	//Parameters: script_name callback
+	const char* script_name = luaL_checkstring(l, 1);
+	luaL_checktype(l, 2, LUA_TFUNCTION);
+
+	// Lua errors must not skip the destructors: raise them out of this block.
+	LuaWorker* worker = NULL;
+	{
+		std::string file_name = script_name;
+		if(!FileTools::data_file_exists(file_name))
+		{
+			file_name += ".lua";
+		}
+
+		if(FileTools::data_file_exists(file_name))
+		{
+			size_t size;
+			char* buffer;
+			FileTools::data_file_open_buffer(file_name, &buffer, &size);
+			worker = new LuaWorker(file_name, std::string(buffer, size));
+			FileTools::data_file_close_buffer(buffer);
+		}
+	}
+
+	if(worker == NULL)
+	{
+		luaL_argerror(l, 1, "no such script");
+	}
+
+	LuaContext& lua_context = get_lua_context(l);
+	lua_context.add_worker(worker, 2);
+	worker->start();
+
+	push_worker(l, *worker);
+	return 1;
+}
+
+/**
+* @brief Implementation of worker:send().
+* @param l The Lua context that is calling this function.
+* @return Number of values to return to Lua.
+*/
+int LuaContext::worker_api_send(lua_State* l)
+{
+	LuaWorker& worker = LuaType<LuaWorker>::check(l, 1);
+	luaL_checkany(l, 2);
+
+	// As in worker_api_start(), no Lua error inside this block.
+	bool sent;
+	{
+		LuaMessage message;
+		std::string error;
+		sent = message.read(l, 2, error);
+		if(sent)
+		{
+			worker.send(message);
+		}
+		else
+		{
+			lua_pushstring(l, error.c_str());
+		}
+	}
+
+	if(!sent)
+	{
+		luaL_argerror(l, 2, lua_tostring(l, -1));
+	}
+	return 0;
+}
+
+/**
+* @brief Implementation of worker:stop().
+* @param l The Lua context that is calling this function.
+* @return Number of values to return to Lua.
+*/
+int LuaContext::worker_api_stop(lua_State* l)
+{
+	LuaWorker& worker = LuaType<LuaWorker>::check(l, 1);
+
+	LuaContext& lua_context = get_lua_context(l);
+	if(lua_context.workers.find(&worker) != lua_context.workers.end())
+	{
+		lua_context.remove_worker(&worker);
+	}
+	return 0;
+}